@@ -21,10 +21,15 @@
  *
  */
 
+/* for memfd_create() and file sealing */
+#define _GNU_SOURCE
+
 #include "config.h"
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -47,6 +52,19 @@
 #include "cinnamon-settings-profile.h"
 #include "csd-clipboard-manager.h"
 
+#define CLIPBOARD_SCHEMA "org.cinnamon.settings-daemon.plugins.clipboard"
+#define CLIPBOARD_MEMORY_BUDGET_KEY "memory-budget-kb"
+#define CLIPBOARD_SPILL_THRESHOLD_KEY "spill-threshold-kb"
+#define CLIPBOARD_SAVE_ALL_TARGETS_KEY "save-all-targets"
+#define CLIPBOARD_PRIORITY_TARGETS_KEY "priority-targets"
+
+/* How long an exiting application may be kept waiting for SAVE_TARGETS
+ * to complete; whatever has not arrived by then is dropped. */
+#define SAVE_TARGETS_TIMEOUT_MS 2000
+
+/* Upper bound on the INCR size hint we preallocate for */
+#define INCR_SIZE_HINT_MAX (256 * 1024 * 1024)
+
 #define CSD_CLIPBOARD_MANAGER_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), CSD_TYPE_CLIPBOARD_MANAGER, CsdClipboardManagerPrivate))
 
 struct CsdClipboardManagerPrivate
@@ -56,18 +74,43 @@ struct CsdClipboardManagerPrivate
         Window   window;
         Time     timestamp;
 
-        List    *contents;
-        List    *conversions;
+        List       *contents;
+        GHashTable *contents_index;     /* target Atom → TargetData */
+        guint       n_incr_contents;    /* contents still being received */
+        GHashTable *conversions;        /* (requestor, property) → IncrConversion */
+
+        GSettings  *settings;
+        GHashTable *stores;             /* content → TargetStore, for the current contents */
+        gsize       stores_heap_size;   /* bytes of the current contents kept in the heap */
+
+        guint       save_timeout_id;
+        Atom        synth_targets[2];   /* dropped UTF-8 text aliases to serve from the saved text */
+        int         n_synth_targets;
 
         Window   requestor;
         Atom     property;
         Time     time;
 };
 
+/* The bytes of a saved target. Targets with identical contents (say
+ * several encodings of the same ASCII text) share a store, and large
+ * stores are moved out of the heap into a sealed memfd mapping.
+ */
 typedef struct
 {
         unsigned char *data;
         unsigned long  length;
+        guint          hash;
+        gboolean       mapped;
+        int            refcount;
+} TargetStore;
+
+typedef struct
+{
+        unsigned char *data;            /* points into store once complete */
+        unsigned long  length;
+        unsigned long  capacity;        /* allocated size of data while receiving INCR */
+        TargetStore   *store;
         Atom           target;
         Atom           type;
         int            format;
@@ -106,16 +149,178 @@ target_data_ref (TargetData *data)
         return data;
 }
 
+static void
+target_store_unref (TargetStore *store)
+{
+        store->refcount--;
+        if (store->refcount == 0) {
+                if (store->mapped)
+                        munmap (store->data, store->length);
+                else
+                        free (store->data);
+                free (store);
+        }
+}
+
 static void
 target_data_unref (TargetData *data)
 {
         data->refcount--;
         if (data->refcount == 0) {
-                free (data->data);
+                if (data->store)
+                        target_store_unref (data->store);
+                else
+                        free (data->data);
                 free (data);
         }
 }
 
+static guint
+target_store_hash (gconstpointer key)
+{
+        const TargetStore *store = key;
+
+        return store->hash;
+}
+
+static gboolean
+target_store_equal (gconstpointer a,
+                    gconstpointer b)
+{
+        const TargetStore *store1 = a;
+        const TargetStore *store2 = b;
+
+        return (store1->length == store2->length &&
+                memcmp (store1->data, store2->data, store1->length) == 0);
+}
+
+/* FNV-1a */
+static guint
+clipboard_hash_data (const unsigned char *data,
+                     unsigned long        length)
+{
+        guint32 hash = 2166136261u;
+        unsigned long i;
+
+        for (i = 0; i < length; i++) {
+                hash ^= data[i];
+                hash *= 16777619u;
+        }
+
+        return hash;
+}
+
+/* Copies @data into an anonymous sealed file and maps it read-only;
+ * returns NULL if that isn't possible. */
+static unsigned char *
+clipboard_spill_data (const unsigned char *data,
+                      unsigned long        length)
+{
+        unsigned char *map = NULL;
+        unsigned long  written;
+        ssize_t        n;
+        int            fd;
+
+#if HAVE_MEMFD_CREATE
+        fd = memfd_create ("csd-clipboard", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+        {
+                gchar *path;
+
+                path = g_build_filename (g_get_user_runtime_dir (), "csd-clipboard-XXXXXX", NULL);
+                fd = g_mkstemp_full (path, O_RDWR | O_CLOEXEC, 0600);
+                if (fd >= 0)
+                        unlink (path);
+                g_free (path);
+        }
+#endif
+        if (fd < 0)
+                return NULL;
+
+        for (written = 0; written < length; written += n) {
+                n = write (fd, data + written, length - written);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                n = 0;
+                                continue;
+                        }
+                        goto out;
+                }
+        }
+
+#if HAVE_MEMFD_CREATE
+        fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+
+        map = mmap (NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+                map = NULL;
+out:
+        close (fd);
+
+        return map;
+}
+
+/* Moves the data of a completely received target into a (possibly
+ * shared) store. */
+static void
+target_data_store (CsdClipboardManager *manager,
+                   TargetData          *tdata)
+{
+        CsdClipboardManagerPrivate *p = manager->priv;
+        TargetStore  key;
+        TargetStore *store;
+        gsize        budget;
+        gsize        threshold;
+        unsigned char *map;
+
+        if (tdata->data == NULL || tdata->store != NULL)
+                return;
+
+        key.data = tdata->data;
+        key.length = tdata->length;
+        key.hash = clipboard_hash_data (tdata->data, tdata->length);
+
+        store = g_hash_table_lookup (p->stores, &key);
+        if (store != NULL) {
+                free (tdata->data);
+                store->refcount++;
+                goto done;
+        }
+
+        store = (TargetStore *) malloc (sizeof (TargetStore));
+        store->data = tdata->data;
+        store->length = tdata->length;
+        store->hash = key.hash;
+        store->mapped = FALSE;
+        store->refcount = 1;
+
+        budget = (gsize) g_settings_get_int (p->settings, CLIPBOARD_MEMORY_BUDGET_KEY) * 1024;
+        threshold = (gsize) g_settings_get_int (p->settings, CLIPBOARD_SPILL_THRESHOLD_KEY) * 1024;
+
+        if (store->length > 0 &&
+            (store->length > threshold || p->stores_heap_size + store->length > budget)) {
+                map = clipboard_spill_data (store->data, store->length);
+                if (map != NULL) {
+                        free (store->data);
+                        store->data = map;
+                        store->mapped = TRUE;
+                } else {
+                        g_debug ("Failed to move %lu bytes of clipboard data out of memory", store->length);
+                }
+        }
+
+        if (!store->mapped)
+                p->stores_heap_size += store->length;
+
+        g_hash_table_add (p->stores, store);
+
+done:
+        tdata->store = store;
+        tdata->data = store->data;
+        tdata->capacity = 0;
+}
+
 static void
 conversion_free (IncrConversion *rdata)
 {
@@ -125,6 +330,25 @@ conversion_free (IncrConversion *rdata)
         free (rdata);
 }
 
+static guint
+conversion_hash (gconstpointer key)
+{
+        const IncrConversion *rdata = key;
+
+        return (guint) rdata->requestor * 31 + (guint) rdata->property;
+}
+
+static gboolean
+conversion_equal (gconstpointer a,
+                  gconstpointer b)
+{
+        const IncrConversion *rdata1 = a;
+        const IncrConversion *rdata2 = b;
+
+        return (rdata1->requestor == rdata2->requestor &&
+                rdata1->property == rdata2->property);
+}
+
 static void
 send_selection_notify (CsdClipboardManager *manager,
                        Bool                 success)
@@ -196,11 +420,160 @@ clipboard_bytes_per_item (int format)
 static void
 free_contents (CsdClipboardManager *manager)
 {
+        /* stores only dedup within one set of contents; conversions
+         * in flight keep theirs alive through the target data */
+        g_hash_table_remove_all (manager->priv->stores);
+        manager->priv->stores_heap_size = 0;
+
+        g_hash_table_remove_all (manager->priv->contents_index);
+        manager->priv->n_incr_contents = 0;
+
         list_foreach (manager->priv->contents, (Callback)target_data_unref, NULL);
         list_free (manager->priv->contents);
         manager->priv->contents = NULL;
 }
 
+static TargetData *
+find_content_target (CsdClipboardManager *manager,
+                     Atom                 target)
+{
+        return g_hash_table_lookup (manager->priv->contents_index,
+                                    GSIZE_TO_POINTER (target));
+}
+
+static void
+add_content (CsdClipboardManager *manager,
+             TargetData          *tdata)
+{
+        manager->priv->contents = list_prepend (manager->priv->contents, tdata);
+        g_hash_table_insert (manager->priv->contents_index,
+                             GSIZE_TO_POINTER (tdata->target), tdata);
+}
+
+static void
+remove_content (CsdClipboardManager *manager,
+                TargetData          *tdata)
+{
+        g_hash_table_remove (manager->priv->contents_index,
+                             GSIZE_TO_POINTER (tdata->target));
+        manager->priv->contents = list_remove (manager->priv->contents, tdata);
+        target_data_unref (tdata);
+}
+
+/* Serves the UTF-8 text targets we didn't fetch from the saved text */
+static void
+synthesize_text_targets (CsdClipboardManager *manager)
+{
+        TargetData *source;
+        TargetData *tdata;
+        int         i;
+
+        source = find_content_target (manager, XA_UTF8_STRING);
+        if (source == NULL || source->store == NULL)
+                source = find_content_target (manager, XA_TEXT_PLAIN_UTF8);
+        if (source == NULL || source->store == NULL)
+                goto out;
+
+        for (i = 0; i < manager->priv->n_synth_targets; i++) {
+                if (find_content_target (manager, manager->priv->synth_targets[i]))
+                        continue;
+
+                tdata = (TargetData *) malloc (sizeof (TargetData));
+                tdata->store = source->store;
+                tdata->store->refcount++;
+                tdata->data = source->data;
+                tdata->length = source->length;
+                tdata->capacity = 0;
+                tdata->target = manager->priv->synth_targets[i];
+                tdata->type = source->type;
+                tdata->format = source->format;
+                tdata->refcount = 1;
+                add_content (manager, tdata);
+        }
+
+out:
+        manager->priv->n_synth_targets = 0;
+}
+
+static void
+cancel_save_timeout (CsdClipboardManager *manager)
+{
+        if (manager->priv->save_timeout_id != 0) {
+                g_source_remove (manager->priv->save_timeout_id);
+                manager->priv->save_timeout_id = 0;
+        }
+}
+
+static void
+finish_save_targets (CsdClipboardManager *manager,
+                     Bool                 success)
+{
+        cancel_save_timeout (manager);
+
+        if (success)
+                synthesize_text_targets (manager);
+
+        send_selection_notify (manager, success);
+
+        if (!success)
+                free_contents (manager);
+
+        clipboard_manager_watch_cb (manager,
+                                    manager->priv->requestor,
+                                    False,
+                                    0,
+                                    NULL);
+        manager->priv->requestor = None;
+}
+
+static gboolean
+save_targets_timeout_cb (CsdClipboardManager *manager)
+{
+        List       *list;
+        List       *next;
+        TargetData *tdata;
+
+        manager->priv->save_timeout_id = 0;
+
+        if (manager->priv->n_incr_contents == 0) {
+                /* the owner never answered our TARGETS or MULTIPLE request */
+                g_debug ("Clipboard owner did not answer in time, not saving the clipboard");
+                finish_save_targets (manager, False);
+                return FALSE;
+        }
+
+        /* keep what arrived in time and let the owner go */
+        g_debug ("Dropping %u clipboard targets still being received",
+                 manager->priv->n_incr_contents);
+
+        for (list = manager->priv->contents; list; list = next) {
+                next = list->next;
+                tdata = (TargetData *) list->data;
+                if (tdata->type == XA_INCR)
+                        remove_content (manager, tdata);
+        }
+        manager->priv->n_incr_contents = 0;
+
+        finish_save_targets (manager, True);
+
+        return FALSE;
+}
+
+static gboolean
+is_priority_target (Atom  target,
+                    Atom *priority,
+                    int   n_priority)
+{
+        int i;
+
+        for (i = 0; i < n_priority; i++) {
+                if (priority[i] == target)
+                        return TRUE;
+        }
+
+        return FALSE;
+}
+
 static void
 save_targets (CsdClipboardManager *manager,
               Atom                *save_targets,
@@ -209,25 +582,51 @@ save_targets (CsdClipboardManager *manager,
         int         nout, i;
         Atom       *multiple;
         TargetData *tdata;
+        gboolean    save_all;
+        gchar     **priority_names = NULL;
+        Atom       *priority = NULL;
+        int         n_priority = 0;
+
+        save_all = g_settings_get_boolean (manager->priv->settings, CLIPBOARD_SAVE_ALL_TARGETS_KEY);
+        if (!save_all) {
+                priority_names = g_settings_get_strv (manager->priv->settings, CLIPBOARD_PRIORITY_TARGETS_KEY);
+                n_priority = g_strv_length (priority_names);
+                priority = g_new0 (Atom, MAX (n_priority, 1));
+                if (n_priority > 0)
+                        XInternAtoms (manager->priv->display, priority_names, n_priority, False, priority);
+        }
+
+        manager->priv->n_synth_targets = 0;
 
         multiple = (Atom *) malloc (2 * nitems * sizeof (Atom));
 
         nout = 0;
         for (i = 0; i < nitems; i++) {
+                if (!save_all && !is_priority_target (save_targets[i], priority, n_priority)) {
+                        if ((save_targets[i] == XA_UTF8_STRING ||
+                             save_targets[i] == XA_TEXT_PLAIN_UTF8) &&
+                            manager->priv->n_synth_targets < (int) G_N_ELEMENTS (manager->priv->synth_targets))
+                                manager->priv->synth_targets[manager->priv->n_synth_targets++] = save_targets[i];
+                        continue;
+                }
+
                 if (save_targets[i] != XA_TARGETS &&
                     save_targets[i] != XA_MULTIPLE &&
                     save_targets[i] != XA_DELETE &&
                     save_targets[i] != XA_INSERT_PROPERTY &&
                     save_targets[i] != XA_INSERT_SELECTION &&
-                    save_targets[i] != XA_PIXMAP) {
+                    save_targets[i] != XA_PIXMAP &&
+                    !find_content_target (manager, save_targets[i])) {
                         tdata = (TargetData *) malloc (sizeof (TargetData));
                         tdata->data = NULL;
                         tdata->length = 0;
+                        tdata->capacity = 0;
+                        tdata->store = NULL;
                         tdata->target = save_targets[i];
                         tdata->type = None;
                         tdata->format = 0;
                         tdata->refcount = 1;
-                        manager->priv->contents = list_prepend (manager->priv->contents, tdata);
+                        add_content (manager, tdata);
 
                         multiple[nout++] = save_targets[i];
                         multiple[nout++] = save_targets[i];
@@ -235,6 +634,8 @@ save_targets (CsdClipboardManager *manager,
         }
 
         XFree (save_targets);
+        g_strfreev (priority_names);
+        g_free (priority);
 
         XChangeProperty (manager->priv->display, manager->priv->window,
                          XA_MULTIPLE, XA_ATOM_PAIR,
@@ -246,28 +647,6 @@ save_targets (CsdClipboardManager *manager,
                            manager->priv->window, manager->priv->time);
 }
 
-static int
-find_content_target (TargetData *tdata,
-                     Atom        target)
-{
-        return tdata->target == target;
-}
-
-static int
-find_content_type (TargetData *tdata,
-                   Atom        type)
-{
-        return tdata->type == type;
-}
-
-static int
-find_conversion_requestor (IncrConversion *rdata,
-                           XEvent         *xev)
-{
-        return (rdata->requestor == xev->xproperty.window &&
-                rdata->property == xev->xproperty.atom);
-}
-
 static void
 get_property (TargetData          *tdata,
               CsdClipboardManager *manager)
@@ -292,25 +671,60 @@ get_property (TargetData          *tdata,
                             &data);
 
         if (type == None) {
+                g_hash_table_remove (manager->priv->contents_index,
+                                     GSIZE_TO_POINTER (tdata->target));
                 manager->priv->contents = list_remove (manager->priv->contents, tdata);
                 free (tdata);
         } else if (type == XA_INCR) {
                 tdata->type = type;
                 tdata->length = 0;
+                manager->priv->n_incr_contents++;
+
+                /* the INCR property carries a lower bound of the size,
+                 * which lets us allocate the buffer once up-front */
+                if (format == 32 && length >= 1)
+                        tdata->capacity = MIN (((unsigned long *) data)[0], INCR_SIZE_HINT_MAX) + 1;
+
                 XFree (data);
         } else {
                 tdata->type = type;
                 tdata->data = data;
                 tdata->length = length * clipboard_bytes_per_item (format);
                 tdata->format = format;
+
+                target_data_store (manager, tdata);
+        }
+}
+
+/* Appends an INCR chunk, growing the buffer geometrically so that a
+ * large transfer is not copied over and over. The data is kept NUL
+ * terminated, as Xlib does for properties. */
+static void
+target_data_append (TargetData    *tdata,
+                    unsigned char *data,
+                    unsigned long  length)
+{
+        unsigned long needed;
+
+        needed = tdata->length + length + 1;
+        if (tdata->data == NULL) {
+                /* first chunk, trust the size hint if there was one */
+                tdata->capacity = MAX (tdata->capacity, needed);
+                tdata->data = malloc (tdata->capacity);
+        } else if (needed > tdata->capacity) {
+                tdata->capacity = MAX (needed, tdata->capacity * 2);
+                tdata->data = realloc (tdata->data, tdata->capacity);
         }
+
+        memcpy (tdata->data + tdata->length, data, length);
+        tdata->length += length;
+        tdata->data[tdata->length] = '\0';
 }
 
 static Bool
 receive_incrementally (CsdClipboardManager *manager,
                        XEvent              *xev)
 {
-        List          *list;
         TargetData    *tdata;
         Atom           type;
         int            format;
@@ -320,14 +734,10 @@ receive_incrementally (CsdClipboardManager *manager,
         if (xev->xproperty.window != manager->priv->window)
                 return False;
 
-        list = list_find (manager->priv->contents,
-                          (ListFindFunc) find_content_target, (void *) xev->xproperty.atom);
-
-        if (!list)
+        tdata = find_content_target (manager, xev->xproperty.atom);
+        if (!tdata)
                 return False;
 
-        tdata = (TargetData *) list->data;
-
         if (tdata->type != XA_INCR)
                 return False;
 
@@ -342,24 +752,27 @@ receive_incrementally (CsdClipboardManager *manager,
                 tdata->type = type;
                 tdata->format = format;
 
-                if (!list_find (manager->priv->contents,
-                                (ListFindFunc) find_content_type, (void *)XA_INCR)) {
+                /* give back what an overestimated size hint or the
+                 * last doubling left unused */
+                if (tdata->data != NULL && tdata->capacity > tdata->length + 1) {
+                        tdata->data = realloc (tdata->data, tdata->length + 1);
+                        tdata->capacity = tdata->length + 1;
+                }
+
+                if (type != XA_INCR) {
+                        manager->priv->n_incr_contents--;
+                        target_data_store (manager, tdata);
+                }
+
+                if (manager->priv->n_incr_contents == 0) {
                         /* all incremental transfers done */
-                        send_selection_notify (manager, True);
-                        manager->priv->requestor = None;
+                        finish_save_targets (manager, True);
                 }
 
                 XFree (data);
         } else {
-                if (!tdata->data) {
-                        tdata->data = data;
-                        tdata->length = length;
-                } else {
-                        tdata->data = realloc (tdata->data, tdata->length + length + 1);
-                        memcpy (tdata->data + tdata->length, data, length + 1);
-                        tdata->length += length;
-                        XFree (data);
-                }
+                target_data_append (tdata, data, length);
+                XFree (data);
         }
 
         return True;
@@ -369,20 +782,19 @@ static Bool
 send_incrementally (CsdClipboardManager *manager,
                     XEvent              *xev)
 {
-        List           *list;
+        IncrConversion  key;
         IncrConversion *rdata;
         unsigned long   length;
         unsigned long   items;
         unsigned char  *data;
         gsize           bytes_per_item;
 
-        list = list_find (manager->priv->conversions,
-                          (ListFindFunc) find_conversion_requestor, xev);
-        if (list == NULL)
+        key.requestor = xev->xproperty.window;
+        key.property = xev->xproperty.atom;
+        rdata = g_hash_table_lookup (manager->priv->conversions, &key);
+        if (rdata == NULL)
                 return False;
 
-        rdata = (IncrConversion *) list->data;
-
         bytes_per_item = clipboard_bytes_per_item (rdata->data->format);
         if (bytes_per_item == 0)
                 return False;
@@ -407,8 +819,8 @@ send_incrementally (CsdClipboardManager *manager,
                                             PropertyChangeMask,
                                             NULL);
 
-                manager->priv->conversions = list_remove (manager->priv->conversions, rdata);
-                conversion_free (rdata);
+                /* frees rdata */
+                g_hash_table_remove (manager->priv->conversions, rdata);
         }
 
         return True;
@@ -468,6 +880,11 @@ convert_clipboard_manager (CsdClipboardManager *manager,
                         manager->priv->property = xev->xselectionrequest.property;
                         manager->priv->time = xev->xselectionrequest.time;
 
+                        cancel_save_timeout (manager);
+                        manager->priv->save_timeout_id = g_timeout_add (SAVE_TARGETS_TIMEOUT_MS,
+                                                                        (GSourceFunc) save_targets_timeout_cb,
+                                                                        manager);
+
                         if (type == None)
                                 XConvertSelection (manager->priv->display, XA_CLIPBOARD,
                                                    XA_TARGETS, XA_TARGETS,
@@ -514,7 +931,7 @@ convert_clipboard_target (IncrConversion      *rdata,
         XWindowAttributes atts;
 
         if (rdata->target == XA_TARGETS) {
-                n_targets = list_length (manager->priv->contents) + 2;
+                n_targets = g_hash_table_size (manager->priv->contents_index) + 2;
                 targets = (Atom *) malloc (n_targets * sizeof (Atom));
 
                 n_targets = 0;
@@ -536,14 +953,12 @@ convert_clipboard_target (IncrConversion      *rdata,
                 gsize bytes_per_item;
 
                 /* Convert from stored CLIPBOARD data */
-                list = list_find (manager->priv->contents,
-                                  (ListFindFunc) find_content_target, (void *) rdata->target);
+                tdata = find_content_target (manager, rdata->target);
 
                 /* We got a target that we don't support */
-                if (!list)
+                if (!tdata)
                         return;
 
-                tdata = (TargetData *)list->data;
                 if (tdata->type == XA_INCR) {
                         /* we haven't completely received this target yet  */
                         rdata->property = None;
@@ -594,9 +1009,18 @@ static void
 collect_incremental (IncrConversion      *rdata,
                      CsdClipboardManager *manager)
 {
-        if (rdata->offset >= 0)
-                manager->priv->conversions = list_prepend (manager->priv->conversions, rdata);
-        else {
+        if (rdata->offset >= 0) {
+                /* a requestor reusing the property of an unfinished
+                 * transfer aborts that transfer */
+                if (g_hash_table_contains (manager->priv->conversions, rdata))
+                        clipboard_manager_watch_cb (manager,
+                                                    rdata->requestor,
+                                                    False,
+                                                    PropertyChangeMask,
+                                                    NULL);
+
+                g_hash_table_replace (manager->priv->conversions, rdata, rdata);
+        } else {
                 if (rdata->data) {
                         target_data_unref (rdata->data);
                         rdata->data = NULL;
@@ -700,6 +1124,7 @@ clipboard_manager_process_event (CsdClipboardManager *manager,
         switch (xev->xany.type) {
         case DestroyNotify:
                 if (xev->xdestroywindow.window == manager->priv->requestor) {
+                        cancel_save_timeout (manager);
                         free_contents (manager);
 
                         clipboard_manager_watch_cb (manager,
@@ -735,6 +1160,7 @@ clipboard_manager_process_event (CsdClipboardManager *manager,
                 }
                 if (xev->xselectionclear.selection == XA_CLIPBOARD) {
                         /* We lost the clipboard selection */
+                        cancel_save_timeout (manager);
                         free_contents(manager);
                         clipboard_manager_watch_cb (manager,
                                                     manager->priv->requestor,
@@ -752,6 +1178,10 @@ clipboard_manager_process_event (CsdClipboardManager *manager,
                         return False;
 
                 if (xev->xselection.selection == XA_CLIPBOARD) {
+                        /* a conversion we gave up on in save_targets_timeout_cb() */
+                        if (manager->priv->requestor == None)
+                                return True;
+
                         /* a CLIPBOARD conversion is done */
                         if (xev->xselection.property == XA_TARGETS) {
                                 XGetWindowProperty (xev->xselection.display,
@@ -780,27 +1210,13 @@ clipboard_manager_process_event (CsdClipboardManager *manager,
                                                          XA_ATOM, 32, PropModeReplace,
                                                          (unsigned char *)&XA_NULL, 1);
 
-                                if (!list_find (manager->priv->contents,
-                                                (ListFindFunc)find_content_type, (void *)XA_INCR)) {
+                                if (manager->priv->n_incr_contents == 0) {
                                         /* all transfers done */
-                                        send_selection_notify (manager, True);
-                                        clipboard_manager_watch_cb (manager,
-                                                                    manager->priv->requestor,
-                                                                    False,
-                                                                    0,
-                                                                    NULL);
-                                        manager->priv->requestor = None;
+                                        finish_save_targets (manager, True);
                                 }
                         }
                         else if (xev->xselection.property == None) {
-                                send_selection_notify (manager, False);
-                                free_contents (manager);
-                                clipboard_manager_watch_cb (manager,
-                                                            manager->priv->requestor,
-                                                            False,
-                                                            0,
-                                                            NULL);
-                                manager->priv->requestor = None;
+                                finish_save_targets (manager, False);
                         }
 
                         return True;
@@ -890,7 +1306,6 @@ start_clipboard_idle_cb (CsdClipboardManager *manager)
         }
 
         manager->priv->contents = NULL;
-        manager->priv->conversions = NULL;
         manager->priv->requestor = None;
 
         manager->priv->window = XCreateSimpleWindow (manager->priv->display,
@@ -956,6 +1371,9 @@ csd_clipboard_manager_start (CsdClipboardManager *manager,
 {
         cinnamon_settings_profile_start (NULL);
 
+        if (manager->priv->settings == NULL)
+                manager->priv->settings = g_settings_new (CLIPBOARD_SCHEMA);
+
         manager->priv->start_idle_id = g_idle_add ((GSourceFunc) start_clipboard_idle_cb, manager);
 
         cinnamon_settings_profile_end (NULL);
@@ -968,6 +1386,8 @@ csd_clipboard_manager_stop (CsdClipboardManager *manager)
 {
         g_debug ("Stopping clipboard manager");
 
+        cancel_save_timeout (manager);
+
         if (manager->priv->window != None) {
                 clipboard_manager_watch_cb (manager,
                                             manager->priv->window,
@@ -978,11 +1398,7 @@ csd_clipboard_manager_stop (CsdClipboardManager *manager)
                 manager->priv->window = None;
         }
 
-        if (manager->priv->conversions != NULL) {
-                list_foreach (manager->priv->conversions, (Callback) conversion_free, NULL);
-                list_free (manager->priv->conversions);
-                manager->priv->conversions = NULL;
-        }
+        g_hash_table_remove_all (manager->priv->conversions);
 
         if (manager->priv->contents != NULL) {
                 free_contents (manager);
@@ -1006,6 +1422,12 @@ csd_clipboard_manager_init (CsdClipboardManager *manager)
 
         manager->priv->display = GDK_DISPLAY_XDISPLAY (gdk_display_get_default ());
 
+        manager->priv->contents_index = g_hash_table_new (g_direct_hash, g_direct_equal);
+        manager->priv->stores = g_hash_table_new (target_store_hash, target_store_equal);
+        manager->priv->conversions = g_hash_table_new_full (conversion_hash,
+                                                            conversion_equal,
+                                                            (GDestroyNotify) conversion_free,
+                                                            NULL);
 }
 
 static void
@@ -1022,6 +1444,11 @@ csd_clipboard_manager_finalize (GObject *object)
 
         csd_clipboard_manager_stop(clipboard_manager);
 
+        g_hash_table_destroy (clipboard_manager->priv->contents_index);
+        g_hash_table_destroy (clipboard_manager->priv->conversions);
+        g_hash_table_destroy (clipboard_manager->priv->stores);
+        g_clear_object (&clipboard_manager->priv->settings);
+
         if (clipboard_manager->priv->start_idle_id !=0) {
             g_source_remove (clipboard_manager->priv->start_idle_id);
             clipboard_manager->priv->start_idle_id = 0;
@@ -37,7 +37,9 @@ Atom XA_MULTIPLE;
 Atom XA_NULL;
 Atom XA_SAVE_TARGETS;
 Atom XA_TARGETS;
+Atom XA_TEXT_PLAIN_UTF8;
 Atom XA_TIMESTAMP;
+Atom XA_UTF8_STRING;
 
 unsigned long SELECTION_MAX_SIZE = 0;
 
@@ -62,7 +64,9 @@ init_atoms (Display *display)
   XA_NULL = XInternAtom (display, "NULL", False);
   XA_SAVE_TARGETS = XInternAtom (display, "SAVE_TARGETS", False);
   XA_TARGETS = XInternAtom (display, "TARGETS", False);
+  XA_TEXT_PLAIN_UTF8 = XInternAtom (display, "text/plain;charset=utf-8", False);
   XA_TIMESTAMP = XInternAtom (display, "TIMESTAMP", False);
+  XA_UTF8_STRING = XInternAtom (display, "UTF8_STRING", False);
   
   max_request_size = XExtendedMaxRequestSize (display);
   if (max_request_size == 0)
@@ -38,7 +38,9 @@ extern Atom XA_MULTIPLE;
 extern Atom XA_NULL;
 extern Atom XA_SAVE_TARGETS;
 extern Atom XA_TARGETS;
+extern Atom XA_TEXT_PLAIN_UTF8;
 extern Atom XA_TIMESTAMP;
+extern Atom XA_UTF8_STRING;
 
 extern unsigned long SELECTION_MAX_SIZE;
 
@@ -29,6 +29,7 @@
 #include "csd-color-state.h"
 #include "csd-night-light.h"
 #include "csd-night-light-common.h"
+#include "tz-coords.h"
 
 GMainLoop *mainloop;
 
@@ -409,6 +410,40 @@ ccm_test_frac_day (void)
         g_assert_true (csd_night_light_frac_day_is_between (0.5, 0.5, 0.5));
 }
 
+static void
+ccm_test_timezone_coords (void)
+{
+        gdouble lat, lon;
+        guint i;
+
+        /* every zone.tab entry is found, which also checks the sort order */
+        for (i = 0; i < G_N_ELEMENTS (tz_coord_list); i++) {
+                g_assert_true (csd_night_light_get_timezone_coords (tz_coord_list[i].timezone, &lat, &lon));
+                g_assert_cmpfloat (lat, ==, tz_coord_list[i].latitude);
+                g_assert_cmpfloat (lon, ==, tz_coord_list[i].longitude);
+        }
+
+        /* every alias resolves to the city of the zone it links to */
+        for (i = 0; i < G_N_ELEMENTS (tz_alias_list); i++) {
+                const TZCoords *coords = &tz_coord_list[tz_alias_list[i].index];
+
+                g_assert_cmpuint (tz_alias_list[i].index, <, G_N_ELEMENTS (tz_coord_list));
+                g_assert_true (csd_night_light_get_timezone_coords (tz_alias_list[i].alias, &lat, &lon));
+                g_assert_cmpfloat (lat, ==, coords->latitude);
+                g_assert_cmpfloat (lon, ==, coords->longitude);
+        }
+
+        /* test an alias by name */
+        g_assert_true (csd_night_light_get_timezone_coords ("Asia/Calcutta", &lat, &lon));
+        g_assert_cmpfloat (lat, >, 22.5);
+        g_assert_cmpfloat (lat, <, 22.6);
+
+        /* test unknown and locationless zones */
+        g_assert_false (csd_night_light_get_timezone_coords ("UTC", &lat, &lon));
+        g_assert_false (csd_night_light_get_timezone_coords ("Nowhere/Atlantis", &lat, &lon));
+        g_assert_false (csd_night_light_get_timezone_coords (NULL, &lat, &lon));
+}
+
 int
 main (int argc, char **argv)
 {
@@ -423,6 +458,7 @@ main (int argc, char **argv)
         g_test_add_func ("/color/sunset-sunrise/fractional-timezone", ccm_test_sunset_sunrise_fractional_timezone);
         g_test_add_func ("/color/fractional-day", ccm_test_frac_day);
         g_test_add_func ("/color/night-light", ccm_test_night_light);
+        g_test_add_func ("/color/timezone-coords", ccm_test_timezone_coords);
 
         return g_test_run ();
 }
@@ -50,6 +50,7 @@ static const gchar introspection_xml[] =
 "    <property name='DisabledUntilTomorrow' type='b' access='readwrite'/>"
 "    <property name='Sunrise' type='d' access='read'/>"
 "    <property name='Sunset' type='d' access='read'/>"
+"    <property name='NextWakeup' type='x' access='read'/>"
 "  </interface>"
 "</node>";
 
@@ -202,6 +203,16 @@ on_disabled_until_tmw_notify (CsdNightLight *nlight,
                                g_variant_new_boolean (csd_night_light_get_disabled_until_tmw (manager->nlight)));
 }
 
+static void
+on_next_wakeup_notify (CsdNightLight *nlight,
+                       GParamSpec      *pspec,
+                       gpointer         user_data)
+{
+        CsdColorManager *manager = CSD_COLOR_MANAGER (user_data);
+        emit_property_changed (manager, "NextWakeup",
+                               g_variant_new_int64 (csd_night_light_get_next_wakeup (manager->nlight)));
+}
+
 static void
 on_temperature_notify (CsdNightLight *nlight,
                        GParamSpec      *pspec,
@@ -234,6 +245,8 @@ csd_color_manager_init (CsdColorManager *manager)
                           G_CALLBACK (on_temperature_notify), manager);
         g_signal_connect (manager->nlight, "notify::disabled-until-tmw",
                           G_CALLBACK (on_disabled_until_tmw_notify), manager);
+        g_signal_connect (manager->nlight, "notify::next-wakeup",
+                          G_CALLBACK (on_next_wakeup_notify), manager);
 }
 
 static void
@@ -362,6 +375,10 @@ handle_get_property (GDBusConnection *connection,
         if (g_strcmp0 (property_name, "Sunset") == 0)
                 return g_variant_new_double (csd_night_light_get_sunset (manager->nlight));
 
+        /* seconds since the epoch, or 0 if nothing is scheduled */
+        if (g_strcmp0 (property_name, "NextWakeup") == 0)
+                return g_variant_new_int64 (csd_night_light_get_next_wakeup (manager->nlight));
+
         g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
                      "Failed to get property: %s", property_name);
         return NULL;
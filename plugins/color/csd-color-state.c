@@ -45,6 +45,7 @@
 #define CSD_DBUS_BASE_INTERFACE "org.gnome.SettingsDaemon"
 
 static void ccm_session_set_gamma_for_all_devices (CsdColorState *state);
+static gboolean ccm_session_set_gamma_from_cache (CsdColorState *state);
 
 struct _CsdColorState
 {
@@ -58,6 +59,7 @@ struct _CsdColorState
         GdkWindow       *gdk_window;
         gboolean         session_is_active;
         GHashTable      *device_assign_hash;
+        GHashTable      *gamma_cache;
         guint            color_temperature;
 };
 
@@ -71,11 +73,17 @@ G_DEFINE_TYPE (CsdColorState, csd_color_state, G_TYPE_OBJECT)
 #define CCM_ICC_PROFILE_IN_X_VERSION_MAJOR      0
 #define CCM_ICC_PROFILE_IN_X_VERSION_MINOR      3
 
+/* the decoded VCGT of the profile last applied to an output, or a linear
+ * ramp if it has none, so that a color temperature change doesn't have
+ * to reload the ICC file; the buffers are reused for as long as the gamma
+ * size of the output doesn't change */
 typedef struct {
-        guint32          red;
-        guint32          green;
-        guint32          blue;
-} GnomeRROutputClutItem;
+        gchar           *profile_id;    /* NULL for a linear ramp */
+        gboolean         valid;
+        guint            size;
+        gfloat          *base;          /* red, green and blue planes */
+        guint16         *clut;          /* same layout, as sent to the crtc */
+} CcmSessionGammaCache;
 
 GQuark
 csd_color_state_error_quark (void)
@@ -180,6 +188,8 @@ csd_color_state_set_temperature (CsdColorState *state, guint temperature)
                 return;
 
         state->color_temperature = temperature;
+        if (ccm_session_set_gamma_from_cache (state))
+                return;
         ccm_session_set_gamma_for_all_devices (state);
 }
 
@@ -432,17 +442,68 @@ out:
         return ret;
 }
 
-static GPtrArray *
-ccm_session_generate_vcgt (CdProfile *profile, guint color_temperature, guint size)
+static void
+ccm_session_gamma_cache_free (CcmSessionGammaCache *cache)
+{
+        g_free (cache->profile_id);
+        g_free (cache->base);
+        g_free (cache->clut);
+        g_free (cache);
+}
+
+/* Returns the cache entry of @output_name sized for @size, reusing its
+ * buffers when possible. The entry is only valid if it already holds the
+ * ramp for @profile_id, otherwise the caller has to fill in the base. */
+static CcmSessionGammaCache *
+ccm_session_gamma_cache_get (CsdColorState *state,
+                             const gchar *output_name,
+                             const gchar *profile_id,
+                             guint size)
+{
+        CcmSessionGammaCache *cache;
+
+        cache = g_hash_table_lookup (state->gamma_cache, output_name);
+        if (cache != NULL && cache->size == size) {
+                if (g_strcmp0 (cache->profile_id, profile_id) != 0) {
+                        g_free (cache->profile_id);
+                        cache->profile_id = g_strdup (profile_id);
+                        cache->valid = FALSE;
+                }
+                return cache;
+        }
+
+        cache = g_new0 (CcmSessionGammaCache, 1);
+        cache->profile_id = g_strdup (profile_id);
+        cache->size = size;
+        cache->base = g_new (gfloat, size * 3);
+        cache->clut = g_new (guint16, size * 3);
+        g_hash_table_insert (state->gamma_cache, g_strdup (output_name), cache);
+        return cache;
+}
+
+static const gchar *
+ccm_session_get_profile_id (CdProfile *profile)
+{
+        const gchar *profile_id;
+
+        /* the checksum also catches a profile rewritten in place */
+        profile_id = cd_profile_get_metadata_item (profile,
+                                                   CD_PROFILE_METADATA_FILE_CHECKSUM);
+        if (profile_id == NULL)
+                profile_id = cd_profile_get_filename (profile);
+        return profile_id;
+}
+
+static gboolean
+ccm_session_generate_vcgt (CdProfile *profile, CcmSessionGammaCache *cache)
 {
-        GnomeRROutputClutItem *tmp;
-        GPtrArray *array = NULL;
         const cmsToneCurve **vcgt;
         cmsFloat32Number in;
         guint i;
+        guint size = cache->size;
         cmsHPROFILE lcms_profile;
         CdIcc *icc = NULL;
-        CdColorRGB temp;
+        gboolean ret = FALSE;
 
         /* invalid size */
         if (size == 0)
@@ -461,6 +522,55 @@ ccm_session_generate_vcgt (CdProfile *profile, guint color_temperature, guint si
                 goto out;
         }
 
+        /* decode the curves once, the color temperature is applied later */
+        for (i = 0; i < size; i++) {
+                in = (gdouble) i / (gdouble) (size - 1);
+                cache->base[i] = cmsEvalToneCurveFloat (vcgt[0], in);
+                cache->base[size + i] = cmsEvalToneCurveFloat (vcgt[1], in);
+                cache->base[2 * size + i] = cmsEvalToneCurveFloat (vcgt[2], in);
+        }
+        ret = TRUE;
+out:
+        if (icc != NULL)
+                g_object_unref (icc);
+        return ret;
+}
+
+/* kept as a plain loop over contiguous planes so that the compiler can
+ * vectorize it */
+static void
+ccm_session_scale_plane (guint16 * restrict clut,
+                         const gfloat * restrict base,
+                         gdouble factor,
+                         guint size)
+{
+        gfloat scale = factor * (gdouble) 0xffff;
+        guint i;
+
+        for (i = 0; i < size; i++)
+                clut[i] = base[i] * scale;
+}
+
+static gboolean
+ccm_session_gamma_cache_apply (GnomeRROutput *output,
+                               CcmSessionGammaCache *cache,
+                               guint color_temperature,
+                               GError **error)
+{
+        GnomeRRCrtc *crtc;
+        CdColorRGB temp;
+        guint size = cache->size;
+
+        crtc = gnome_rr_output_get_crtc (output);
+        if (crtc == NULL) {
+                g_set_error (error,
+                             CSD_COLOR_MANAGER_ERROR,
+                             CSD_COLOR_MANAGER_ERROR_FAILED,
+                             "failed to get ctrc for %s",
+                             gnome_rr_output_get_name (output));
+                return FALSE;
+        }
+
         /* get the color temperature */
         if (!cd_color_get_blackbody_rgb_full (color_temperature,
                                               &temp,
@@ -472,20 +582,62 @@ ccm_session_generate_vcgt (CdProfile *profile, guint color_temperature, guint si
                          color_temperature, temp.R, temp.G, temp.B);
         }
 
-        /* create array */
-        array = g_ptr_array_new_with_free_func (g_free);
-        for (i = 0; i < size; i++) {
-                in = (gdouble) i / (gdouble) (size - 1);
-                tmp = g_new0 (GnomeRROutputClutItem, 1);
-                tmp->red = cmsEvalToneCurveFloat(vcgt[0], in) * temp.R * (gdouble) 0xffff;
-                tmp->green = cmsEvalToneCurveFloat(vcgt[1], in) * temp.G * (gdouble) 0xffff;
-                tmp->blue = cmsEvalToneCurveFloat(vcgt[2], in) * temp.B * (gdouble) 0xffff;
-                g_ptr_array_add (array, tmp);
+        ccm_session_scale_plane (cache->clut, cache->base, temp.R, size);
+        ccm_session_scale_plane (cache->clut + size, cache->base + size, temp.G, size);
+        ccm_session_scale_plane (cache->clut + 2 * size, cache->base + 2 * size, temp.B, size);
+
+        gnome_rr_crtc_set_gamma (crtc, size,
+                                 cache->clut,
+                                 cache->clut + size,
+                                 cache->clut + 2 * size);
+        return TRUE;
+}
+
+/* Applies the current color temperature to all outputs using the cached
+ * gamma ramps, without asking colord or loading any profile. Returns
+ * FALSE if any active output has no cached ramp yet. */
+static gboolean
+ccm_session_set_gamma_from_cache (CsdColorState *state)
+{
+        CcmSessionGammaCache *cache;
+        GnomeRROutput **outputs;
+        GError *error = NULL;
+        const gchar *output_name;
+        guint i;
+
+        if (state->state_screen == NULL)
+                return FALSE;
+        outputs = gnome_rr_screen_list_outputs (state->state_screen);
+        if (outputs == NULL)
+                return FALSE;
+
+        for (i = 0; outputs[i] != NULL; i++) {
+                output_name = gnome_rr_output_get_name (outputs[i]);
+                if (!gnome_rr_output_is_connected (outputs[i]) ||
+                    gnome_rr_output_get_crtc (outputs[i]) == NULL ||
+                    g_str_has_prefix (output_name, "VNC-"))
+                        continue;
+                cache = g_hash_table_lookup (state->gamma_cache, output_name);
+                if (cache == NULL || !cache->valid)
+                        return FALSE;
         }
-out:
-        if (icc != NULL)
-                g_object_unref (icc);
-        return array;
+
+        for (i = 0; outputs[i] != NULL; i++) {
+                cache = g_hash_table_lookup (state->gamma_cache,
+                                             gnome_rr_output_get_name (outputs[i]));
+                if (cache == NULL || !cache->valid ||
+                    gnome_rr_output_get_crtc (outputs[i]) == NULL)
+                        continue;
+                if (!ccm_session_gamma_cache_apply (outputs[i], cache,
+                                                    state->color_temperature,
+                                                    &error)) {
+                        g_warning ("failed to set %s gamma tables: %s",
+                                   gnome_rr_output_get_name (outputs[i]),
+                                   error->message);
+                        g_clear_error (&error);
+                }
+        }
+        return TRUE;
 }
 
 static guint
@@ -504,143 +656,74 @@ gnome_rr_output_get_gamma_size (GnomeRROutput *output)
 }
 
 static gboolean
-ccm_session_output_set_gamma (GnomeRROutput *output,
-                              GPtrArray *array,
-                              GError **error)
-{
-        gboolean ret = TRUE;
-        guint16 *red = NULL;
-        guint16 *green = NULL;
-        guint16 *blue = NULL;
-        guint i;
-        GnomeRROutputClutItem *data;
-        GnomeRRCrtc *crtc;
-
-        /* no length? */
-        if (array->len == 0) {
-                ret = FALSE;
-                g_set_error_literal (error,
-                                     CSD_COLOR_MANAGER_ERROR,
-                                     CSD_COLOR_MANAGER_ERROR_FAILED,
-                                     "no data in the CLUT array");
-                goto out;
-        }
-
-        /* convert to a type X understands */
-        red = g_new (guint16, array->len);
-        green = g_new (guint16, array->len);
-        blue = g_new (guint16, array->len);
-        for (i = 0; i < array->len; i++) {
-                data = g_ptr_array_index (array, i);
-                red[i] = data->red;
-                green[i] = data->green;
-                blue[i] = data->blue;
-        }
-
-        /* send to LUT */
-        crtc = gnome_rr_output_get_crtc (output);
-        if (crtc == NULL) {
-                ret = FALSE;
-                g_set_error (error,
-                             CSD_COLOR_MANAGER_ERROR,
-                             CSD_COLOR_MANAGER_ERROR_FAILED,
-                             "failed to get ctrc for %s",
-                             gnome_rr_output_get_name (output));
-                goto out;
-        }
-        gnome_rr_crtc_set_gamma (crtc, array->len,
-                                 red, green, blue);
-out:
-        g_free (red);
-        g_free (green);
-        g_free (blue);
-        return ret;
-}
-
-static gboolean
-ccm_session_device_set_gamma (GnomeRROutput *output,
+ccm_session_device_set_gamma (CsdColorState *state,
+                              GnomeRROutput *output,
                               CdProfile *profile,
                               guint color_temperature,
                               GError **error)
 {
-        gboolean ret = FALSE;
+        CcmSessionGammaCache *cache;
+        const gchar *output_name;
         guint size;
-        GPtrArray *clut = NULL;
 
         /* create a lookup table */
         size = gnome_rr_output_get_gamma_size (output);
-        if (size == 0) {
-                ret = TRUE;
-                goto out;
-        }
-        clut = ccm_session_generate_vcgt (profile, color_temperature, size);
-        if (clut == NULL) {
-                g_set_error_literal (error,
-                                     CSD_COLOR_MANAGER_ERROR,
-                                     CSD_COLOR_MANAGER_ERROR_FAILED,
-                                     "failed to generate vcgt");
-                goto out;
+        if (size == 0)
+                return TRUE;
+
+        /* only parse the profile again if it changed */
+        output_name = gnome_rr_output_get_name (output);
+        cache = ccm_session_gamma_cache_get (state,
+                                             output_name,
+                                             ccm_session_get_profile_id (profile),
+                                             size);
+        if (!cache->valid) {
+                if (!ccm_session_generate_vcgt (profile, cache)) {
+                        g_hash_table_remove (state->gamma_cache, output_name);
+                        g_set_error_literal (error,
+                                             CSD_COLOR_MANAGER_ERROR,
+                                             CSD_COLOR_MANAGER_ERROR_FAILED,
+                                             "failed to generate vcgt");
+                        return FALSE;
+                }
+                cache->valid = TRUE;
         }
 
         /* apply the vcgt to this output */
-        ret = ccm_session_output_set_gamma (output, clut, error);
-        if (!ret)
-                goto out;
-out:
-        if (clut != NULL)
-                g_ptr_array_unref (clut);
-        return ret;
+        return ccm_session_gamma_cache_apply (output, cache, color_temperature, error);
 }
 
 static gboolean
-ccm_session_device_reset_gamma (GnomeRROutput *output,
+ccm_session_device_reset_gamma (CsdColorState *state,
+                                GnomeRROutput *output,
                                 guint color_temperature,
                                 GError **error)
 {
-        gboolean ret;
+        CcmSessionGammaCache *cache;
         guint i;
         guint size;
-        guint32 value;
-        GPtrArray *clut;
-        GnomeRROutputClutItem *data;
-        CdColorRGB temp;
 
-        /* create a linear ramp */
-        g_debug ("falling back to dummy ramp");
-        clut = g_ptr_array_new_with_free_func (g_free);
         size = gnome_rr_output_get_gamma_size (output);
-        if (size == 0) {
-                ret = TRUE;
-                goto out;
-        }
-
-        /* get the color temperature */
-        if (!cd_color_get_blackbody_rgb_full (color_temperature,
-                                              &temp,
-                                              CD_COLOR_BLACKBODY_FLAG_USE_PLANCKIAN)) {
-                g_warning ("failed to get blackbody for %uK", color_temperature);
-                cd_color_rgb_set (&temp, 1.0, 1.0, 1.0);
-        } else {
-                g_debug ("using reset gamma of %uK = %.1f,%.1f,%.1f",
-                         color_temperature, temp.R, temp.G, temp.B);
-        }
+        if (size == 0)
+                return TRUE;
 
-        for (i = 0; i < size; i++) {
-                value = (i * 0xffff) / (size - 1);
-                data = g_new0 (GnomeRROutputClutItem, 1);
-                data->red = value * temp.R;
-                data->green = value * temp.G;
-                data->blue = value * temp.B;
-                g_ptr_array_add (clut, data);
+        /* create a linear ramp */
+        g_debug ("falling back to dummy ramp");
+        cache = ccm_session_gamma_cache_get (state,
+                                             gnome_rr_output_get_name (output),
+                                             NULL,
+                                             size);
+        if (!cache->valid) {
+                for (i = 0; i < size; i++) {
+                        cache->base[i] = (gdouble) i / (gdouble) (size - 1);
+                        cache->base[size + i] = cache->base[i];
+                        cache->base[2 * size + i] = cache->base[i];
+                }
+                cache->valid = TRUE;
         }
 
-        /* apply the vcgt to this output */
-        ret = ccm_session_output_set_gamma (output, clut, error);
-        if (!ret)
-                goto out;
-out:
-        g_ptr_array_unref (clut);
-        return ret;
+        /* apply the ramp to this output */
+        return ccm_session_gamma_cache_apply (output, cache, color_temperature, error);
 }
 
 static GnomeRROutput *
@@ -817,7 +900,8 @@ ccm_session_device_assign_profile_connect_cb (GObject *object,
         /* create a vcgt for this icc file */
         ret = cd_profile_get_has_vcgt (profile);
         if (ret) {
-                ret = ccm_session_device_set_gamma (output,
+                ret = ccm_session_device_set_gamma (state,
+                                                    output,
                                                     profile,
                                                     state->color_temperature,
                                                     &error);
@@ -829,7 +913,8 @@ ccm_session_device_assign_profile_connect_cb (GObject *object,
                         goto out;
                 }
         } else {
-                ret = ccm_session_device_reset_gamma (output,
+                ret = ccm_session_device_reset_gamma (state,
+                                                      output,
                                                       state->color_temperature,
                                                       &error);
                 if (!ret) {
@@ -982,7 +1067,8 @@ ccm_session_device_assign_connect_cb (GObject *object,
                 }
 
                 /* reset, as we want linear profiles for profiling */
-                ret = ccm_session_device_reset_gamma (output,
+                ret = ccm_session_device_reset_gamma (state,
+                                                      output,
                                                       state->color_temperature,
                                                       &error);
                 if (!ret) {
@@ -1247,6 +1333,8 @@ gnome_rr_screen_output_removed_cb (GnomeRRScreen *screen,
                  gnome_rr_output_get_name (output));
         g_hash_table_remove (state->edid_cache,
                              gnome_rr_output_get_name (output));
+        g_hash_table_remove (state->gamma_cache,
+                             gnome_rr_output_get_name (output));
         cd_client_find_device_by_property (state->client,
                                            CD_DEVICE_METADATA_XRANDR_NAME,
                                            gnome_rr_output_get_name (output),
@@ -1345,6 +1433,8 @@ static void
 gnome_rr_screen_output_changed_cb (GnomeRRScreen *screen,
                                    CsdColorState *state)
 {
+        /* the crtcs and their gamma sizes may have changed */
+        g_hash_table_remove_all (state->gamma_cache);
         ccm_session_set_gamma_for_all_devices (state);
 }
 
@@ -1561,6 +1651,12 @@ csd_color_state_init (CsdColorState *state)
                                                           g_free,
                                                           NULL);
 
+        /* loading profiles is expensive, keyed by output name */
+        state->gamma_cache = g_hash_table_new_full (g_str_hash,
+                                                   g_str_equal,
+                                                   g_free,
+                                                   (GDestroyNotify) ccm_session_gamma_cache_free);
+
         /* default color temperature */
         state->color_temperature = CSD_COLOR_TEMPERATURE_DEFAULT;
 
@@ -1583,6 +1679,7 @@ csd_color_state_finalize (GObject *object)
         g_clear_object (&state->session);
         g_clear_pointer (&state->edid_cache, g_hash_table_destroy);
         g_clear_pointer (&state->device_assign_hash, g_hash_table_destroy);
+        g_clear_pointer (&state->gamma_cache, g_hash_table_destroy);
         g_clear_object (&state->state_screen);
 
         G_OBJECT_CLASS (csd_color_state_parent_class)->finalize (object);
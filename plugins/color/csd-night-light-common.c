@@ -21,8 +21,11 @@
 
 #include <glib.h>
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "csd-night-light-common.h"
+#include "tz-coords.h"
 
 static gdouble
 deg2rad (gdouble degrees)
@@ -142,3 +145,46 @@ csd_night_light_frac_day_is_between (gdouble  value,
          */
         return value >= start && value < end;
 }
+
+static int
+tz_coords_cmp (const void *key, const void *member)
+{
+        return strcmp (key, ((const TZCoords *) member)->timezone);
+}
+
+static int
+tz_alias_cmp (const void *key, const void *member)
+{
+        return strcmp (key, ((const TZAlias *) member)->alias);
+}
+
+gboolean
+csd_night_light_get_timezone_coords (const gchar *timezone,
+                                     gdouble     *latitude,
+                                     gdouble     *longitude)
+{
+        const TZCoords *coords;
+        const TZAlias *alias;
+
+        if (timezone == NULL)
+                return FALSE;
+
+        /* both tables are generated sorted by generate-tz-header.py */
+        coords = bsearch (timezone, tz_coord_list, G_N_ELEMENTS (tz_coord_list),
+                          sizeof (TZCoords), tz_coords_cmp);
+        if (coords == NULL) {
+                /* backward compatible names, e.g. Asia/Calcutta, use the
+                 * city of the zone they link to */
+                alias = bsearch (timezone, tz_alias_list, G_N_ELEMENTS (tz_alias_list),
+                                 sizeof (TZAlias), tz_alias_cmp);
+                if (alias == NULL)
+                        return FALSE;
+                coords = &tz_coord_list[alias->index];
+        }
+
+        if (latitude != NULL)
+                *latitude = coords->latitude;
+        if (longitude != NULL)
+                *longitude = coords->longitude;
+        return TRUE;
+}
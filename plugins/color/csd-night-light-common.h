@@ -34,6 +34,9 @@ gchar *  csd_night_light_time_string_from_frac  (gdouble         fraction);
 gboolean csd_night_light_frac_day_is_between    (gdouble         value,
                                                  gdouble         start,
                                                  gdouble         end);
+gboolean csd_night_light_get_timezone_coords    (const gchar    *timezone,
+                                                 gdouble        *latitude,
+                                                 gdouble        *longitude);
 
 G_END_DECLS
 
@@ -20,6 +20,10 @@
 
 #include "config.h"
 
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+
 #define GNOME_DESKTOP_USE_UNSTABLE_API
 #include "gnome-datetime-source.h"
 
@@ -27,7 +31,21 @@
 
 #include "csd-night-light.h"
 #include "csd-night-light-common.h"
-#include "tz-coords.h"
+
+#define SUN_TABLE_FILE          "night-light-sun-table"
+#define SUN_TABLE_VERSION       1
+#define SUN_TABLE_DAYS          366
+#define SUN_TABLE_COORD_DELTA   0.0001  /* degrees */
+
+/* sunrise and sunset of every day of a year, for one location */
+typedef struct {
+        gint       year;
+        gdouble    latitude;
+        gdouble    longitude;
+        GTimeZone *tz;
+        gdouble    sunrise[SUN_TABLE_DAYS];
+        gdouble    sunset[SUN_TABLE_DAYS];
+} SunTable;
 
 struct _CsdNightLight {
         GObject            parent;
@@ -36,9 +54,12 @@ struct _CsdNightLight {
         gboolean           disabled_until_tmw;
         GDateTime         *disabled_until_tmw_dt;
         GSource           *source;
+        GDateTime         *next_wakeup;
         guint              validate_id;
         gdouble            cached_sunrise;
         gdouble            cached_sunset;
+        SunTable          *sun_table;
+        gboolean           sun_table_pending;
         gdouble            cached_temperature;
         gboolean           cached_active;
         gboolean           smooth_enabled;
@@ -57,6 +78,7 @@ enum {
         PROP_TEMPERATURE,
         PROP_DISABLED_UNTIL_TMW,
         PROP_FORCED,
+        PROP_NEXT_WAKEUP,
         PROP_LAST
 };
 
@@ -75,7 +97,9 @@ enum {
 #define CSD_TEMPERATURE_MAX_DELTA               (10.f)          /* Kelvin */
 
 static void poll_timeout_destroy (CsdNightLight *self);
-static void poll_timeout_create (CsdNightLight *self);
+static void poll_timeout_create (CsdNightLight *self,
+                                 GDateTime     *dt_now,
+                                 GDateTime     *dt_expiry);
 static void night_light_recheck (CsdNightLight *self);
 
 G_DEFINE_TYPE (CsdNightLight, csd_night_light, G_TYPE_OBJECT);
@@ -127,6 +151,222 @@ linear_interpolate (gdouble val1, gdouble val2, gdouble factor)
         return ((val1 - val2) * factor) + val2;
 }
 
+static SunTable *
+sun_table_new (gint year, gdouble latitude, gdouble longitude, GTimeZone *tz)
+{
+        SunTable *table = g_new0 (SunTable, 1);
+
+        table->year = year;
+        table->latitude = latitude;
+        table->longitude = longitude;
+        table->tz = g_time_zone_ref (tz);
+        return table;
+}
+
+static void
+sun_table_free (SunTable *table)
+{
+        g_time_zone_unref (table->tz);
+        g_free (table);
+}
+
+static gboolean
+sun_table_matches (const SunTable *table,
+                   gint            year,
+                   gdouble         latitude,
+                   gdouble         longitude,
+                   const gchar    *tz_id)
+{
+        return table->year == year &&
+               ABS (table->latitude - latitude) < SUN_TABLE_COORD_DELTA &&
+               ABS (table->longitude - longitude) < SUN_TABLE_COORD_DELTA &&
+               g_strcmp0 (g_time_zone_get_identifier (table->tz), tz_id) == 0;
+}
+
+static gchar *
+sun_table_get_path (void)
+{
+        return g_build_filename (g_get_user_cache_dir (),
+                                 "cinnamon-settings-daemon",
+                                 SUN_TABLE_FILE, NULL);
+}
+
+/* The cache holds the table of the last location only:
+ *
+ *   night-light-sun-table <version> <year> <latitude> <longitude> <timezone>
+ *   <sunrise> <sunset>
+ *   ... one line per day of the year
+ */
+static gboolean
+sun_table_read (SunTable *table, const gchar *path)
+{
+        g_autofree gchar *contents = NULL;
+        g_auto(GStrv) lines = NULL;
+        g_auto(GStrv) header = NULL;
+        guint i;
+
+        if (!g_file_get_contents (path, &contents, NULL, NULL))
+                return FALSE;
+
+        lines = g_strsplit (contents, "\n", -1);
+        if (g_strv_length (lines) < SUN_TABLE_DAYS + 1)
+                return FALSE;
+
+        header = g_strsplit (lines[0], " ", 6);
+        if (g_strv_length (header) != 6 ||
+            g_strcmp0 (header[0], SUN_TABLE_FILE) != 0 ||
+            atoi (header[1]) != SUN_TABLE_VERSION)
+                return FALSE;
+        if (!sun_table_matches (table,
+                                atoi (header[2]),
+                                g_ascii_strtod (header[3], NULL),
+                                g_ascii_strtod (header[4], NULL),
+                                header[5]))
+                return FALSE;
+
+        for (i = 0; i < SUN_TABLE_DAYS; i++) {
+                const gchar *line = lines[i + 1];
+                gchar *end;
+
+                table->sunrise[i] = g_ascii_strtod (line, &end);
+                if (end == line)
+                        return FALSE;
+                line = end;
+                table->sunset[i] = g_ascii_strtod (line, &end);
+                if (end == line)
+                        return FALSE;
+        }
+
+        return TRUE;
+}
+
+static void
+sun_table_write (SunTable *table, const gchar *path)
+{
+        g_autofree gchar *dir = g_path_get_dirname (path);
+        g_autoptr(GString) out = g_string_new (NULL);
+        g_autoptr(GError) error = NULL;
+        gchar lat[G_ASCII_DTOSTR_BUF_SIZE];
+        gchar lon[G_ASCII_DTOSTR_BUF_SIZE];
+        gchar sunrise[G_ASCII_DTOSTR_BUF_SIZE];
+        gchar sunset[G_ASCII_DTOSTR_BUF_SIZE];
+        guint i;
+
+        g_string_append_printf (out, "%s %d %d %s %s %s\n",
+                                SUN_TABLE_FILE, SUN_TABLE_VERSION, table->year,
+                                g_ascii_dtostr (lat, sizeof (lat), table->latitude),
+                                g_ascii_dtostr (lon, sizeof (lon), table->longitude),
+                                g_time_zone_get_identifier (table->tz));
+        for (i = 0; i < SUN_TABLE_DAYS; i++) {
+                g_string_append_printf (out, "%s %s\n",
+                                        g_ascii_formatd (sunrise, sizeof (sunrise), "%.4f", table->sunrise[i]),
+                                        g_ascii_formatd (sunset, sizeof (sunset), "%.4f", table->sunset[i]));
+        }
+
+        /* not being able to save the table only means computing it again */
+        if (g_mkdir_with_parents (dir, 0755) != 0 ||
+            !g_file_set_contents (path, out->str, out->len, &error))
+                g_debug ("failed to save sunrise/sunset table to %s: %s", path,
+                         error != NULL ? error->message : g_strerror (errno));
+}
+
+static void
+sun_table_compute (SunTable *table)
+{
+        g_autoptr(GDateTime) dt_jan1 = NULL;
+        guint i;
+
+        /* noon keeps every entry on its own day across DST changes */
+        dt_jan1 = g_date_time_new (table->tz, table->year, 1, 1, 12, 0, 0);
+        for (i = 0; i < SUN_TABLE_DAYS; i++) {
+                g_autoptr(GDateTime) dt = g_date_time_add_days (dt_jan1, i);
+
+                if (!csd_night_light_get_sunrise_sunset (dt,
+                                                         table->latitude,
+                                                         table->longitude,
+                                                         &table->sunrise[i],
+                                                         &table->sunset[i])) {
+                        table->sunrise[i] = -1.f;
+                        table->sunset[i] = -1.f;
+                }
+        }
+}
+
+static void
+sun_table_thread (GTask        *task,
+                  gpointer      source_object,
+                  gpointer      task_data,
+                  GCancellable *cancellable)
+{
+        SunTable *key = task_data;
+        SunTable *table;
+        g_autofree gchar *path = sun_table_get_path ();
+
+        table = sun_table_new (key->year, key->latitude, key->longitude, key->tz);
+        if (sun_table_read (table, path)) {
+                g_debug ("loaded sunrise/sunset table for %d from %s",
+                         table->year, path);
+                g_task_return_pointer (task, table, (GDestroyNotify) sun_table_free);
+                return;
+        }
+
+        sun_table_compute (table);
+        if (g_task_return_error_if_cancelled (task)) {
+                sun_table_free (table);
+                return;
+        }
+
+        sun_table_write (table, path);
+        g_debug ("computed sunrise/sunset table for %d", table->year);
+        g_task_return_pointer (task, table, (GDestroyNotify) sun_table_free);
+}
+
+static void
+sun_table_ready_cb (GObject      *source_object,
+                    GAsyncResult *res,
+                    gpointer      user_data)
+{
+        CsdNightLight *self = CSD_NIGHT_LIGHT (source_object);
+        g_autoptr(GError) error = NULL;
+        SunTable *table;
+
+        self->sun_table_pending = FALSE;
+
+        table = g_task_propagate_pointer (G_TASK (res), &error);
+        if (table == NULL) {
+                if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                        g_warning ("failed to prepare sunrise/sunset table: %s",
+                                   error->message);
+                return;
+        }
+
+        g_clear_pointer (&self->sun_table, sun_table_free);
+        self->sun_table = table;
+        night_light_recheck (self);
+}
+
+/* builds or loads the table in a thread, the only work left for a recheck
+ * is then a lookup */
+static void
+sun_table_request (CsdNightLight *self,
+                   gint           year,
+                   gdouble        latitude,
+                   gdouble        longitude,
+                   GTimeZone     *tz)
+{
+        g_autoptr(GTask) task = NULL;
+
+        if (self->sun_table_pending)
+                return;
+        self->sun_table_pending = TRUE;
+
+        task = g_task_new (self, self->cancellable, sun_table_ready_cb, NULL);
+        g_task_set_task_data (task,
+                              sun_table_new (year, latitude, longitude, tz),
+                              (GDestroyNotify) sun_table_free);
+        g_task_run_in_thread (task, sun_table_thread);
+}
+
 static gboolean
 update_cached_sunrise_sunset (CsdNightLight *self)
 {
@@ -135,6 +375,8 @@ update_cached_sunrise_sunset (CsdNightLight *self)
         gdouble longitude;
         gdouble sunrise;
         gdouble sunset;
+        gint year;
+        GTimeZone *tz;
         g_autoptr(GVariant) tmp = NULL;
         g_autoptr(GDateTime) dt_now = csd_night_light_get_date_time_now (self);
 
@@ -145,11 +387,24 @@ update_cached_sunrise_sunset (CsdNightLight *self)
                 return FALSE;
         if (longitude > 180.f || longitude < -180.f)
                 return FALSE;
-        if (!csd_night_light_get_sunrise_sunset (dt_now, latitude, longitude,
-                                                   &sunrise, &sunset)) {
-                g_warning ("failed to get sunset/sunrise for %.3f,%.3f",
-                           latitude, longitude);
-                return FALSE;
+
+        year = g_date_time_get_year (dt_now);
+        tz = g_date_time_get_timezone (dt_now);
+        if (self->sun_table != NULL &&
+            sun_table_matches (self->sun_table, year, latitude, longitude,
+                               g_time_zone_get_identifier (tz))) {
+                gint day = g_date_time_get_day_of_year (dt_now) - 1;
+                sunrise = self->sun_table->sunrise[day];
+                sunset = self->sun_table->sunset[day];
+        } else {
+                /* use the direct calculation until the table is ready */
+                sun_table_request (self, year, latitude, longitude, tz);
+                if (!csd_night_light_get_sunrise_sunset (dt_now, latitude, longitude,
+                                                         &sunrise, &sunset)) {
+                        g_warning ("failed to get sunset/sunrise for %.3f,%.3f",
+                                   latitude, longitude);
+                        return FALSE;
+                }
         }
 
         /* anything changed */
@@ -249,30 +504,45 @@ csd_night_light_set_active (CsdNightLight *self, gboolean active)
         g_object_notify (G_OBJECT (self), "active");
 }
 
-static void
-night_light_recheck (CsdNightLight *self)
+/* hours from @frac_day until the clock next shows @frac_target */
+static gdouble
+frac_day_until (gdouble frac_day, gdouble frac_target)
+{
+        gdouble delta = fmod (frac_target - frac_day, 24);
+        if (delta <= 0)
+                delta += 24;
+        return delta;
+}
+
+/* Updates the temperature for @dt_now and returns the number of hours
+ * until it will change again without any settings being touched, or
+ * -1 if it stays the same until then. */
+static gdouble
+night_light_recheck_at (CsdNightLight *self, GDateTime *dt_now)
 {
         gdouble frac_day;
         gdouble schedule_from = -1.f;
         gdouble schedule_to = -1.f;
         gdouble smear = CSD_NIGHT_LIGHT_POLL_SMEAR; /* hours */
+        gdouble poll = CSD_NIGHT_LIGHT_POLL_TIMEOUT / 3600.f; /* hours */
+        gdouble next;
+        gboolean sun_schedule = FALSE;
         guint temperature;
         guint temp_smeared;
-        g_autoptr(GDateTime) dt_now = csd_night_light_get_date_time_now (self);
 
         /* Forced mode, just set the temperature to night light.
          * Proper rechecking will happen once forced mode is disabled again */
         if (self->forced) {
                 temperature = g_settings_get_uint (self->settings, "night-light-temperature");
                 csd_night_light_set_temperature (self, temperature);
-                return;
+                return -1.f;
         }
 
         /* enabled */
         if (!g_settings_get_boolean (self->settings, "night-light-enabled")) {
                 g_debug ("night light disabled, resetting");
                 csd_night_light_set_active (self, FALSE);
-                return;
+                return -1.f;
         }
 
         /* schedule-mode */
@@ -284,13 +554,14 @@ night_light_recheck (CsdNightLight *self)
                          temperature);
                 csd_night_light_set_active (self, TRUE);
                 csd_night_light_set_temperature (self, temperature);
-                return;
+                return -1.f;
         case NIGHT_LIGHT_SCHEDULE_AUTO:
                 /* calculate the position of the sun */
                 update_cached_sunrise_sunset (self);
                 if (self->cached_sunrise > 0.f && self->cached_sunset > 0.f) {
                         schedule_to = self->cached_sunrise;
                         schedule_from = self->cached_sunset;
+                        sun_schedule = TRUE;
                 }
                 break;
         default:
@@ -342,7 +613,11 @@ night_light_recheck (CsdNightLight *self)
                         g_debug ("night light still day-disabled, resetting");
                         csd_night_light_set_temperature (self,
                                                          CSD_COLOR_TEMPERATURE_DEFAULT);
-                        return;
+
+                        /* expires at the next sunrise, or after 24h */
+                        next = MIN (frac_day_until (frac_day, schedule_to),
+                                    (gdouble) ((GTimeSpan) 24 * 60 * 60 * 1000000 - time_span) / G_TIME_SPAN_HOUR);
+                        goto out;
                 }
         }
 
@@ -356,7 +631,8 @@ night_light_recheck (CsdNightLight *self)
                                                   schedule_to)) {
                 g_debug ("not time for night-light");
                 csd_night_light_set_active (self, FALSE);
-                return;
+                next = frac_day_until (frac_day, schedule_from - smear);
+                goto out;
         }
 
         /* smear the temperature for a short duration before the set limits
@@ -368,58 +644,121 @@ night_light_recheck (CsdNightLight *self)
          * \                        /
          *  \                      /
          *   \--------------------/
+         *
+         * the temperature only changes while smearing, so that is the
+         * only time it needs to be polled
          */
         temperature = g_settings_get_uint (self->settings, "night-light-temperature");
         if (smear < 0.01) {
                 /* Don't try to smear for extremely short or zero periods */
                 temp_smeared = temperature;
+                next = frac_day_until (frac_day, schedule_to);
         } else if (csd_night_light_frac_day_is_between (frac_day,
                                                         schedule_from - smear,
                                                         schedule_from)) {
                 gdouble factor = 1.f - ((frac_day - (schedule_from - smear)) / smear);
                 temp_smeared = linear_interpolate (CSD_COLOR_TEMPERATURE_DEFAULT,
                                                    temperature, factor);
+                next = MIN (poll, frac_day_until (frac_day, schedule_from));
         } else if (csd_night_light_frac_day_is_between (frac_day,
                                                         schedule_to - smear,
                                                         schedule_to)) {
                 gdouble factor = (frac_day - (schedule_to - smear)) / smear;
                 temp_smeared = linear_interpolate (CSD_COLOR_TEMPERATURE_DEFAULT,
                                                    temperature, factor);
+                next = MIN (poll, frac_day_until (frac_day, schedule_to));
         } else {
                 temp_smeared = temperature;
+                next = frac_day_until (frac_day, schedule_to - smear);
         }
         g_debug ("night light mode on, using temperature of %uK (aiming for %uK)",
                  temp_smeared, temperature);
         csd_night_light_set_active (self, TRUE);
         csd_night_light_set_temperature (self, temp_smeared);
+
+out:
+        /* sunrise and sunset move a little every day, so edges after
+         * midnight are only exact once the new day has been looked up */
+        if (sun_schedule)
+                next = MIN (next, 24.f - frac_day);
+        return next;
 }
 
-/* called when the time may have changed */
+/* The wall clock time @hours after @dt_now, plus a second of slack so the
+ * edge is behind us when the timer fires.  Going through the wall clock
+ * keeps the edges in place across a DST change. */
+static GDateTime *
+date_time_add_frac_hours (GDateTime *dt_now, gdouble hours)
+{
+        g_autoptr(GDateTime) dt_day = NULL;
+        GDateTime *dt;
+        gdouble target = csd_night_light_frac_day_from_dt (dt_now) + hours;
+        gint seconds;
+
+        dt_day = g_date_time_add_days (dt_now, (gint) floor (target / 24));
+        seconds = MIN ((gint) ceil (fmod (target, 24) * 3600) + 1, 24 * 3600 - 1);
+        dt = g_date_time_new (g_date_time_get_timezone (dt_day),
+                              g_date_time_get_year (dt_day),
+                              g_date_time_get_month (dt_day),
+                              g_date_time_get_day_of_month (dt_day),
+                              seconds / 3600,
+                              (seconds / 60) % 60,
+                              seconds % 60);
+        if (dt == NULL || g_date_time_compare (dt, dt_now) <= 0) {
+                g_clear_pointer (&dt, g_date_time_unref);
+                dt = g_date_time_add_seconds (dt_now, ceil (hours * 3600) + 1);
+        }
+        return dt;
+}
+
+static void
+night_light_recheck (CsdNightLight *self)
+{
+        g_autoptr(GDateTime) dt_now = csd_night_light_get_date_time_now (self);
+        g_autoptr(GDateTime) dt_next = NULL;
+        gdouble next;
+
+        next = night_light_recheck_at (self, dt_now);
+
+        /* a single timer for the next change, nothing in between */
+        poll_timeout_destroy (self);
+        if (next >= 0.f) {
+                dt_next = date_time_add_frac_hours (dt_now, next);
+                poll_timeout_create (self, dt_now, dt_next);
+        }
+
+        if (csd_night_light_get_next_wakeup (self) != (dt_next != NULL ? g_date_time_to_unix (dt_next) : 0)) {
+                g_clear_pointer (&self->next_wakeup, g_date_time_unref);
+                if (dt_next != NULL)
+                        self->next_wakeup = g_date_time_ref (dt_next);
+                g_object_notify (G_OBJECT (self), "next-wakeup");
+        }
+        if (dt_next != NULL) {
+                g_autofree gchar *formatted = g_date_time_format (dt_next, "%F %T");
+                g_debug ("next night light wakeup at %s", formatted);
+        }
+}
+
+/* called when the next change is due, or the time may have changed */
 static gboolean
 night_light_recheck_cb (gpointer user_data)
 {
         CsdNightLight *self = CSD_NIGHT_LIGHT (user_data);
 
-        /* recheck parameters, then reschedule a new timeout */
-        night_light_recheck (self);
+        /* recheck parameters, this also arms the next timeout */
         poll_timeout_destroy (self);
-        poll_timeout_create (self);
+        night_light_recheck (self);
 
         /* return value ignored for a one-time watch */
         return G_SOURCE_REMOVE;
 }
 
 static void
-poll_timeout_create (CsdNightLight *self)
+poll_timeout_create (CsdNightLight *self, GDateTime *dt_now, GDateTime *dt_expiry)
 {
-        g_autoptr(GDateTime) dt_now = NULL;
-        g_autoptr(GDateTime) dt_expiry = NULL;
-
         if (self->source != NULL)
                 return;
 
-        dt_now = csd_night_light_get_date_time_now (self);
-        dt_expiry = g_date_time_add_seconds (dt_now, CSD_NIGHT_LIGHT_POLL_TIMEOUT);
         self->source = _gnome_datetime_source_new (dt_now,
                                                    dt_expiry,
                                                    TRUE);
@@ -454,19 +793,19 @@ update_location_from_timezone (CsdNightLight *self)
 {
     GTimeZone *tz = g_time_zone_new_local ();
     const gchar *id = g_time_zone_get_identifier (tz);
+    gdouble latitude, longitude;
 
-    for (int i = 0; i < G_N_ELEMENTS (tz_coord_list); i++)
+    if (csd_night_light_get_timezone_coords (id, &latitude, &longitude))
     {
-        const TZCoords coords = tz_coord_list[i];
-        if (g_strcmp0 (coords.timezone, id) == 0)
-        {
-            g_debug ("Coordinates updated, timezone: %s, lat:%.3f, long:%.3f.",
-                    id, coords.latitude, coords.longitude);
-            g_settings_set_value (self->settings,
-                                  "night-light-last-coordinates",
-                                  g_variant_new ("(dd)", coords.latitude, coords.longitude));
-            break;
-        }
+        g_debug ("Coordinates updated, timezone: %s, lat:%.3f, long:%.3f.",
+                id, latitude, longitude);
+        g_settings_set_value (self->settings,
+                              "night-light-last-coordinates",
+                              g_variant_new ("(dd)", latitude, longitude));
+    }
+    else
+    {
+        g_warning ("No coordinates known for timezone %s, keeping the last location", id);
     }
 
     g_time_zone_unref (tz);
@@ -541,11 +880,18 @@ csd_night_light_get_temperature (CsdNightLight *self)
         return self->cached_temperature;
 }
 
+gint64
+csd_night_light_get_next_wakeup (CsdNightLight *self)
+{
+        if (self->next_wakeup == NULL)
+                return 0;
+        return g_date_time_to_unix (self->next_wakeup);
+}
+
 gboolean
 csd_night_light_start (CsdNightLight *self, GError **error)
 {
         night_light_recheck (self);
-        poll_timeout_create (self);
 
         /* care about changes */
         g_signal_connect (self->settings, "changed",
@@ -564,9 +910,13 @@ csd_night_light_finalize (GObject *object)
         poll_timeout_destroy (self);
         poll_smooth_destroy (self);
 
+        g_cancellable_cancel (self->cancellable);
+        g_clear_object (&self->cancellable);
+        g_clear_pointer (&self->sun_table, sun_table_free);
         g_clear_object (&self->settings);
         g_clear_pointer (&self->datetime_override, g_date_time_unref);
         g_clear_pointer (&self->disabled_until_tmw_dt, g_date_time_unref);
+        g_clear_pointer (&self->next_wakeup, g_date_time_unref);
 
         if (self->validate_id > 0) {
                 g_source_remove (self->validate_id);
@@ -632,6 +982,9 @@ csd_night_light_get_property (GObject    *object,
         case PROP_FORCED:
                 g_value_set_boolean (value, csd_night_light_get_forced (self));
                 break;
+        case PROP_NEXT_WAKEUP:
+                g_value_set_int64 (value, csd_night_light_get_next_wakeup (self));
+                break;
         default:
                 G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
         }
@@ -700,6 +1053,16 @@ csd_night_light_class_init (CsdNightLightClass *klass)
                                                                FALSE,
                                                                G_PARAM_READWRITE));
 
+        g_object_class_install_property (object_class,
+                                         PROP_NEXT_WAKEUP,
+                                         g_param_spec_int64 ("next-wakeup",
+                                                             "Next wakeup",
+                                                             "When the temperature is next rechecked, in seconds since the epoch, or 0",
+                                                             0,
+                                                             G_MAXINT64,
+                                                             0,
+                                                             G_PARAM_READABLE));
+
 }
 
 static void
@@ -709,6 +1072,7 @@ csd_night_light_init (CsdNightLight *self)
         self->cached_sunrise = -1.f;
         self->cached_sunset = -1.f;
         self->cached_temperature = CSD_COLOR_TEMPERATURE_DEFAULT;
+        self->cancellable = g_cancellable_new ();
         self->settings = g_settings_new ("org.cinnamon.settings-daemon.plugins.color");
 }
 
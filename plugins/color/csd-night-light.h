@@ -36,6 +36,7 @@ gboolean         csd_night_light_get_active             (CsdNightLight *self);
 gdouble          csd_night_light_get_sunrise            (CsdNightLight *self);
 gdouble          csd_night_light_get_sunset             (CsdNightLight *self);
 gdouble          csd_night_light_get_temperature        (CsdNightLight *self);
+gint64           csd_night_light_get_next_wakeup        (CsdNightLight *self);
 
 gboolean         csd_night_light_get_disabled_until_tmw (CsdNightLight *self);
 void             csd_night_light_set_disabled_until_tmw (CsdNightLight *self,
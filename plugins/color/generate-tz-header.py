@@ -6,14 +6,34 @@ from pathlib import Path
 
 COORDS_RE = re.compile(r"([+-]{1}[0-9]{2})([0-9]{2})([0-9]*)([+-]{1}[0-9]{3})([0-9]{2})([0-9]*)")
 
+# Backward compatible names that are still commonly configured, used when the
+# tzdata link file is not available.  Maps the old name to the current zone.
+BUILTIN_LINKS = {
+    "America/Buenos_Aires": "America/Argentina/Buenos_Aires",
+    "America/Indianapolis": "America/Indiana/Indianapolis",
+    "Asia/Calcutta": "Asia/Kolkata",
+    "Asia/Katmandu": "Asia/Kathmandu",
+    "Asia/Rangoon": "Asia/Yangon",
+    "Asia/Saigon": "Asia/Ho_Chi_Minh",
+    "Europe/Kiev": "Europe/Kyiv",
+    "Pacific/Truk": "Pacific/Chuuk",
+}
+
 d = {}
+links = dict(BUILTIN_LINKS)
 
 parser = ArgumentParser(prog='generate-tz-header',
                         description='Generate tz-coords.h header from timezone-data')
 parser.add_argument('-i', '--zone_tab', nargs='?', default='/usr/share/zoneinfo/zone.tab', type=Path)
+parser.add_argument('-l', '--links', nargs='?', default=None, type=Path,
+                    help='tzdata.zi or backward file listing zone aliases '
+                         '(default: tzdata.zi next to the zone table)')
 parser.add_argument('-o', '--out_file', nargs='?', default='tz-coords.h', type=Path)
 args = parser.parse_args()
 
+if args.links is None:
+    args.links = args.zone_tab.parent / 'tzdata.zi'
+
 with open(args.zone_tab, "r") as f:
     for line in f:
         line = line.strip()
@@ -28,8 +48,36 @@ with open(args.zone_tab, "r") as f:
 
         d[tz] = [lat, long]
 
+# Both tzdata.zi ("L target alias") and the backward file ("Link target alias")
+# describe aliases the same way.
+if args.links.exists():
+    with open(args.links, "r") as f:
+        for line in f:
+            fields = line.split('#', 1)[0].split()
+            if len(fields) == 3 and fields[0] in ("L", "Link"):
+                links[fields[2]] = fields[1]
+
+# The table is searched with strcmp(), so sort by byte value rather than locale.
+zones = sorted(d.keys(), key=lambda z: z.encode())
+index = {zone: i for i, zone in enumerate(zones)}
+
+# Resolve every alias to the zone.tab city it ends up at, following link
+# chains.  Aliases of locationless zones (Etc/UTC and friends) are dropped.
+aliases = {}
+for alias, target in links.items():
+    if alias in index:
+        continue
+    seen = set()
+    while target not in index and target in links and target not in seen:
+        seen.add(target)
+        target = links[target]
+    if target in index:
+        aliases[alias] = target
+
 header = """
-// Generated from %s, used by csd-nightlight.c to calculate sunrise and sunset based on the system timezone
+// Generated from %s and %s,
+// used by csd-night-light-common.c to calculate sunrise and sunset based on the
+// system timezone.  Both tables are sorted with strcmp() for bsearch().
 
 typedef struct
 {
@@ -38,14 +86,27 @@ typedef struct
     double longitude;
 } TZCoords;
 
-static TZCoords tz_coord_list[] = {
-""" % (args.zone_tab)
+typedef struct
+{
+    const gchar *alias;
+    guint16 index;
+} TZAlias;
+
+static const TZCoords tz_coord_list[] = {
+""" % (args.zone_tab, args.links if args.links.exists() else "builtin links")
 
-for zone in sorted(d.keys()):
+for zone in zones:
     latitude, longitude = d[zone]
 
     header += "    { \"%s\", %f, %f },\n" % (zone, latitude, longitude)
 
+header += "};\n\n"
+header += "// Backward compatible names, mapped to an index in tz_coord_list\n"
+header += "static const TZAlias tz_alias_list[] = {\n"
+
+for alias in sorted(aliases.keys(), key=lambda z: z.encode()):
+    header += "    { \"%s\", %d }, // %s\n" % (alias, index[aliases[alias]], aliases[alias])
+
 header += "};"
 
 with open(args.out_file, "w") as f:
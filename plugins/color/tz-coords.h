@@ -1,5 +1,7 @@
 
-// Generated from /usr/share/zoneinfo/zone.tab, used by csd-nightlight.c to calculate sunrise and sunset based on the system timezone
+// Generated from /usr/share/zoneinfo/zone.tab and /usr/share/zoneinfo/tzdata.zi,
+// used by csd-night-light-common.c to calculate sunrise and sunset based on the
+// system timezone.  Both tables are sorted with strcmp() for bsearch().
 
 typedef struct
 {
@@ -8,7 +10,13 @@ typedef struct
     double longitude;
 } TZCoords;
 
-static TZCoords tz_coord_list[] = {
+typedef struct
+{
+    const gchar *alias;
+    guint16 index;
+} TZAlias;
+
+static const TZCoords tz_coord_list[] = {
     { "Africa/Abidjan", 5.316667, -4.033333 },
     { "Africa/Accra", 5.550000, -0.216667 },
     { "Africa/Addis_Ababa", 9.033333, 38.700000 },
@@ -427,4 +435,132 @@ static TZCoords tz_coord_list[] = {
     { "Pacific/Tongatapu", -21.133333, -175.200000 },
     { "Pacific/Wake", 19.283333, 166.616667 },
     { "Pacific/Wallis", -13.300000, -176.166667 },
+};
+
+// Backward compatible names, mapped to an index in tz_coord_list
+static const TZAlias tz_alias_list[] = {
+    { "Africa/Asmera", 42 }, // Africa/Nairobi
+    { "Africa/Timbuktu", 0 }, // Africa/Abidjan
+    { "America/Argentina/ComodRivadavia", 58 }, // America/Argentina/Catamarca
+    { "America/Atka", 52 }, // America/Adak
+    { "America/Buenos_Aires", 57 }, // America/Argentina/Buenos_Aires
+    { "America/Catamarca", 58 }, // America/Argentina/Catamarca
+    { "America/Coral_Harbour", 161 }, // America/Panama
+    { "America/Cordoba", 59 }, // America/Argentina/Cordoba
+    { "America/Ensenada", 189 }, // America/Tijuana
+    { "America/Fort_Wayne", 117 }, // America/Indiana/Indianapolis
+    { "America/Godthab", 159 }, // America/Nuuk
+    { "America/Indianapolis", 117 }, // America/Indiana/Indianapolis
+    { "America/Jujuy", 60 }, // America/Argentina/Jujuy
+    { "America/Knox_IN", 118 }, // America/Indiana/Knox
+    { "America/Louisville", 129 }, // America/Kentucky/Louisville
+    { "America/Mendoza", 62 }, // America/Argentina/Mendoza
+    { "America/Montreal", 190 }, // America/Toronto
+    { "America/Nipigon", 190 }, // America/Toronto
+    { "America/Pangnirtung", 126 }, // America/Iqaluit
+    { "America/Porto_Acre", 173 }, // America/Rio_Branco
+    { "America/Rainy_River", 194 }, // America/Winnipeg
+    { "America/Rosario", 59 }, // America/Argentina/Cordoba
+    { "America/Santa_Isabel", 189 }, // America/Tijuana
+    { "America/Shiprock", 98 }, // America/Denver
+    { "America/Thunder_Bay", 190 }, // America/Toronto
+    { "America/Virgin", 167 }, // America/Puerto_Rico
+    { "America/Yellowknife", 101 }, // America/Edmonton
+    { "Antarctica/South_Pole", 381 }, // Pacific/Auckland
+    { "Asia/Ashkhabad", 214 }, // Asia/Ashgabat
+    { "Asia/Calcutta", 246 }, // Asia/Kolkata
+    { "Asia/Choibalsan", 281 }, // Asia/Ulaanbaatar
+    { "Asia/Chongqing", 271 }, // Asia/Shanghai
+    { "Asia/Chungking", 271 }, // Asia/Shanghai
+    { "Asia/Dacca", 227 }, // Asia/Dhaka
+    { "Asia/Harbin", 271 }, // Asia/Shanghai
+    { "Asia/Istanbul", 329 }, // Europe/Istanbul
+    { "Asia/Kashgar", 282 }, // Asia/Urumqi
+    { "Asia/Katmandu", 244 }, // Asia/Kathmandu
+    { "Asia/Macao", 251 }, // Asia/Macau
+    { "Asia/Rangoon", 287 }, // Asia/Yangon
+    { "Asia/Saigon", 234 }, // Asia/Ho_Chi_Minh
+    { "Asia/Tel_Aviv", 240 }, // Asia/Jerusalem
+    { "Asia/Thimbu", 278 }, // Asia/Thimphu
+    { "Asia/Ujung_Pandang", 253 }, // Asia/Makassar
+    { "Asia/Ulan_Bator", 281 }, // Asia/Ulaanbaatar
+    { "Atlantic/Faeroe", 294 }, // Atlantic/Faroe
+    { "Atlantic/Jan_Mayen", 316 }, // Europe/Berlin
+    { "Australia/ACT", 310 }, // Australia/Sydney
+    { "Australia/Canberra", 310 }, // Australia/Sydney
+    { "Australia/Currie", 305 }, // Australia/Hobart
+    { "Australia/LHI", 307 }, // Australia/Lord_Howe
+    { "Australia/NSW", 310 }, // Australia/Sydney
+    { "Australia/North", 303 }, // Australia/Darwin
+    { "Australia/Queensland", 301 }, // Australia/Brisbane
+    { "Australia/South", 300 }, // Australia/Adelaide
+    { "Australia/Tasmania", 305 }, // Australia/Hobart
+    { "Australia/Victoria", 308 }, // Australia/Melbourne
+    { "Australia/West", 309 }, // Australia/Perth
+    { "Australia/Yancowinna", 302 }, // Australia/Broken_Hill
+    { "Brazil/Acre", 173 }, // America/Rio_Branco
+    { "Brazil/DeNoronha", 155 }, // America/Noronha
+    { "Brazil/East", 177 }, // America/Sao_Paulo
+    { "Brazil/West", 138 }, // America/Manaus
+    { "Canada/Atlantic", 114 }, // America/Halifax
+    { "Canada/Central", 194 }, // America/Winnipeg
+    { "Canada/Eastern", 190 }, // America/Toronto
+    { "Canada/Mountain", 101 }, // America/Edmonton
+    { "Canada/Newfoundland", 181 }, // America/St_Johns
+    { "Canada/Pacific", 192 }, // America/Vancouver
+    { "Canada/Saskatchewan", 171 }, // America/Regina
+    { "Canada/Yukon", 193 }, // America/Whitehorse
+    { "Chile/Continental", 175 }, // America/Santiago
+    { "Chile/EasterIsland", 385 }, // Pacific/Easter
+    { "Cuba", 115 }, // America/Havana
+    { "Egypt", 12 }, // Africa/Cairo
+    { "Eire", 324 }, // Europe/Dublin
+    { "Europe/Belfast", 336 }, // Europe/London
+    { "Europe/Kiev", 333 }, // Europe/Kyiv
+    { "Europe/Nicosia", 256 }, // Asia/Nicosia
+    { "Europe/Tiraspol", 322 }, // Europe/Chisinau
+    { "Europe/Uzhgorod", 333 }, // Europe/Kyiv
+    { "Europe/Zaporozhye", 333 }, // Europe/Kyiv
+    { "GB", 336 }, // Europe/London
+    { "GB-Eire", 336 }, // Europe/London
+    { "Hongkong", 235 }, // Asia/Hong_Kong
+    { "Iceland", 0 }, // Africa/Abidjan
+    { "Iran", 277 }, // Asia/Tehran
+    { "Israel", 240 }, // Asia/Jerusalem
+    { "Jamaica", 127 }, // America/Jamaica
+    { "Japan", 279 }, // Asia/Tokyo
+    { "Kwajalein", 398 }, // Pacific/Kwajalein
+    { "Libya", 49 }, // Africa/Tripoli
+    { "Mexico/BajaNorte", 189 }, // America/Tijuana
+    { "Mexico/BajaSur", 142 }, // America/Mazatlan
+    { "Mexico/General", 146 }, // America/Mexico_City
+    { "NZ", 381 }, // Pacific/Auckland
+    { "NZ-CHAT", 383 }, // Pacific/Chatham
+    { "Navajo", 98 }, // America/Denver
+    { "PRC", 271 }, // Asia/Shanghai
+    { "Pacific/Enderbury", 395 }, // Pacific/Kanton
+    { "Pacific/Johnston", 394 }, // Pacific/Honolulu
+    { "Pacific/Ponape", 392 }, // Pacific/Guadalcanal
+    { "Pacific/Samoa", 406 }, // Pacific/Pago_Pago
+    { "Pacific/Truk", 410 }, // Pacific/Port_Moresby
+    { "Pacific/Yap", 410 }, // Pacific/Port_Moresby
+    { "Poland", 366 }, // Europe/Warsaw
+    { "Portugal", 334 }, // Europe/Lisbon
+    { "ROC", 274 }, // Asia/Taipei
+    { "ROK", 270 }, // Asia/Seoul
+    { "Singapore", 272 }, // Asia/Singapore
+    { "Turkey", 329 }, // Europe/Istanbul
+    { "US/Alaska", 53 }, // America/Anchorage
+    { "US/Aleutian", 52 }, // America/Adak
+    { "US/Arizona", 163 }, // America/Phoenix
+    { "US/Central", 87 }, // America/Chicago
+    { "US/East-Indiana", 117 }, // America/Indiana/Indianapolis
+    { "US/Eastern", 153 }, // America/New_York
+    { "US/Hawaii", 394 }, // Pacific/Honolulu
+    { "US/Indiana-Starke", 118 }, // America/Indiana/Knox
+    { "US/Michigan", 99 }, // America/Detroit
+    { "US/Mountain", 98 }, // America/Denver
+    { "US/Pacific", 134 }, // America/Los_Angeles
+    { "US/Samoa", 406 }, // Pacific/Pago_Pago
+    { "W-SU", 343 }, // Europe/Moscow
 };
\ No newline at end of file
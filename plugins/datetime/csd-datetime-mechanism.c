@@ -51,6 +51,11 @@ struct _CsdDatetimeMechanism
         GObject        parent;
         CsdExportedDateTime *skeleton;
         PolkitAuthority *auth;
+
+        /* answer for GetTimezone, dropped when one of the files it
+         * comes from changes */
+        gchar *timezone;
+        GPtrArray *timezone_monitors;
 };
 
 G_DEFINE_TYPE (CsdDatetimeMechanism, csd_datetime_mechanism, G_TYPE_OBJECT)
@@ -59,6 +64,13 @@ static gboolean _check_polkit_for_action (CsdDatetimeMechanism *mechanism, GDBus
 
 #define IFACE "org.cinnamon.SettingsDaemon.DateTimeMechanism"
 
+#define KILLTIMER_SECONDS 30
+/* With the timezone cached, staying around is cheaper than starting
+ * again and re-reading the config files on the next GetTimezone */
+#define KILLTIMER_CACHED_SECONDS (5 * 60)
+
+static guint killtimer_seconds = KILLTIMER_SECONDS;
+
 static const GDBusErrorEntry csd_datetime_mechanism_error_entries[] = {
         { CSD_DATETIME_MECHANISM_ERROR_GENERAL,                 IFACE ".GeneralError" },
         { CSD_DATETIME_MECHANISM_ERROR_NOT_PRIVILEGED,          IFACE ".NotPrivileged" },
@@ -96,8 +108,67 @@ reset_killtimer (void)
                 timer_id = 0;
         }
 
-        g_debug ("Setting killtimer to 30 seconds...");
-        timer_id = g_timeout_add_seconds (30, do_exit, NULL);
+        g_debug ("Setting killtimer to %u seconds...", killtimer_seconds);
+        timer_id = g_timeout_add_seconds (killtimer_seconds, do_exit, NULL);
+}
+
+static void
+timezone_cache_invalidate (CsdDatetimeMechanism *mechanism)
+{
+        g_clear_pointer (&mechanism->timezone, g_free);
+        killtimer_seconds = KILLTIMER_SECONDS;
+}
+
+static void
+timezone_file_changed (GFileMonitor         *monitor,
+                       GFile                *file,
+                       GFile                *other_file,
+                       GFileMonitorEvent     event_type,
+                       CsdDatetimeMechanism *mechanism)
+{
+        if (mechanism->timezone == NULL)
+                return;
+
+        g_debug ("Timezone configuration changed, dropping cached timezone");
+        timezone_cache_invalidate (mechanism);
+}
+
+static void
+timezone_cache_watch (CsdDatetimeMechanism *mechanism)
+{
+        const char * const *files;
+        gint i;
+
+        mechanism->timezone_monitors = g_ptr_array_new_with_free_func (g_object_unref);
+
+        files = system_timezone_get_config_files ();
+        for (i = 0; files[i] != NULL; i++) {
+                GFile *file;
+                GFileMonitor *monitor;
+                char *dir;
+                gboolean has_dir;
+
+                /* GLib polls for files in directories that don't exist,
+                 * and /etc/sysconfig or /etc/conf.d only exist on some
+                 * distributions */
+                dir = g_path_get_dirname (files[i]);
+                has_dir = g_file_test (dir, G_FILE_TEST_IS_DIR);
+                g_free (dir);
+
+                if (!has_dir)
+                        continue;
+
+                file = g_file_new_for_path (files[i]);
+                monitor = g_file_monitor_file (file, G_FILE_MONITOR_NONE, NULL, NULL);
+                g_object_unref (file);
+
+                if (monitor == NULL)
+                        continue;
+
+                g_signal_connect (monitor, "changed",
+                                  G_CALLBACK (timezone_file_changed), mechanism);
+                g_ptr_array_add (mechanism->timezone_monitors, monitor);
+        }
 }
 
 static gboolean
@@ -240,6 +311,9 @@ handle_set_timezone (CsdExportedDateTime     *object,
                 return FALSE;
         }
 
+        /* don't wait for the file monitors to catch up */
+        timezone_cache_invalidate (mechanism);
+
         csd_exported_date_time_complete_set_timezone (object, invocation);
         return TRUE;
 }
@@ -250,15 +324,16 @@ handle_get_timezone (CsdExportedDateTime    *object,
                      GDBusMethodInvocation  *invocation,
                      CsdDatetimeMechanism   *mechanism)
 {
-  gchar *timezone;
+  if (mechanism->timezone == NULL)
+    {
+      mechanism->timezone = system_timezone_find ();
+      killtimer_seconds = KILLTIMER_CACHED_SECONDS;
+    }
 
   reset_killtimer ();
   g_debug ("GetTimezone called");
 
-  timezone = system_timezone_find ();
-
-  csd_exported_date_time_complete_get_timezone (object, invocation, timezone);
-  g_free (timezone);
+  csd_exported_date_time_complete_get_timezone (object, invocation, mechanism->timezone);
 
   return TRUE;
 }
@@ -703,6 +778,9 @@ csd_datetime_mechanism_dispose (GObject *object)
 
         g_clear_object (&mechanism->auth);
 
+        g_clear_pointer (&mechanism->timezone_monitors, g_ptr_array_unref);
+        g_clear_pointer (&mechanism->timezone, g_free);
+
         G_OBJECT_CLASS (csd_datetime_mechanism_parent_class)->dispose (object);
 }
 
@@ -777,6 +855,8 @@ register_mechanism (CsdDatetimeMechanism *mechanism)
                                   mechanism);
         }
 
+        timezone_cache_watch (mechanism);
+
         reset_killtimer ();
 
         return TRUE;
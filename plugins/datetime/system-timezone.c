@@ -594,6 +594,358 @@ recursive_compare (struct stat  *localtime_stat,
 }
 
 
+/*
+ * Resolving /etc/localtime when it is a hard link or a copy means finding
+ * the zoneinfo file with the same inode or content. Instead of walking
+ * the whole zoneinfo tree every time, we keep an index of every file in
+ * it (device and inode, size → path relative to the zoneinfo directory),
+ * built with stat() alone. It is saved to ZONEINFO_INDEX_FILE and checked
+ * against the mtime of every directory of the tree before use, so that
+ * short-lived mechanism processes don't have to walk the tree again.
+ * A copy is then found by comparing /etc/localtime with the few files of
+ * the same size only.
+ */
+#define ZONEINFO_INDEX_FILE    "/var/cache/cinnamon-settings-daemon/zoneinfo.index"
+#define ZONEINFO_INDEX_VERSION 2
+
+static GHashTable *zoneinfo_index_dirs = NULL;     /* relpath → mtime */
+static GHashTable *zoneinfo_index_by_inode = NULL; /* "dev:ino" → relpath */
+static GHashTable *zoneinfo_index_by_size = NULL;  /* size → GPtrArray of relpath */
+
+static char *
+zoneinfo_index_inode_key (struct stat *file_stat)
+{
+        return g_strdup_printf ("%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT,
+                                (guint64) file_stat->st_dev,
+                                (guint64) file_stat->st_ino);
+}
+
+static void
+zoneinfo_index_clear (void)
+{
+        g_clear_pointer (&zoneinfo_index_dirs, g_hash_table_destroy);
+        g_clear_pointer (&zoneinfo_index_by_inode, g_hash_table_destroy);
+        g_clear_pointer (&zoneinfo_index_by_size, g_hash_table_destroy);
+}
+
+static void
+zoneinfo_index_init (void)
+{
+        zoneinfo_index_clear ();
+
+        zoneinfo_index_dirs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                     g_free, g_free);
+        zoneinfo_index_by_inode = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                         g_free, g_free);
+        zoneinfo_index_by_size = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                        g_free,
+                                                        (GDestroyNotify) g_ptr_array_unref);
+}
+
+static void
+zoneinfo_index_add_dir (const char *relpath,
+                        const char *mtime)
+{
+        g_hash_table_replace (zoneinfo_index_dirs, g_strdup (relpath), g_strdup (mtime));
+}
+
+static void
+zoneinfo_index_add_file (const char *inode_key,
+                         const char *size,
+                         const char *relpath)
+{
+        GPtrArray *paths;
+
+        /* the first file wins, as it did for the tree walk */
+        if (!g_hash_table_contains (zoneinfo_index_by_inode, inode_key))
+                g_hash_table_insert (zoneinfo_index_by_inode,
+                                     g_strdup (inode_key), g_strdup (relpath));
+
+        paths = g_hash_table_lookup (zoneinfo_index_by_size, size);
+        if (paths == NULL) {
+                paths = g_ptr_array_new_with_free_func (g_free);
+                g_hash_table_insert (zoneinfo_index_by_size, g_strdup (size), paths);
+        }
+        g_ptr_array_add (paths, g_strdup (relpath));
+}
+
+static void
+zoneinfo_index_build_dir (const char  *path,
+                          const char  *relpath,
+                          struct stat *dir_stat,
+                          GString     *out)
+{
+        GDir       *dir;
+        const char *name;
+        char       *mtime;
+
+        dir = g_dir_open (path, 0, NULL);
+        if (dir == NULL)
+                return;
+
+        mtime = g_strdup_printf ("%" G_GINT64_FORMAT, (gint64) dir_stat->st_mtime);
+        zoneinfo_index_add_dir (relpath, mtime);
+        g_string_append_printf (out, "d %s %s\n", mtime, relpath);
+        g_free (mtime);
+
+        while ((name = g_dir_read_name (dir)) != NULL) {
+                struct stat  file_stat;
+                char        *subpath;
+                char        *subrelpath;
+
+                subpath = g_build_filename (path, name, NULL);
+                if (relpath[0] == '\0')
+                        subrelpath = g_strdup (name);
+                else
+                        subrelpath = g_build_filename (relpath, name, NULL);
+
+                if (g_stat (subpath, &file_stat) != 0) {
+                        /* ignore */
+                } else if (S_ISDIR (file_stat.st_mode)) {
+                        zoneinfo_index_build_dir (subpath, subrelpath, &file_stat, out);
+                } else if (S_ISREG (file_stat.st_mode)) {
+                        char *inode_key;
+                        char *size;
+
+                        inode_key = zoneinfo_index_inode_key (&file_stat);
+                        size = g_strdup_printf ("%" G_GINT64_FORMAT, (gint64) file_stat.st_size);
+
+                        zoneinfo_index_add_file (inode_key, size, subrelpath);
+                        g_string_append_printf (out, "f %s %s %s\n",
+                                                inode_key, size, subrelpath);
+
+                        g_free (inode_key);
+                        g_free (size);
+                }
+
+                g_free (subrelpath);
+                g_free (subpath);
+        }
+
+        g_dir_close (dir);
+}
+
+static gboolean
+zoneinfo_index_build (void)
+{
+        struct stat  dir_stat;
+        GString     *out;
+        char        *index_dir;
+
+        if (g_stat (SYSTEM_ZONEINFODIR, &dir_stat) != 0 ||
+            !S_ISDIR (dir_stat.st_mode))
+                return FALSE;
+
+        zoneinfo_index_init ();
+
+        out = g_string_new (NULL);
+        g_string_append_printf (out, "zoneinfo-index %d\n", ZONEINFO_INDEX_VERSION);
+        zoneinfo_index_build_dir (SYSTEM_ZONEINFODIR, "", &dir_stat, out);
+
+        /* only the mechanism can write there, failing only makes the next
+         * process walk the tree again */
+        index_dir = g_path_get_dirname (ZONEINFO_INDEX_FILE);
+        if (g_mkdir_with_parents (index_dir, 0755) == 0)
+                g_file_set_contents (ZONEINFO_INDEX_FILE, out->str, out->len, NULL);
+        g_free (index_dir);
+
+        g_string_free (out, TRUE);
+
+        return TRUE;
+}
+
+static gboolean
+zoneinfo_index_read (void)
+{
+        char     *content;
+        char    **lines;
+        char     *header;
+        gboolean  retval = FALSE;
+        int       n;
+
+        if (!g_file_get_contents (ZONEINFO_INDEX_FILE, &content, NULL, NULL))
+                return FALSE;
+
+        lines = g_strsplit (content, "\n", 0);
+        g_free (content);
+
+        header = g_strdup_printf ("zoneinfo-index %d", ZONEINFO_INDEX_VERSION);
+        if (lines[0] == NULL || strcmp (lines[0], header) != 0)
+                goto out;
+
+        zoneinfo_index_init ();
+
+        for (n = 1; lines[n] != NULL; n++) {
+                char **fields = NULL;
+
+                if (g_str_has_prefix (lines[n], "d ")) {
+                        /* the top directory has an empty relative path */
+                        fields = g_strsplit (lines[n] + 2, " ", 2);
+                        if (g_strv_length (fields) == 2)
+                                zoneinfo_index_add_dir (fields[1], fields[0]);
+                        else if (g_strv_length (fields) == 1)
+                                zoneinfo_index_add_dir ("", fields[0]);
+                } else if (g_str_has_prefix (lines[n], "f ")) {
+                        fields = g_strsplit (lines[n] + 2, " ", 3);
+                        if (g_strv_length (fields) == 3)
+                                zoneinfo_index_add_file (fields[0], fields[1], fields[2]);
+                }
+                g_strfreev (fields);
+        }
+
+        retval = TRUE;
+out:
+        g_free (header);
+        g_strfreev (lines);
+
+        return retval;
+}
+
+static gboolean
+zoneinfo_index_is_current (void)
+{
+        GHashTableIter  iter;
+        gpointer        key, value;
+        struct stat     dir_stat;
+        gboolean        current = TRUE;
+
+        if (zoneinfo_index_dirs == NULL ||
+            !g_hash_table_contains (zoneinfo_index_dirs, ""))
+                return FALSE;
+
+        /* a file added, removed or renamed anywhere changes the mtime of
+         * its directory, and a new directory the mtime of its parent */
+        g_hash_table_iter_init (&iter, zoneinfo_index_dirs);
+        while (current && g_hash_table_iter_next (&iter, &key, &value)) {
+                char *path;
+
+                path = g_build_filename (SYSTEM_ZONEINFODIR, key, NULL);
+                current = (g_stat (path, &dir_stat) == 0 &&
+                           S_ISDIR (dir_stat.st_mode) &&
+                           g_ascii_strtoll (value, NULL, 10) == (gint64) dir_stat.st_mtime);
+                g_free (path);
+        }
+
+        return current;
+}
+
+/* Makes sure the index matches the zoneinfo tree, reading it from disk or
+ * rebuilding it as needed, or unconditionally rebuilding it if @force */
+static gboolean
+zoneinfo_index_load (gboolean force)
+{
+        if (!force) {
+                if (zoneinfo_index_is_current ())
+                        return TRUE;
+
+                if (zoneinfo_index_read () && zoneinfo_index_is_current ())
+                        return TRUE;
+        }
+
+        return zoneinfo_index_build ();
+}
+
+static char *
+zoneinfo_index_strip_path (const char *relpath)
+{
+        char *path;
+        char *tz;
+
+        path = g_build_filename (SYSTEM_ZONEINFODIR, relpath, NULL);
+        tz = system_timezone_strip_path_if_valid (path);
+        g_free (path);
+
+        return tz;
+}
+
+/* Returns the timezone of the file with the same inode as /etc/localtime;
+ * *found is set if the index could be used at all.  A miss is the normal
+ * result when /etc/localtime is a copy, only a hit on a file that has
+ * been replaced in place makes us rebuild the index. */
+static char *
+zoneinfo_index_lookup_inode (struct stat *localtime_stat,
+                             gboolean    *found)
+{
+        const char *relpath;
+        char       *key;
+        gboolean    force;
+
+        *found = FALSE;
+        key = zoneinfo_index_inode_key (localtime_stat);
+
+        for (force = FALSE; ; force = TRUE) {
+                struct stat  file_stat;
+                char        *path;
+                gboolean     valid = FALSE;
+
+                if (!zoneinfo_index_load (force))
+                        break;
+
+                *found = TRUE;
+                relpath = g_hash_table_lookup (zoneinfo_index_by_inode, key);
+                if (relpath == NULL)
+                        break;
+
+                path = g_build_filename (SYSTEM_ZONEINFODIR, relpath, NULL);
+                if (g_stat (path, &file_stat) == 0)
+                        valid = (file_stat.st_dev == localtime_stat->st_dev &&
+                                 file_stat.st_ino == localtime_stat->st_ino);
+                g_free (path);
+
+                if (valid) {
+                        g_free (key);
+                        return zoneinfo_index_strip_path (relpath);
+                }
+
+                if (force)
+                        break;
+        }
+
+        g_free (key);
+
+        return NULL;
+}
+
+/* Returns the timezone of the first file with the same content as
+ * /etc/localtime, only reading the files of the same size */
+static char *
+zoneinfo_index_lookup_content (const char *localtime_content,
+                               gsize       localtime_content_len,
+                               gboolean   *found)
+{
+        GPtrArray *paths;
+        char      *size;
+        char      *retval = NULL;
+        guint      i;
+
+        *found = FALSE;
+        if (!zoneinfo_index_load (FALSE))
+                return NULL;
+
+        *found = TRUE;
+        size = g_strdup_printf ("%" G_GSIZE_FORMAT, localtime_content_len);
+        paths = g_hash_table_lookup (zoneinfo_index_by_size, size);
+        g_free (size);
+
+        for (i = 0; paths != NULL && i < paths->len && retval == NULL; i++) {
+                const char *relpath = g_ptr_array_index (paths, i);
+                char       *path;
+                char       *content;
+                gsize       content_len;
+
+                path = g_build_filename (SYSTEM_ZONEINFODIR, relpath, NULL);
+                if (g_file_get_contents (path, &content, &content_len, NULL)) {
+                        if (content_len == localtime_content_len &&
+                            memcmp (content, localtime_content, content_len) == 0)
+                                retval = zoneinfo_index_strip_path (relpath);
+                        g_free (content);
+                }
+                g_free (path);
+        }
+
+        return retval;
+}
+
 static gboolean
 files_are_identical_inode (struct stat *a_stat,
                            struct stat *b_stat,
@@ -610,7 +962,9 @@ files_are_identical_inode (struct stat *a_stat,
 static char *
 system_timezone_read_etc_localtime_hardlink (void)
 {
-        struct stat stat_localtime;
+        struct stat  stat_localtime;
+        char        *tz;
+        gboolean     found;
 
         if (g_stat (ETC_LOCALTIME, &stat_localtime) != 0)
                 return NULL;
@@ -618,6 +972,10 @@ system_timezone_read_etc_localtime_hardlink (void)
         if (!S_ISREG (stat_localtime.st_mode))
                 return NULL;
 
+        tz = zoneinfo_index_lookup_inode (&stat_localtime, &found);
+        if (found)
+                return tz;
+
         return recursive_compare (&stat_localtime,
                                   NULL,
                                   0,
@@ -662,6 +1020,7 @@ system_timezone_read_etc_localtime_content (void)
         char        *localtime_content = NULL;
         gsize        localtime_content_len = -1;
         char        *retval;
+        gboolean     found;
 
         if (g_stat (ETC_LOCALTIME, &stat_localtime) != 0)
                 return NULL;
@@ -675,11 +1034,15 @@ system_timezone_read_etc_localtime_content (void)
                                   NULL))
                 return NULL;
 
-        retval = recursive_compare (&stat_localtime,
-                                   localtime_content,
-                                   localtime_content_len,
-                                   SYSTEM_ZONEINFODIR,
-                                   files_are_identical_content);
+        retval = zoneinfo_index_lookup_content (localtime_content,
+                                                localtime_content_len,
+                                                &found);
+        if (!found)
+                retval = recursive_compare (&stat_localtime,
+                                            localtime_content,
+                                            localtime_content_len,
+                                            SYSTEM_ZONEINFODIR,
+                                            files_are_identical_content);
 
         g_free (localtime_content);
 
@@ -742,6 +1105,24 @@ system_timezone_find (void)
         return g_strdup ("UTC");
 }
 
+/* The files system_timezone_find() looks at, for callers that want to
+ * know when its answer may have changed */
+const char * const *
+system_timezone_get_config_files (void)
+{
+        static const char * const files[] = {
+                ETC_LOCALTIME,
+                ETC_TIMEZONE,
+                ETC_SYSCONFIG_CLOCK,
+                ETC_TIMEZONE_MAJ,
+                ETC_RC_CONF,
+                ETC_CONF_D_CLOCK,
+                NULL
+        };
+
+        return files;
+}
+
 /*
  *
  * Now, setting the timezone.
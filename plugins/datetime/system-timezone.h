@@ -72,6 +72,7 @@ typedef enum
 } SystemTimezoneError;
 
 char *system_timezone_find (void);
+const char * const *system_timezone_get_config_files (void);
 
 gboolean system_timezone_set (const char  *tz,
                               GError     **error);
@@ -40,7 +40,23 @@
 
 #define GIGABYTE                   1024 * 1024 * 1024
 
+/* The check interval backs off from CHECK_EVERY_X_SECONDS up to
+ * CHECK_MAX_SECONDS while every volume has plenty of headroom, and
+ * drops to CHECK_MIN_SECONDS while one is filling up quickly. */
 #define CHECK_EVERY_X_SECONDS      60
+#define CHECK_MIN_SECONDS          15
+#define CHECK_MAX_SECONDS          (32 * 60)
+
+/* Free space samples kept per mount to estimate its fill rate */
+#define FILL_RATE_SAMPLES          8
+#define FILL_RATE_MIN_SAMPLES      3
+
+/* Warn about volumes that are close to the low space thresholds and
+ * predicted to cross them within this time.  The prediction needs samples
+ * spanning at least FILL_RATE_MIN_SPAN seconds, which 8 samples taken at
+ * the shortest interval still do. */
+#define FULL_SOON_SECONDS          (60 * 60)
+#define FILL_RATE_MIN_SPAN         90
 
 #define DISK_SPACE_ANALYZER        "baobab"
 
@@ -51,15 +67,35 @@
 #define SETTINGS_MIN_NOTIFY_PERIOD    "min-notify-period"
 #define SETTINGS_IGNORE_PATHS         "ignore-paths"
 
+typedef struct
+{
+        gint64 time;
+        guint64 free;
+} LdsmSample;
+
 typedef struct
 {
         GUnixMountEntry *mount;
         struct statvfs buf;
         time_t notify_time;
+
+        /* ring buffer of free space samples */
+        LdsmSample samples[FILL_RATE_SAMPLES];
+        guint n_samples;
+        guint sample_head;
+
+        /* seconds until the low space thresholds are crossed and until
+         * full at the current fill rate, or -1 if the rate isn't known
+         * well enough to predict them */
+        gint64 time_to_low;
+        gint64 time_to_full;
+        gboolean readonly;
 } LdsmMountInfo;
 
 static GHashTable        *ldsm_notified_hash = NULL;
 static unsigned int       ldsm_timeout_id = 0;
+static unsigned int       ldsm_check_interval = CHECK_EVERY_X_SECONDS;
+static GList             *ldsm_mounts = NULL;
 static GUnixMountMonitor *ldsm_monitor = NULL;
 static double             free_percent_notify = 0.05;
 static double             free_percent_notify_again = 0.01;
@@ -325,6 +361,21 @@ ldsm_notify_for_mount (LdsmMountInfo *mount,
                 }
         }
 
+        if (mount->time_to_full >= 0 && mount->time_to_full < FULL_SOON_SECONDS) {
+                gint minutes;
+                g_autofree gchar *full_soon_str = NULL;
+                gchar *full_body;
+
+                minutes = MAX (1, (mount->time_to_full + 59) / 60);
+                full_soon_str = g_strdup_printf (ngettext ("At the current rate it will be full in about %d minute.",
+                                                           "At the current rate it will be full in about %d minutes.",
+                                                           minutes),
+                                                 minutes);
+                full_body = g_strdup_printf ("%s  %s", body, full_soon_str);
+                g_free (body);
+                body = full_body;
+        }
+
         notification = notify_notification_new (summary, body, "xsi-drive-harddisk-symbolic");
         g_signal_connect (notification,
                           "closed",
@@ -374,6 +425,10 @@ ldsm_mount_has_space (LdsmMountInfo *mount)
 {
         gdouble free_space;
 
+        /* filling up steadily, warn before the thresholds are reached */
+        if (mount->time_to_low >= 0 && mount->time_to_low < FULL_SOON_SECONDS)
+                return FALSE;
+
         free_space = (double) mount->buf.f_bavail / (double) mount->buf.f_blocks;
         /* enough free space, nothing to do */
         if (free_space > free_percent_notify)
@@ -386,6 +441,142 @@ ldsm_mount_has_space (LdsmMountInfo *mount)
         return FALSE;
 }
 
+static guint64
+ldsm_mount_get_free (LdsmMountInfo *mount)
+{
+        return (guint64) mount->buf.f_frsize * (guint64) mount->buf.f_bavail;
+}
+
+/* Free space left before ldsm_mount_has_space() starts failing */
+static gint64
+ldsm_mount_get_headroom (LdsmMountInfo *mount)
+{
+        gdouble low_percent;
+        gdouble low_size;
+
+        low_percent = free_percent_notify * (gdouble) mount->buf.f_blocks * (gdouble) mount->buf.f_frsize;
+        low_size = (gdouble) free_size_gb_no_notify * GIGABYTE;
+
+        return (gint64) ldsm_mount_get_free (mount) - (gint64) MIN (low_percent, low_size);
+}
+
+static void
+ldsm_mount_add_sample (LdsmMountInfo *mount,
+                       gint64         now)
+{
+        LdsmSample *sample;
+
+        sample = &mount->samples[mount->sample_head];
+        sample->time = now;
+        sample->free = ldsm_mount_get_free (mount);
+
+        mount->sample_head = (mount->sample_head + 1) % FILL_RATE_SAMPLES;
+        if (mount->n_samples < FILL_RATE_SAMPLES)
+                mount->n_samples++;
+}
+
+/* Seconds between the oldest and the newest sample */
+static gint64
+ldsm_mount_get_sample_span (LdsmMountInfo *mount)
+{
+        gint64 oldest = G_MAXINT64;
+        gint64 newest = G_MININT64;
+        guint i;
+
+        for (i = 0; i < mount->n_samples; i++) {
+                oldest = MIN (oldest, mount->samples[i].time);
+                newest = MAX (newest, mount->samples[i].time);
+        }
+
+        return mount->n_samples > 0 ? newest - oldest : 0;
+}
+
+/* Least-squares slope of the free space samples, in bytes consumed per
+ * second; negative when space is being freed. */
+static gdouble
+ldsm_mount_get_fill_rate (LdsmMountInfo *mount)
+{
+        gdouble mean_time = 0;
+        gdouble mean_free = 0;
+        gdouble covariance = 0;
+        gdouble variance = 0;
+        gint64 origin;
+        guint i;
+
+        if (mount->n_samples < FILL_RATE_MIN_SAMPLES)
+                return 0;
+
+        /* relative times keep the sums well inside double precision */
+        origin = mount->samples[0].time;
+
+        for (i = 0; i < mount->n_samples; i++) {
+                mean_time += mount->samples[i].time - origin;
+                mean_free += mount->samples[i].free;
+        }
+        mean_time /= mount->n_samples;
+        mean_free /= mount->n_samples;
+
+        for (i = 0; i < mount->n_samples; i++) {
+                gdouble dt = (mount->samples[i].time - origin) - mean_time;
+
+                covariance += dt * (mount->samples[i].free - mean_free);
+                variance += dt * dt;
+        }
+
+        if (variance == 0)
+                return 0;
+
+        return -covariance / variance;
+}
+
+/* Returns the interval this mount wants to be checked at, or 0 if it
+ * is happy with whatever the other mounts want. */
+static guint
+ldsm_mount_get_check_interval (LdsmMountInfo *mount,
+                               gint64         now)
+{
+        gint64 headroom;
+        guint64 free_space;
+        gdouble rate;
+        gdouble crossing;
+        guint interval = 0;
+
+        ldsm_mount_add_sample (mount, now);
+
+        headroom = ldsm_mount_get_headroom (mount);
+        free_space = ldsm_mount_get_free (mount);
+        rate = ldsm_mount_get_fill_rate (mount);
+
+        /* a short burst, e.g. a large copy, isn't a trend yet, and a
+         * steep one is only worth a warning close to the thresholds */
+        if (rate > 0 &&
+            headroom < (gint64) free_space / 2 &&
+            ldsm_mount_get_sample_span (mount) >= FILL_RATE_MIN_SPAN) {
+                mount->time_to_low = headroom > 0 ? (gint64) (headroom / rate) : 0;
+                mount->time_to_full = (gint64) (free_space / rate);
+        } else {
+                mount->time_to_low = -1;
+                mount->time_to_full = -1;
+        }
+
+        /* close to (or past) the threshold */
+        if (headroom < (gint64) free_space / 2)
+                interval = CHECK_EVERY_X_SECONDS;
+
+        if (rate > 0) {
+                guint crossing_interval;
+
+                /* look again halfway to the predicted threshold crossing,
+                 * or to the volume filling up once it is past it */
+                crossing = (headroom > 0 ? headroom : (gint64) free_space) / rate;
+                crossing_interval = CLAMP (crossing / 2, CHECK_MIN_SECONDS, CHECK_MAX_SECONDS);
+                if (interval == 0 || crossing_interval < interval)
+                        interval = crossing_interval;
+        }
+
+        return interval;
+}
+
 static gboolean
 ldsm_mount_is_virtual (LdsmMountInfo *mount)
 {
@@ -425,6 +616,20 @@ ldsm_free_mount_info (gpointer data)
         g_free (mount);
 }
 
+static LdsmMountInfo *
+ldsm_copy_mount_info (LdsmMountInfo *mount)
+{
+        LdsmMountInfo *copy;
+
+        copy = g_new0 (LdsmMountInfo, 1);
+        copy->mount = g_unix_mount_copy (mount->mount);
+        copy->buf = mount->buf;
+        copy->time_to_low = mount->time_to_low;
+        copy->time_to_full = mount->time_to_full;
+
+        return copy;
+}
+
 static void
 ldsm_maybe_warn_mounts (GList *mounts,
                         gboolean multiple_volumes,
@@ -491,25 +696,34 @@ ldsm_maybe_warn_mounts (GList *mounts,
         }
 }
 
-static gboolean
-ldsm_check_all_mounts (gpointer data)
+/* Rebuilds the list of mounts to watch. This only runs when the mount
+ * table changes, the periodic checks just statvfs() the cached list. */
+static void
+ldsm_refresh_mounts (void)
 {
-        GList *mounts;
+        GHashTable *previous;
+        GList *mount_points;
         GList *l;
-        GList *check_mounts = NULL;
-        GList *full_mounts = NULL;
-        guint number_of_mounts;
-        guint number_of_full_mounts;
-        gboolean multiple_volumes = FALSE;
-        gboolean other_usable_volumes = FALSE;
+
+        /* keep the samples of mounts that are still around */
+        previous = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          NULL, ldsm_free_mount_info);
+        for (l = ldsm_mounts; l != NULL; l = l->next) {
+                LdsmMountInfo *mount_info = l->data;
+
+                g_hash_table_replace (previous,
+                                      (gpointer) g_unix_mount_get_mount_path (mount_info->mount),
+                                      mount_info);
+        }
+        g_clear_pointer (&ldsm_mounts, g_list_free);
 
         /* We iterate through the static mounts in /etc/fstab first, seeing if
          * they're mounted by checking if the GUnixMountPoint has a corresponding GUnixMountEntry.
          * Iterating through the static mounts means we automatically ignore dynamically mounted media.
          */
-        mounts = g_unix_mount_points_get (time_read);
+        mount_points = g_unix_mount_points_get (time_read);
 
-        for (l = mounts; l != NULL; l = l->next) {
+        for (l = mount_points; l != NULL; l = l->next) {
                 GUnixMountPoint *mount_point = l->data;
                 GUnixMountEntry *mount;
                 LdsmMountInfo *mount_info;
@@ -523,40 +737,89 @@ ldsm_check_all_mounts (gpointer data)
                         continue;
                 }
 
-                mount_info = g_new0 (LdsmMountInfo, 1);
-                mount_info->mount = mount;
-
                 path = g_unix_mount_get_mount_path (mount);
 
-                if (g_unix_mount_is_readonly (mount)) {
-                        ldsm_free_mount_info (mount_info);
+                if (g_unix_mount_is_readonly (mount) ||
+                    ldsm_mount_is_user_ignore (path) ||
+                    csd_should_ignore_unix_mount (mount)) {
+                        g_unix_mount_free (mount);
                         continue;
                 }
 
-                if (ldsm_mount_is_user_ignore (path)) {
-                        ldsm_free_mount_info (mount_info);
-                        continue;
+                mount_info = g_hash_table_lookup (previous, path);
+                if (mount_info != NULL) {
+                        g_hash_table_steal (previous, path);
+                        g_unix_mount_free (mount_info->mount);
+                        mount_info->readonly = FALSE;
+                } else {
+                        mount_info = g_new0 (LdsmMountInfo, 1);
+                        mount_info->time_to_low = -1;
+                        mount_info->time_to_full = -1;
                 }
+                mount_info->mount = mount;
 
-                if (csd_should_ignore_unix_mount (mount)) {
-                        ldsm_free_mount_info (mount_info);
+                ldsm_mounts = g_list_prepend (ldsm_mounts, mount_info);
+        }
+
+        g_list_free (mount_points);
+        g_hash_table_destroy (previous);
+}
+
+static gboolean ldsm_check_timeout (gpointer data);
+
+static void
+ldsm_schedule_check (guint interval)
+{
+        if (ldsm_timeout_id) {
+                g_source_remove (ldsm_timeout_id);
+                ldsm_timeout_id = 0;
+        }
+
+        ldsm_check_interval = interval;
+        ldsm_timeout_id = g_timeout_add_seconds (interval, ldsm_check_timeout, NULL);
+}
+
+static void
+ldsm_check_all_mounts (void)
+{
+        GList *l;
+        GList *check_mounts = NULL;
+        GList *full_mounts = NULL;
+        guint number_of_mounts;
+        guint number_of_full_mounts;
+        gboolean multiple_volumes = FALSE;
+        gboolean other_usable_volumes = FALSE;
+        guint interval = 0;
+        gint64 now;
+
+        now = g_get_monotonic_time () / G_USEC_PER_SEC;
+
+        for (l = ldsm_mounts; l != NULL; l = l->next) {
+                LdsmMountInfo *mount_info = l->data;
+                guint mount_interval;
+
+                /* read-only at the superblock (e.g. a read-only bind mount
+                 * of a writable volume): nothing to watch until remounted */
+                if (mount_info->readonly)
                         continue;
-                }
 
-                if (statvfs (path, &mount_info->buf) != 0) {
-                        ldsm_free_mount_info (mount_info);
+                if (statvfs (g_unix_mount_get_mount_path (mount_info->mount), &mount_info->buf) != 0)
                         continue;
-                }
 
-                if (ldsm_mount_is_virtual (mount_info)) {
-                        ldsm_free_mount_info (mount_info);
+                if (mount_info->buf.f_flag & ST_RDONLY) {
+                        mount_info->readonly = TRUE;
                         continue;
                 }
 
-                check_mounts = g_list_prepend (check_mounts, mount_info);
-        }
+                if (ldsm_mount_is_virtual (mount_info))
+                        continue;
+
+                mount_interval = ldsm_mount_get_check_interval (mount_info, now);
+                if (mount_interval > 0 && (interval == 0 || mount_interval < interval))
+                        interval = mount_interval;
 
-        g_list_free (mounts);
+                check_mounts = g_list_prepend (check_mounts, ldsm_copy_mount_info (mount_info));
+        }
 
         number_of_mounts = g_list_length (check_mounts);
         if (number_of_mounts > 1)
@@ -583,7 +846,21 @@ ldsm_check_all_mounts (gpointer data)
         g_list_free (check_mounts);
         g_list_free (full_mounts);
 
-        return TRUE;
+        /* nothing is filling up, back off */
+        if (interval == 0)
+                interval = MIN (ldsm_check_interval * 2, CHECK_MAX_SECONDS);
+
+        g_debug ("next disk space check in %u seconds", interval);
+        ldsm_schedule_check (interval);
+}
+
+static gboolean
+ldsm_check_timeout (gpointer data)
+{
+        ldsm_timeout_id = 0;
+        ldsm_check_all_mounts ();
+
+        return G_SOURCE_REMOVE;
 }
 
 static gboolean
@@ -618,16 +895,12 @@ ldsm_mounts_changed (GObject  *monitor,
                                      ldsm_is_hash_item_not_in_mounts, mounts);
         g_list_free_full (mounts, (GDestroyNotify) g_unix_mount_free);
 
-        /* check the status now, for the new mounts */
-        ldsm_check_all_mounts (NULL);
+        ldsm_refresh_mounts ();
 
-        /* and reset the timeout */
-        if (ldsm_timeout_id) {
-            g_source_remove (ldsm_timeout_id);
-            ldsm_timeout_id = 0;
-        }
-        ldsm_timeout_id = g_timeout_add_seconds (CHECK_EVERY_X_SECONDS,
-                                                 ldsm_check_all_mounts, NULL);
+        /* check the status now, for the new mounts, and start
+         * backing off again from there */
+        ldsm_check_interval = CHECK_EVERY_X_SECONDS / 2;
+        ldsm_check_all_mounts ();
 }
 
 static gboolean
@@ -687,6 +960,10 @@ csd_ldsm_update_config (GSettings *settings,
                         gpointer user_data)
 {
         csd_ldsm_get_config ();
+
+        /* the ignore list or the thresholds may have changed */
+        ldsm_refresh_mounts ();
+        ldsm_schedule_check (CHECK_EVERY_X_SECONDS);
 }
 
 void
@@ -709,12 +986,17 @@ csd_ldsm_setup (gboolean check_now)
         ldsm_monitor = g_unix_mount_monitor_get ();
         g_signal_connect (ldsm_monitor, "mounts-changed",
                           G_CALLBACK (ldsm_mounts_changed), NULL);
+        g_signal_connect (ldsm_monitor, "mountpoints-changed",
+                          G_CALLBACK (ldsm_mounts_changed), NULL);
 
-        if (check_now)
-                ldsm_check_all_mounts (NULL);
+        ldsm_refresh_mounts ();
 
-        ldsm_timeout_id = g_timeout_add_seconds (CHECK_EVERY_X_SECONDS,
-                                                 ldsm_check_all_mounts, NULL);
+        if (check_now) {
+                ldsm_check_interval = CHECK_EVERY_X_SECONDS / 2;
+                ldsm_check_all_mounts ();
+        } else {
+                ldsm_schedule_check (CHECK_EVERY_X_SECONDS);
+        }
 }
 
 void
@@ -725,7 +1007,13 @@ csd_ldsm_clean (void)
             ldsm_timeout_id = 0;
         }
 
+        g_list_free_full (ldsm_mounts, ldsm_free_mount_info);
+        ldsm_mounts = NULL;
+        ldsm_check_interval = CHECK_EVERY_X_SECONDS;
+
         g_clear_pointer (&ldsm_notified_hash, g_hash_table_destroy);
+        if (ldsm_monitor != NULL)
+                g_signal_handlers_disconnect_by_func (ldsm_monitor, ldsm_mounts_changed, NULL);
         g_clear_object (&ldsm_monitor);
         g_clear_object (&settings);
         if (notification != NULL)
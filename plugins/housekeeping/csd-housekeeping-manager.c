@@ -21,7 +21,11 @@
 
 #include <gio/gio.h>
 #include <glib/gstdio.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "cinnamon-settings-profile.h"
 #include "csd-housekeeping-manager.h"
@@ -38,10 +42,19 @@
 #define THUMB_AGE_KEY "maximum-age"
 #define THUMB_SIZE_KEY "maximum-size"
 
+/* Directory entries or records handled per purge slice */
+#define THUMB_PURGE_SLICE 512
+
+typedef struct ThumbPurge ThumbPurge;
+
 struct CsdHousekeepingManagerPrivate {
         GSettings *settings;
         guint long_term_cb;
         guint short_term_cb;
+
+        ThumbPurge *purge;
+        GThread *purge_thread;
+        guint purge_idle_id;
 };
 
 
@@ -52,98 +65,6 @@ G_DEFINE_TYPE (CsdHousekeepingManager, csd_housekeeping_manager, G_TYPE_OBJECT)
 static gpointer manager_object = NULL;
 
 
-typedef struct {
-        glong now;
-        glong max_age;
-        goffset total_size;
-        goffset max_size;
-} PurgeData;
-
-
-typedef struct {
-        time_t  mtime;
-        char   *path;
-        glong   size;
-} ThumbData;
-
-
-static void
-thumb_data_free (gpointer data)
-{
-        ThumbData *info = data;
-
-        if (info) {
-                g_free (info->path);
-                g_free (info);
-        }
-}
-
-static GList *
-read_dir_for_purge (const char *path, GList *files)
-{
-        GFile           *read_path;
-        GFileEnumerator *enum_dir;
-
-        read_path = g_file_new_for_path (path);
-        enum_dir = g_file_enumerate_children (read_path,
-                                              G_FILE_ATTRIBUTE_STANDARD_NAME ","
-                                              G_FILE_ATTRIBUTE_TIME_MODIFIED ","
-                                              G_FILE_ATTRIBUTE_STANDARD_SIZE,
-                                              G_FILE_QUERY_INFO_NONE,
-                                              NULL,
-                                              NULL);
-
-        if (enum_dir != NULL) {
-                GFileInfo *info;
-                while ((info = g_file_enumerator_next_file (enum_dir, NULL, NULL)) != NULL) {
-                        const char *name;
-                        name = g_file_info_get_name (info);
-
-                        if (strlen (name) == 36 && strcmp (name + 32, ".png") == 0) {
-                                ThumbData *td;
-                                GFile     *entry;
-                                char      *entry_path;
-                                GTimeVal   mod_time;
-
-                                entry = g_file_get_child (read_path, name);
-                                entry_path = g_file_get_path (entry);
-                                g_object_unref (entry);
-
-                                g_file_info_get_modification_time (info, &mod_time);
-
-                                td = g_new0 (ThumbData, 1);
-                                td->path = entry_path;
-                                td->mtime = mod_time.tv_sec;
-                                td->size = g_file_info_get_size (info);
-
-                                files = g_list_prepend (files, td);
-                        }
-                        g_object_unref (info);
-                }
-                g_object_unref (enum_dir);
-        }
-        g_object_unref (read_path);
-
-        return files;
-}
-
-static void
-purge_old_thumbnails (ThumbData *info, PurgeData *purge_data)
-{
-        if ((purge_data->now - info->mtime) > purge_data->max_age) {
-                g_unlink (info->path);
-                info->size = 0;
-        } else {
-                purge_data->total_size += info->size;
-        }
-}
-
-static int
-sort_file_mtime (ThumbData *file1, ThumbData *file2)
-{
-        return file1->mtime - file2->mtime;
-}
-
 static char **
 get_thumbnail_dirs (void)
 {
@@ -197,46 +118,359 @@ get_thumbnail_dirs (void)
         return (char **) g_ptr_array_free (array, FALSE);
 }
 
+/* Thumbnail records are kept in a flat array and the file names in a
+ * single arena, so that a cache with hundreds of thousands of entries
+ * costs a couple of allocations rather than one per file. */
+typedef struct {
+        gint64   mtime;
+        goffset  size;
+        guint32  name_offset;
+        guint32  dir_index;
+} ThumbRecord;
+
+typedef enum {
+        THUMB_PURGE_SCAN,
+        THUMB_PURGE_AGE,
+        THUMB_PURGE_SIZE,
+        THUMB_PURGE_DONE
+} ThumbPurgePhase;
+
+struct ThumbPurge {
+        char            **paths;
+        int              *dir_fds;
+        guint             n_dirs;
+        guint             dir_index;
+        DIR              *dir;
+
+        GString          *arena;
+        GArray           *records;
+        guint             cursor;
+        guint             kept;
+
+        gint64            now;
+        gint64            max_age;
+        goffset           total_size;
+        goffset           max_size;
+
+        ThumbPurgePhase   phase;
+        guint             n_unlinked;
+
+        gint              cancelled;
+        GSource          *done_source;
+};
+
+static ThumbPurge *
+thumb_purge_new (GSettings *settings)
+{
+        ThumbPurge *purge;
+        guint       i;
+
+        purge = g_new0 (ThumbPurge, 1);
+        purge->paths = get_thumbnail_dirs ();
+        purge->n_dirs = g_strv_length (purge->paths);
+        purge->dir_fds = g_new (int, purge->n_dirs);
+        for (i = 0; i < purge->n_dirs; i++)
+                purge->dir_fds[i] = -1;
+
+        purge->arena = g_string_sized_new (4096);
+        purge->records = g_array_new (FALSE, FALSE, sizeof (ThumbRecord));
+
+        purge->now = g_get_real_time () / G_USEC_PER_SEC;
+        purge->max_age = (gint64) g_settings_get_int (settings, THUMB_AGE_KEY) * 24 * 60 * 60;
+        purge->max_size = (goffset) g_settings_get_int (settings, THUMB_SIZE_KEY) * 1024 * 1024;
+        purge->phase = THUMB_PURGE_SCAN;
+
+        return purge;
+}
+
+static void
+thumb_purge_free (ThumbPurge *purge)
+{
+        guint i;
+
+        if (purge->dir != NULL)
+                closedir (purge->dir);
+        for (i = 0; i < purge->n_dirs; i++) {
+                if (purge->dir_fds[i] >= 0)
+                        close (purge->dir_fds[i]);
+        }
+        g_free (purge->dir_fds);
+        g_strfreev (purge->paths);
+        if (purge->arena != NULL)
+                g_string_free (purge->arena, TRUE);
+        if (purge->records != NULL)
+                g_array_free (purge->records, TRUE);
+        if (purge->done_source != NULL) {
+                g_source_destroy (purge->done_source);
+                g_source_unref (purge->done_source);
+        }
+        g_free (purge);
+}
+
+/* Drops the records as soon as the worker is done with them, they can
+ * take megabytes and the main loop may not reap the thread right away */
+static void
+thumb_purge_release_records (ThumbPurge *purge)
+{
+        g_string_free (purge->arena, TRUE);
+        purge->arena = NULL;
+        g_array_free (purge->records, TRUE);
+        purge->records = NULL;
+}
+
+static void
+thumb_purge_unlink (ThumbPurge *purge, const ThumbRecord *record)
+{
+        if (unlinkat (purge->dir_fds[record->dir_index],
+                      purge->arena->str + record->name_offset, 0) == 0)
+                purge->n_unlinked++;
+}
+
+/* Reads a single directory entry; returns FALSE once every directory
+ * has been scanned. */
+static gboolean
+thumb_purge_scan_next (ThumbPurge *purge)
+{
+        struct dirent *entry;
+        struct stat    st;
+        ThumbRecord    record;
+        int            fd;
+
+        if (purge->dir == NULL) {
+                if (purge->dir_index >= purge->n_dirs)
+                        return FALSE;
+
+                fd = open (purge->paths[purge->dir_index], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (fd >= 0) {
+                        /* keep our own descriptor for unlinkat(), the
+                         * directory stream owns the duplicate */
+                        purge->dir_fds[purge->dir_index] = fd;
+                        fd = fcntl (fd, F_DUPFD_CLOEXEC, 0);
+                        if (fd >= 0) {
+                                purge->dir = fdopendir (fd);
+                                if (purge->dir == NULL)
+                                        close (fd);
+                        }
+                }
+
+                if (purge->dir == NULL)
+                        purge->dir_index++;
+                return TRUE;
+        }
+
+        entry = readdir (purge->dir);
+        if (entry == NULL) {
+                closedir (purge->dir);
+                purge->dir = NULL;
+                purge->dir_index++;
+                return TRUE;
+        }
+
+        if (strlen (entry->d_name) != 36 || strcmp (entry->d_name + 32, ".png") != 0)
+                return TRUE;
+
+        if (fstatat (purge->dir_fds[purge->dir_index], entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+            S_ISDIR (st.st_mode))
+                return TRUE;
+
+        record.mtime = st.st_mtime;
+        record.size = st.st_size;
+        record.name_offset = purge->arena->len;
+        record.dir_index = purge->dir_index;
+        g_string_append_len (purge->arena, entry->d_name, 37);
+        g_array_append_val (purge->records, record);
+
+        return TRUE;
+}
+
+static gint
+thumb_record_compare_mtime (gconstpointer a, gconstpointer b)
+{
+        const ThumbRecord *record1 = a;
+        const ThumbRecord *record2 = b;
+
+        return (record1->mtime > record2->mtime) - (record1->mtime < record2->mtime);
+}
+
+/* Removes thumbnails older than the maximum age and compacts the
+ * surviving records in place. */
+static void
+thumb_purge_check_age (ThumbPurge *purge)
+{
+        ThumbRecord *record;
+
+        record = &g_array_index (purge->records, ThumbRecord, purge->cursor++);
+        if (purge->max_age >= 0 && (purge->now - record->mtime) > purge->max_age) {
+                thumb_purge_unlink (purge, record);
+                return;
+        }
+
+        purge->total_size += record->size;
+        g_array_index (purge->records, ThumbRecord, purge->kept++) = *record;
+}
+
+/* Runs at most @budget steps of the purge, where a step is a single
+ * directory entry or record; returns TRUE while work remains. */
+static gboolean
+thumb_purge_run (ThumbPurge *purge, guint budget)
+{
+        ThumbRecord *record;
+
+        for (; budget > 0; budget--) {
+                switch (purge->phase) {
+                case THUMB_PURGE_SCAN:
+                        if (!thumb_purge_scan_next (purge)) {
+                                purge->phase = THUMB_PURGE_AGE;
+                                purge->cursor = 0;
+                                purge->kept = 0;
+                        }
+                        break;
+                case THUMB_PURGE_AGE:
+                        if (purge->cursor < purge->records->len) {
+                                thumb_purge_check_age (purge);
+                                break;
+                        }
+
+                        g_array_set_size (purge->records, purge->kept);
+                        if (purge->max_size >= 0 && purge->total_size > purge->max_size) {
+                                g_array_sort (purge->records, thumb_record_compare_mtime);
+                                purge->phase = THUMB_PURGE_SIZE;
+                                purge->cursor = 0;
+                        } else {
+                                purge->phase = THUMB_PURGE_DONE;
+                        }
+                        break;
+                case THUMB_PURGE_SIZE:
+                        if (purge->cursor >= purge->records->len ||
+                            purge->total_size <= purge->max_size) {
+                                purge->phase = THUMB_PURGE_DONE;
+                                break;
+                        }
+
+                        record = &g_array_index (purge->records, ThumbRecord, purge->cursor++);
+                        thumb_purge_unlink (purge, record);
+                        purge->total_size -= record->size;
+                        break;
+                case THUMB_PURGE_DONE:
+                        return FALSE;
+                }
+        }
+
+        return purge->phase != THUMB_PURGE_DONE;
+}
+
+static void
+thumb_purge_report (ThumbPurge *purge)
+{
+        g_debug ("housekeeping: thumbnail purge %s, %u entries scanned, %u removed",
+                 purge->phase == THUMB_PURGE_DONE ? "finished" : "cancelled",
+                 purge->records->len, purge->n_unlinked);
+}
+
+static gpointer
+thumb_purge_thread (gpointer data)
+{
+        ThumbPurge *purge = data;
+
+        while (!g_atomic_int_get (&purge->cancelled) &&
+               thumb_purge_run (purge, THUMB_PURGE_SLICE))
+                ;
+
+        thumb_purge_report (purge);
+        thumb_purge_release_records (purge);
+
+        /* have the main loop join us */
+        g_source_attach (purge->done_source, NULL);
+
+        return NULL;
+}
+
+static void
+purge_thumbnail_cache_stop (CsdHousekeepingManager *manager)
+{
+        CsdHousekeepingManagerPrivate *p = manager->priv;
+
+        if (p->purge_thread != NULL) {
+                g_atomic_int_set (&p->purge->cancelled, TRUE);
+                g_thread_join (p->purge_thread);
+                p->purge_thread = NULL;
+        }
+
+        if (p->purge_idle_id != 0) {
+                g_source_remove (p->purge_idle_id);
+                p->purge_idle_id = 0;
+        }
+
+        g_clear_pointer (&p->purge, thumb_purge_free);
+}
+
+static gboolean
+purge_thumbnail_cache_reap (CsdHousekeepingManager *manager)
+{
+        CsdHousekeepingManagerPrivate *p = manager->priv;
+
+        g_thread_join (p->purge_thread);
+        p->purge_thread = NULL;
+        g_clear_pointer (&p->purge, thumb_purge_free);
+
+        return G_SOURCE_REMOVE;
+}
+
+static gboolean
+purge_thumbnail_cache_idle (CsdHousekeepingManager *manager)
+{
+        CsdHousekeepingManagerPrivate *p = manager->priv;
+
+        if (thumb_purge_run (p->purge, THUMB_PURGE_SLICE))
+                return TRUE;
+
+        thumb_purge_report (p->purge);
+        g_clear_pointer (&p->purge, thumb_purge_free);
+        p->purge_idle_id = 0;
+
+        return FALSE;
+}
+
 static void
 purge_thumbnail_cache (CsdHousekeepingManager *manager)
 {
+        CsdHousekeepingManagerPrivate *p = manager->priv;
+        GError *error = NULL;
 
-        char     **paths;
-        GList     *files;
-        PurgeData  purge_data;
-        GTimeVal   current_time;
-        guint      i;
+        if (p->purge != NULL) {
+                g_debug ("housekeeping: thumbnail purge already in progress");
+                return;
+        }
 
         g_debug ("housekeeping: checking thumbnail cache size and freshness");
 
-        paths = get_thumbnail_dirs ();
-        files = NULL;
-        for (i = 0; paths[i] != NULL; i++)
-                files = read_dir_for_purge (paths[i], files);
-        g_strfreev (paths);
-
-        g_get_current_time (&current_time);
-
-        purge_data.now = current_time.tv_sec;
-        purge_data.max_age = g_settings_get_int (manager->priv->settings, THUMB_AGE_KEY) * 24 * 60 * 60;
-        purge_data.max_size = g_settings_get_int (manager->priv->settings, THUMB_SIZE_KEY) * 1024 * 1024;
-        purge_data.total_size = 0;
-
-        if (purge_data.max_age >= 0)
-                g_list_foreach (files, (GFunc) purge_old_thumbnails, &purge_data);
-
-        if ((purge_data.total_size > purge_data.max_size) && (purge_data.max_size >= 0)) {
-                GList *scan;
-                files = g_list_sort (files, (GCompareFunc) sort_file_mtime);
-                for (scan = files; scan && (purge_data.total_size > purge_data.max_size); scan = scan->next) {
-                        ThumbData *info = scan->data;
-                        g_unlink (info->path);
-                        purge_data.total_size -= info->size;
-                }
+        p->purge = thumb_purge_new (p->settings);
+        p->purge->done_source = g_idle_source_new ();
+        g_source_set_callback (p->purge->done_source,
+                               (GSourceFunc) purge_thumbnail_cache_reap,
+                               manager, NULL);
+        p->purge_thread = g_thread_try_new ("csd-thumb-purge", thumb_purge_thread, p->purge, &error);
+        if (p->purge_thread == NULL) {
+                /* no thread, walk the cache a slice at a time from the main loop */
+                g_debug ("housekeeping: purging thumbnails incrementally: %s", error->message);
+                g_error_free (error);
+                p->purge_idle_id = g_idle_add_full (G_PRIORITY_LOW,
+                                                    (GSourceFunc) purge_thumbnail_cache_idle,
+                                                    manager, NULL);
         }
+}
+
+static void
+purge_thumbnail_cache_sync (CsdHousekeepingManager *manager)
+{
+        ThumbPurge *purge;
 
-        g_list_foreach (files, (GFunc) thumb_data_free, NULL);
-        g_list_free (files);
+        purge_thumbnail_cache_stop (manager);
+
+        purge = thumb_purge_new (manager->priv->settings);
+        thumb_purge_run (purge, G_MAXUINT);
+        thumb_purge_report (purge);
+        thumb_purge_free (purge);
 }
 
 static gboolean
@@ -306,6 +540,8 @@ csd_housekeeping_manager_stop (CsdHousekeepingManager *manager)
 
         g_debug ("Stopping housekeeping manager");
 
+        purge_thumbnail_cache_stop (manager);
+
         if (p->short_term_cb) {
                 g_source_remove (p->short_term_cb);
                 p->short_term_cb = 0;
@@ -319,7 +555,7 @@ csd_housekeeping_manager_stop (CsdHousekeepingManager *manager)
                    limits have been set to paranoid levels (zero) */
                 if ((g_settings_get_int (p->settings, THUMB_AGE_KEY) == 0) ||
                     (g_settings_get_int (p->settings, THUMB_SIZE_KEY) == 0)) {
-                        do_cleanup (manager);
+                        purge_thumbnail_cache_sync (manager);
                 }
 
                 g_clear_object (&p->settings);
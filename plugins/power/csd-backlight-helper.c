@@ -22,6 +22,8 @@
 #include "config.h"
 
 #include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <glib-object.h>
 #include <locale.h>
 #include <sys/types.h>
@@ -122,6 +124,209 @@ out:
 	return ret;
 }
 
+static gint
+csd_backlight_helper_read_fd (gint fd, GError **error)
+{
+	gchar buf[32];
+	gchar *endptr = NULL;
+	gssize len;
+	gint64 value;
+
+	/* sysfs regenerates the attribute on every read at offset 0 */
+	len = pread (fd, buf, sizeof (buf) - 1, 0);
+	if (len <= 0) {
+		g_set_error (error, 1, 0, "failed to read attribute");
+		return -1;
+	}
+	buf[len] = '\0';
+
+	value = g_ascii_strtoll (buf, &endptr, 10);
+	if (endptr == buf || value < 0 || value > G_MAXINT) {
+		g_set_error (error, 1, 0, "failed to parse value: %s", buf);
+		return -1;
+	}
+	return value;
+}
+
+static gboolean
+csd_backlight_helper_write_fd (gint fd, gint value, GError **error)
+{
+	gchar text[16];
+	gint length;
+
+	length = g_snprintf (text, sizeof (text), "%i", value);
+	if (pwrite (fd, text, length, 0) != length) {
+		g_set_error (error, 1, 0, "writing '%s' failed", text);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* interval between two writes of a brightness ramp */
+#define CSD_BACKLIGHT_HELPER_RAMP_STEP_MS			20
+
+typedef struct {
+	GMainLoop	*loop;
+	gint		 brightness_fd;
+	gint		 max_fd;
+	gint		 ramp_start;
+	gint		 ramp_target;
+	gint64		 ramp_start_time;
+	gint64		 ramp_duration;
+	guint		 ramp_id;
+} CsdBacklightHelperDaemon;
+
+static void
+csd_backlight_helper_cancel_ramp (CsdBacklightHelperDaemon *helper)
+{
+	if (helper->ramp_id == 0)
+		return;
+	g_source_remove (helper->ramp_id);
+	helper->ramp_id = 0;
+}
+
+static gboolean
+csd_backlight_helper_ramp_cb (gpointer user_data)
+{
+	CsdBacklightHelperDaemon *helper = user_data;
+	gint64 elapsed;
+	gint value;
+
+	elapsed = g_get_monotonic_time () - helper->ramp_start_time;
+	if (elapsed >= helper->ramp_duration) {
+		value = helper->ramp_target;
+		helper->ramp_id = 0;
+	} else {
+		value = helper->ramp_start +
+			(helper->ramp_target - helper->ramp_start) * elapsed / helper->ramp_duration;
+	}
+
+	if (!csd_backlight_helper_write_fd (helper->brightness_fd, value, NULL)) {
+		helper->ramp_id = 0;
+		return G_SOURCE_REMOVE;
+	}
+	return helper->ramp_id != 0 ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
+
+static gint
+csd_backlight_helper_handle_request (CsdBacklightHelperDaemon *helper,
+				     const gchar *line,
+				     GError **error)
+{
+	gint value = -1;
+	gint start, target, duration;
+
+	if (g_strcmp0 (line, "get-brightness") == 0) {
+		value = csd_backlight_helper_read_fd (helper->brightness_fd, error);
+	} else if (g_strcmp0 (line, "get-max-brightness") == 0) {
+		value = csd_backlight_helper_read_fd (helper->max_fd, error);
+	} else if (g_str_has_prefix (line, "set-brightness ")) {
+		/* an explicit value always wins over a running ramp */
+		csd_backlight_helper_cancel_ramp (helper);
+		value = atoi (line + strlen ("set-brightness "));
+		if (!csd_backlight_helper_write_fd (helper->brightness_fd, value, error))
+			value = -1;
+	} else if (sscanf (line, "ramp-brightness %i %i %i", &start, &target, &duration) == 3 &&
+		   start >= 0 && target >= 0 && duration > 0) {
+		csd_backlight_helper_cancel_ramp (helper);
+		helper->ramp_start = start;
+		helper->ramp_target = target;
+		helper->ramp_start_time = g_get_monotonic_time ();
+		helper->ramp_duration = (gint64) duration * 1000;
+		if (!csd_backlight_helper_write_fd (helper->brightness_fd, start, error))
+			return -1;
+		helper->ramp_id = g_timeout_add (CSD_BACKLIGHT_HELPER_RAMP_STEP_MS,
+						 csd_backlight_helper_ramp_cb,
+						 helper);
+		value = target;
+	} else {
+		g_set_error (error, 1, 0, "unknown request: %s", line);
+	}
+	return value;
+}
+
+static gboolean
+csd_backlight_helper_stdin_cb (GIOChannel *channel,
+			       GIOCondition condition,
+			       gpointer user_data)
+{
+	CsdBacklightHelperDaemon *helper = user_data;
+	GIOStatus status;
+	GError *error = NULL;
+	gchar *line = NULL;
+	gint value;
+
+	status = g_io_channel_read_line (channel, &line, NULL, NULL, NULL);
+	if (status == G_IO_STATUS_AGAIN)
+		return G_SOURCE_CONTINUE;
+	if (status != G_IO_STATUS_NORMAL) {
+		/* the power plugin went away */
+		g_main_loop_quit (helper->loop);
+		return G_SOURCE_REMOVE;
+	}
+
+	g_strchomp (line);
+	value = csd_backlight_helper_handle_request (helper, line, &error);
+	if (value < 0) {
+		printf ("ERROR %s\n", error->message);
+		g_error_free (error);
+	} else {
+		printf ("OK %i\n", value);
+	}
+	fflush (stdout);
+	g_free (line);
+	return G_SOURCE_CONTINUE;
+}
+
+/**
+ * csd_backlight_helper_run_daemon:
+ *
+ * Keeps the backlight attributes open and services requests read line by
+ * line from stdin, so the power plugin only has to be authorized once.
+ * Each request is answered with a single "OK <value>" or "ERROR <reason>"
+ * line on stdout. A ramp request is answered straight away and then
+ * interpolated here, writing sysfs directly. The loop ends when the caller
+ * closes the pipe.
+ **/
+static guint
+csd_backlight_helper_run_daemon (const gchar *filename)
+{
+	CsdBacklightHelperDaemon helper = { 0 };
+	GIOChannel *channel;
+	gchar *filename_file;
+
+	filename_file = g_build_filename (filename, "brightness", NULL);
+	helper.brightness_fd = open (filename_file, O_RDWR | O_CLOEXEC);
+	g_free (filename_file);
+
+	filename_file = g_build_filename (filename, "max_brightness", NULL);
+	helper.max_fd = open (filename_file, O_RDONLY | O_CLOEXEC);
+	g_free (filename_file);
+
+	if (helper.brightness_fd < 0 || helper.max_fd < 0) {
+		g_print ("%s\n", "Could not open the backlight attributes");
+		if (helper.brightness_fd >= 0)
+			close (helper.brightness_fd);
+		if (helper.max_fd >= 0)
+			close (helper.max_fd);
+		return CSD_BACKLIGHT_HELPER_EXIT_CODE_FAILED;
+	}
+
+	helper.loop = g_main_loop_new (NULL, FALSE);
+	channel = g_io_channel_unix_new (STDIN_FILENO);
+	g_io_add_watch (channel, G_IO_IN | G_IO_HUP | G_IO_ERR,
+			csd_backlight_helper_stdin_cb, &helper);
+
+	g_main_loop_run (helper.loop);
+
+	csd_backlight_helper_cancel_ramp (&helper);
+	g_io_channel_unref (channel);
+	g_main_loop_unref (helper.loop);
+	close (helper.brightness_fd);
+	close (helper.max_fd);
+	return CSD_BACKLIGHT_HELPER_EXIT_CODE_SUCCESS;
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -134,6 +339,7 @@ main (int argc, char *argv[])
 	gint set_brightness = -1;
 	gboolean get_brightness = FALSE;
 	gboolean get_max_brightness = FALSE;
+	gboolean run_daemon = FALSE;
 	gchar *filename = NULL;
 	gchar *filename_file = NULL;
 	gchar *contents = NULL;
@@ -149,6 +355,9 @@ main (int argc, char *argv[])
 		{ "get-max-brightness", '\0', 0, G_OPTION_ARG_NONE, &get_max_brightness,
 		   /* command line argument */
 		  "Get the number of brightness levels supported", NULL },
+		{ "daemon", '\0', 0, G_OPTION_ARG_NONE, &run_daemon,
+		   /* command line argument */
+		  "Serve brightness requests from stdin until it is closed", NULL },
         { "backlight-preference", 'b', 0, G_OPTION_ARG_STRING_ARRAY,
           &backlight_preference_order,
 		   /* command line argument */
@@ -170,7 +379,7 @@ main (int argc, char *argv[])
 #endif
 
 	/* no input */
-	if (set_brightness == -1 && !get_brightness && !get_max_brightness) {
+	if (set_brightness == -1 && !get_brightness && !get_max_brightness && !run_daemon) {
 		g_print ("%s\n", "No valid option was specified");
 		retval = CSD_BACKLIGHT_HELPER_EXIT_CODE_ARGUMENTS_INVALID;
 		goto out;
@@ -187,6 +396,18 @@ main (int argc, char *argv[])
 		goto out;
 	}
 
+	/* long-lived mode, only for the root user */
+	if (run_daemon) {
+		if (getuid () != 0 || geteuid () != 0) {
+			g_print ("%s\n",
+				 "This program can only be used by the root user");
+			retval = CSD_BACKLIGHT_HELPER_EXIT_CODE_INVALID_USER;
+			goto out;
+		}
+		retval = csd_backlight_helper_run_daemon (filename);
+		goto out;
+	}
+
 	/* GetBrightness */
 	if (get_brightness) {
 		filename_file = g_build_filename (filename, "brightness", NULL);
@@ -24,6 +24,7 @@
 
 #include <fcntl.h>
 #include <math.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -39,6 +40,10 @@
 
 #include <X11/extensions/dpms.h>
 
+#ifdef HAVE_GUDEV
+#include <gudev/gudev.h>
+#endif
+
 #define GNOME_DESKTOP_USE_UNSTABLE_API
 #include <libcinnamon-desktop/gnome-rr.h>
 
@@ -174,6 +179,18 @@ struct CsdPowerManagerPrivate
         gboolean                 skip_unsupported_xrandr;
         gboolean				backlight_helper_force;
         gchar*                  backlight_helper_preference_args;
+        GSubprocess             *backlight_broker;
+        GDataInputStream        *backlight_broker_out;
+        gboolean                 backlight_broker_disabled;
+        gchar                   *backlight_broker_sysfs_path;
+
+        /* cached sysfs backlight model, see backlight_cache_refresh() */
+        gchar                   *backlight_sysfs_path;
+        gint                     backlight_max;
+        gint                     backlight_min_abs;
+#ifdef HAVE_GUDEV
+        GUdevClient             *backlight_udev_client;
+#endif
         gint                     kbd_brightness_now;
         gint                     kbd_brightness_max;
         gint                     kbd_brightness_old;
@@ -270,6 +287,9 @@ static void      activate_screensaver (CsdPowerManager *manager, gboolean force_
 static void      kill_lid_close_safety_timer (CsdPowerManager *manager);
 
 static void      backlight_get_output_id (CsdPowerManager *manager, gint *xout, gint *yout);
+#ifdef HAVE_GUDEV
+static gchar    *backlight_cache_find_sysfs_path (CsdPowerManager *manager);
+#endif
 
 static void device_properties_changed_cb (UpDevice *device, GParamSpec *pspec, CsdPowerManager *manager);
 
@@ -2405,6 +2425,140 @@ out:
         return output;
 }
 
+static void
+backlight_cache_invalidate (CsdPowerManager *manager)
+{
+        g_free (manager->priv->backlight_sysfs_path);
+        manager->priv->backlight_sysfs_path = NULL;
+        manager->priv->backlight_max = -1;
+        manager->priv->backlight_min_abs = -1;
+}
+
+static void
+backlight_broker_stop (CsdPowerManager *manager)
+{
+        if (manager->priv->backlight_broker == NULL)
+                return;
+
+        /* closing stdin makes the helper exit on its own */
+        g_output_stream_close (g_subprocess_get_stdin_pipe (manager->priv->backlight_broker),
+                               NULL, NULL);
+        g_clear_object (&manager->priv->backlight_broker_out);
+        g_clear_object (&manager->priv->backlight_broker);
+        g_free (manager->priv->backlight_broker_sysfs_path);
+        manager->priv->backlight_broker_sysfs_path = NULL;
+}
+
+static gboolean
+backlight_broker_start (CsdPowerManager *manager, GError **error)
+{
+        gchar *command;
+        gchar **argv = NULL;
+        gboolean ret;
+
+        command = g_strdup_printf ("pkexec " LIBEXECDIR "/csd-backlight-helper --daemon %s",
+                                   manager->priv->backlight_helper_preference_args ?
+                                   manager->priv->backlight_helper_preference_args : "");
+        ret = g_shell_parse_argv (command, NULL, &argv, error);
+        if (!ret)
+                goto out;
+
+        /* a dying helper must not take us down with it */
+        signal (SIGPIPE, SIG_IGN);
+
+        manager->priv->backlight_broker = g_subprocess_newv ((const gchar * const *) argv,
+                                                             G_SUBPROCESS_FLAGS_STDIN_PIPE |
+                                                             G_SUBPROCESS_FLAGS_STDOUT_PIPE,
+                                                             error);
+        if (manager->priv->backlight_broker == NULL) {
+                ret = FALSE;
+                goto out;
+        }
+
+        manager->priv->backlight_broker_out =
+                g_data_input_stream_new (g_subprocess_get_stdout_pipe (manager->priv->backlight_broker));
+#ifdef HAVE_GUDEV
+        /* the helper opens the attributes of this device once */
+        manager->priv->backlight_broker_sysfs_path = backlight_cache_find_sysfs_path (manager);
+#endif
+        g_debug ("started %s", command);
+out:
+        g_strfreev (argv);
+        g_free (command);
+        return ret;
+}
+
+/**
+ * backlight_broker_request:
+ *
+ * Sends a request to the long-lived backlight helper, starting it on
+ * first use. The helper is authorized once through pkexec and keeps the
+ * sysfs attributes open, so each request costs a pipe round-trip rather
+ * than a process launch.
+ *
+ * Return value: the value returned by the helper, or -1 for failure.
+ * If -1 then @error is set.
+ **/
+static gint64
+backlight_broker_request (CsdPowerManager *manager,
+                          const gchar *request,
+                          GError **error)
+{
+        GOutputStream *in;
+        gchar *line = NULL;
+        gchar *text;
+        gchar *endptr = NULL;
+        gint64 value = -1;
+        gboolean first_use = FALSE;
+
+        if (manager->priv->backlight_broker == NULL) {
+                if (!backlight_broker_start (manager, error))
+                        return -1;
+                first_use = TRUE;
+        }
+
+        in = g_subprocess_get_stdin_pipe (manager->priv->backlight_broker);
+        text = g_strdup_printf ("%s\n", request);
+        if (!g_output_stream_write_all (in, text, strlen (text), NULL, NULL, error) ||
+            !g_output_stream_flush (in, NULL, error)) {
+                g_free (text);
+                goto failed;
+        }
+        g_free (text);
+
+        line = g_data_input_stream_read_line (manager->priv->backlight_broker_out,
+                                              NULL, NULL, error);
+        if (line == NULL) {
+                if (error != NULL && *error == NULL)
+                        g_set_error_literal (error,
+                                             CSD_POWER_MANAGER_ERROR,
+                                             CSD_POWER_MANAGER_ERROR_FAILED,
+                                             "csd-backlight-helper exited");
+                goto failed;
+        }
+
+        if (g_str_has_prefix (line, "OK "))
+                value = g_ascii_strtoll (line + 3, &endptr, 10);
+        if (endptr == NULL || endptr == line + 3 || value < 0 || value > G_MAXINT) {
+                value = -1;
+                g_set_error (error,
+                             CSD_POWER_MANAGER_ERROR,
+                             CSD_POWER_MANAGER_ERROR_FAILED,
+                             "csd-backlight-helper failed: %s",
+                             g_str_has_prefix (line, "ERROR ") ? line + 6 : line);
+        }
+        g_debug ("backlight broker: %s -> %s", request, line);
+        g_free (line);
+        return value;
+failed:
+        backlight_broker_stop (manager);
+        /* authorization was refused or the helper is too old, so don't
+         * retry until the backlight settings change */
+        if (first_use)
+                manager->priv->backlight_broker_disabled = TRUE;
+        return -1;
+}
+
 static void
 backlight_override_settings_refresh (CsdPowerManager *manager)
 {
@@ -2438,6 +2592,11 @@ backlight_override_settings_refresh (CsdPowerManager *manager)
         g_free(tmp2);
         tmp2 = NULL;
 
+        /* the broker was started with the old preference order */
+        backlight_broker_stop (manager);
+        manager->priv->backlight_broker_disabled = FALSE;
+        backlight_cache_invalidate (manager);
+
         g_free(backlight_preference_order);
         backlight_preference_order = NULL;
 }
@@ -2461,6 +2620,22 @@ backlight_helper_get_value (const gchar *argument, CsdPowerManager* manager,
         gchar *command = NULL;
         gchar *endptr = NULL;
 
+#ifdef __linux__
+        /* prefer the already authorized helper */
+        if (!manager->priv->backlight_broker_disabled) {
+                GError *broker_error = NULL;
+
+                value = backlight_broker_request (manager, argument, &broker_error);
+                if (value >= 0 || manager->priv->backlight_broker != NULL) {
+                        if (broker_error != NULL)
+                                g_propagate_error (error, broker_error);
+                        return value;
+                }
+                g_debug ("backlight broker unavailable: %s", broker_error->message);
+                g_error_free (broker_error);
+        }
+#endif
+
         /* get the data */
         command = g_strdup_printf (LIBEXECDIR "/csd-backlight-helper --%s %s",
                                    argument,
@@ -2551,6 +2726,23 @@ backlight_helper_set_value (const gchar *argument,
         goto out;
 #endif
 
+        /* prefer the already authorized helper */
+        if (!manager->priv->backlight_broker_disabled) {
+                GError *broker_error = NULL;
+                gchar *request;
+
+                request = g_strdup_printf ("%s %i", argument, value);
+                ret = backlight_broker_request (manager, request, &broker_error) >= 0;
+                g_free (request);
+                if (ret || manager->priv->backlight_broker != NULL) {
+                        if (broker_error != NULL)
+                                g_propagate_error (error, broker_error);
+                        goto out;
+                }
+                g_debug ("backlight broker unavailable: %s", broker_error->message);
+                g_error_free (broker_error);
+        }
+
         /* get the data */
         command = g_strdup_printf ("pkexec " LIBEXECDIR "/csd-backlight-helper --%s %i %s",
                                    argument, value,
@@ -2614,13 +2806,120 @@ min_abs_brightness (CsdPowerManager *manager, gint min, gint max)
     return (min + ((max - min) / 100 * min_percent));
 }
 
+#ifdef HAVE_GUDEV
+/* mirrors csd_backlight_helper_get_best_backlight() so that we know
+ * which device the helper is driving */
+static gchar *
+backlight_cache_find_sysfs_path (CsdPowerManager *manager)
+{
+        gchar **preference_order;
+        gchar *path = NULL;
+        GList *devices;
+        GList *d;
+        guint i;
+
+        if (manager->priv->backlight_udev_client == NULL)
+                return NULL;
+
+        devices = g_udev_client_query_by_subsystem (manager->priv->backlight_udev_client,
+                                                    "backlight");
+        preference_order = g_settings_get_strv (manager->priv->settings,
+                                                "backlight-helper-preference-order");
+        for (i = 0; path == NULL && preference_order[i] != NULL; i++) {
+                for (d = devices; d != NULL; d = d->next) {
+                        if (g_strcmp0 (g_udev_device_get_sysfs_attr (d->data, "type"),
+                                       preference_order[i]) == 0) {
+                                path = g_strdup (g_udev_device_get_sysfs_path (d->data));
+                                break;
+                        }
+                }
+        }
+        g_strfreev (preference_order);
+        g_list_free_full (devices, g_object_unref);
+        return path;
+}
+
+static void
+backlight_uevent_cb (GUdevClient *client,
+                     const gchar *action,
+                     GUdevDevice *device,
+                     CsdPowerManager *manager)
+{
+        const gchar *sysfs_path = g_udev_device_get_sysfs_path (device);
+
+        /* a new device may be preferred over the one we use, which
+         * backlight_cache_refresh() finds out */
+        if (g_strcmp0 (action, "add") == 0) {
+                g_debug ("backlight added: %s, invalidating cache", sysfs_path);
+                backlight_cache_invalidate (manager);
+                return;
+        }
+
+        if (g_strcmp0 (action, "change") != 0 &&
+            g_strcmp0 (action, "remove") != 0)
+                return;
+        if (g_strcmp0 (sysfs_path, manager->priv->backlight_sysfs_path) != 0 &&
+            g_strcmp0 (sysfs_path, manager->priv->backlight_broker_sysfs_path) != 0)
+                return;
+
+        /* the broker holds the attributes of the old device open */
+        g_debug ("backlight %s: %s, restarting broker", action, sysfs_path);
+        backlight_broker_stop (manager);
+        backlight_cache_invalidate (manager);
+}
+#endif
+
+/**
+ * backlight_cache_refresh:
+ *
+ * Makes sure the maximum and minimum brightness of the sysfs backlight
+ * are known, asking the helper only when the cache was invalidated by a
+ * udev event or a settings change.
+ *
+ * Return value: Success. If FALSE then @error is set.
+ **/
+static gboolean
+backlight_cache_refresh (CsdPowerManager *manager, GError **error)
+{
+        gint64 max;
+
+        if (manager->priv->backlight_max >= 0)
+                return TRUE;
+
+#ifdef HAVE_GUDEV
+        g_free (manager->priv->backlight_sysfs_path);
+        manager->priv->backlight_sysfs_path = backlight_cache_find_sysfs_path (manager);
+
+        /* the broker would keep driving the device it was started with */
+        if (manager->priv->backlight_broker != NULL &&
+            g_strcmp0 (manager->priv->backlight_sysfs_path,
+                       manager->priv->backlight_broker_sysfs_path) != 0) {
+                g_debug ("backlight moved from %s to %s, restarting broker",
+                         manager->priv->backlight_broker_sysfs_path,
+                         manager->priv->backlight_sysfs_path);
+                backlight_broker_stop (manager);
+        }
+#endif
+
+        max = backlight_helper_get_value ("get-max-brightness", manager, error);
+        if (max < 0)
+                return FALSE;
+
+        manager->priv->backlight_max = max;
+        manager->priv->backlight_min_abs = min_abs_brightness (manager, 0, max);
+        g_debug ("cached backlight %s: max %i, min %i",
+                 manager->priv->backlight_sysfs_path,
+                 manager->priv->backlight_max,
+                 manager->priv->backlight_min_abs);
+        return TRUE;
+}
+
 static gint
 backlight_get_percentage (CsdPowerManager *manager, GError **error)
 {
         GnomeRROutput *output;
         gint now;
         gint value = -1;
-        gint min = 0;
         gint max;
 
         /* prioritize user override settings */
@@ -2641,16 +2940,15 @@ backlight_get_percentage (CsdPowerManager *manager, GError **error)
         }
 
         /* fall back to the polkit helper */
-        max = backlight_helper_get_value ("get-max-brightness", manager, error);
-        if (max < 0) {
+        if (!backlight_cache_refresh (manager, error))
                 goto out;
-            }
+        max = manager->priv->backlight_max;
         now = backlight_helper_get_value ("get-brightness", manager, error);
         if (now < 0) {
                 goto out;
             }
 
-        value = ABS_TO_PERCENTAGE (min_abs_brightness (manager, min, max), max, now);
+        value = ABS_TO_PERCENTAGE (manager->priv->backlight_min_abs, max, now);
 out:
         return value;
 }
@@ -2698,16 +2996,17 @@ backlight_set_percentage (CsdPowerManager *manager,
                 }
         }
 
-        gint min = 0;
-        gint max = 0;
+        gint min_abs;
+        gint max;
         gint new;
 
         /* fall back to the polkit helper */
-        max = backlight_helper_get_value ("get-max-brightness", manager, error);
-        if (max < 0)
+        if (!backlight_cache_refresh (manager, error))
                 goto out;
+        max = manager->priv->backlight_max;
+        min_abs = manager->priv->backlight_min_abs;
 
-        new = CLAMP (PERCENTAGE_TO_ABS (min_abs_brightness (manager, min, max), max, value), min_abs_brightness (manager, min, max), max);
+        new = CLAMP (PERCENTAGE_TO_ABS (min_abs, max, value), min_abs, max);
         ret = backlight_helper_set_value ("set-brightness",
                                           new,
                                           manager,
@@ -2718,6 +3017,62 @@ out:
         return ret;
 }
 
+/**
+ * backlight_ramp_percentage:
+ *
+ * Hands a whole brightness ramp to the backlight helper, which
+ * interpolates it and writes sysfs on its own. Nothing is emitted on
+ * CsdScreen, the caller is expected to set the final value once the
+ * ramp is over.
+ *
+ * Return value: Success. If FALSE the caller has to step through the
+ * ramp itself.
+ **/
+static gboolean
+backlight_ramp_percentage (CsdPowerManager *manager,
+                           guint start,
+                           guint target,
+                           guint duration_ms,
+                           GError **error)
+{
+        gchar *request;
+        gint max;
+        gint min_abs;
+        gint64 ret;
+
+        /* xbacklight has no ramp support */
+        if (!manager->priv->skip_unsupported_xrandr &&
+            !manager->priv->backlight_helper_force &&
+            get_primary_output (manager) != NULL) {
+                g_set_error_literal (error,
+                                     CSD_POWER_MANAGER_ERROR,
+                                     CSD_POWER_MANAGER_ERROR_FAILED,
+                                     "brightness ramps need the backlight helper");
+                return FALSE;
+        }
+
+        if (manager->priv->backlight_broker_disabled) {
+                g_set_error_literal (error,
+                                     CSD_POWER_MANAGER_ERROR,
+                                     CSD_POWER_MANAGER_ERROR_FAILED,
+                                     "the backlight helper is not running");
+                return FALSE;
+        }
+
+        if (!backlight_cache_refresh (manager, error))
+                return FALSE;
+        max = manager->priv->backlight_max;
+        min_abs = manager->priv->backlight_min_abs;
+
+        request = g_strdup_printf ("ramp-brightness %i %i %u",
+                                   CLAMP (PERCENTAGE_TO_ABS (min_abs, max, start), min_abs, max),
+                                   CLAMP (PERCENTAGE_TO_ABS (min_abs, max, target), min_abs, max),
+                                   duration_ms);
+        ret = backlight_broker_request (manager, request, error);
+        g_free (request);
+        return ret >= 0;
+}
+
 static gint
 backlight_step_up (CsdPowerManager *manager, GError **error)
 {
@@ -2767,23 +3122,24 @@ backlight_step_up (CsdPowerManager *manager, GError **error)
         }
 
         gint max = 0;
-        gint min = 0;
+        gint min_abs;
 
         /* fall back to the polkit helper */
+        if (!backlight_cache_refresh (manager, error))
+                goto out;
+        max = manager->priv->backlight_max;
+        min_abs = manager->priv->backlight_min_abs;
         current = backlight_helper_get_value ("get-brightness", manager, error);
         if (current < 0)
                 goto out;
-        max = backlight_helper_get_value ("get-max-brightness", manager, error);
-        if (max < 0)
-                goto out;
-        step = BRIGHTNESS_STEP_AMOUNT (max - min_abs_brightness (manager, min, max));
+        step = BRIGHTNESS_STEP_AMOUNT (max - min_abs);
         new = MIN (current + step, max);
         ret = backlight_helper_set_value ("set-brightness",
                                           new,
                                           manager,
                                           error);
         if (ret)
-                percentage_value = ABS_TO_PERCENTAGE (min_abs_brightness (manager, min, max), max, new);
+                percentage_value = ABS_TO_PERCENTAGE (min_abs, max, new);
 out:
         if (ret)
                 backlight_emit_changed (manager);
@@ -2838,24 +3194,25 @@ backlight_step_down (CsdPowerManager *manager, GError **error)
                 }
         }
 
-        gint min = 0;
+        gint min_abs;
         gint max = 0;
 
         /* fall back to the polkit helper */
+        if (!backlight_cache_refresh (manager, error))
+                goto out;
+        max = manager->priv->backlight_max;
+        min_abs = manager->priv->backlight_min_abs;
         current = backlight_helper_get_value ("get-brightness", manager, error);
         if (current < 0)
                 goto out;
-        max = backlight_helper_get_value ("get-max-brightness", manager, error);
-        if (max < 0)
-                goto out;
-        step = BRIGHTNESS_STEP_AMOUNT (max - min_abs_brightness (manager, min, max));
-        new = MAX (current - step, min_abs_brightness (manager, min, max));
+        step = BRIGHTNESS_STEP_AMOUNT (max - min_abs);
+        new = MAX (current - step, min_abs);
         ret = backlight_helper_set_value ("set-brightness",
                                           new,
                                           manager,
                                           error);
         if (ret)
-                percentage_value = ABS_TO_PERCENTAGE (min_abs_brightness (manager, min, max), max, new);
+                percentage_value = ABS_TO_PERCENTAGE (min_abs, max, new);
 out:
         if (ret)
                 backlight_emit_changed (manager);
@@ -3698,6 +4055,11 @@ engine_settings_key_changed_cb (GSettings *settings,
                 return;
         }
 
+        if (g_strcmp0 (key, "minimum-display-brightness") == 0) {
+                backlight_cache_invalidate (manager);
+                return;
+        }
+
         if (g_str_has_prefix (key, "power-notifications")) {
                 refresh_notification_settings (manager);
                 return;
@@ -3835,7 +4197,8 @@ ambient_transition_step_cb (gpointer user_data)
                      fraction * (manager->priv->ambient_transition_target -
                                  manager->priv->ambient_transition_start);
 
-        if (!backlight_set_percentage (manager, (guint) brightness, TRUE, &error)) {
+        /* only the final value is announced on the bus */
+        if (!backlight_set_percentage (manager, (guint) brightness, FALSE, &error)) {
                 ambient_transition_handle_error (manager, error);
                 return G_SOURCE_REMOVE;
         }
@@ -3863,6 +4226,20 @@ ambient_begin_transition (CsdPowerManager *manager, gdouble target_brightness)
         manager->priv->ambient_transition_target = target_brightness;
         manager->priv->ambient_transition_step = 0;
 
+        /* let the backlight helper interpolate, and only land on the target here */
+        if (backlight_ramp_percentage (manager,
+                                       (guint) current,
+                                       (guint) target_brightness,
+                                       AMBIENT_TRANSITION_DURATION_MS,
+                                       NULL)) {
+                manager->priv->ambient_transition_step = AMBIENT_TRANSITION_STEPS - 1;
+                manager->priv->ambient_transition_timer_id =
+                        g_timeout_add (AMBIENT_TRANSITION_DURATION_MS,
+                                       ambient_transition_step_cb,
+                                       manager);
+                return;
+        }
+
         manager->priv->ambient_transition_timer_id =
                 g_timeout_add (AMBIENT_TRANSITION_STEP_MS,
                                ambient_transition_step_cb,
@@ -4453,6 +4830,10 @@ handle_resume_actions (CsdPowerManager *manager)
                                 G_DBUS_CALL_FLAGS_NONE, -1,
                                 NULL, NULL, NULL);
 
+        /* the backlight may have been replaced or reprobed while we
+         * were asleep */
+        backlight_cache_invalidate (manager);
+
         /* close existing notifications on resume, the system power
          * state is probably different now */
         notify_close_if_showing (manager->priv->notification_low);
@@ -4644,6 +5025,16 @@ on_rr_screen_acquired (GObject      *object,
         manager->priv->backlight_helper_preference_args = NULL;
         backlight_override_settings_refresh (manager);
 
+#ifdef HAVE_GUDEV
+        {
+                const gchar * const subsystems[] = { "backlight", NULL };
+
+                manager->priv->backlight_udev_client = g_udev_client_new (subsystems);
+                g_signal_connect (manager->priv->backlight_udev_client, "uevent",
+                                  G_CALLBACK (backlight_uevent_cb), manager);
+        }
+#endif
+
         /* get percentage policy */
         manager->priv->low_percentage = g_settings_get_int (manager->priv->settings,
                                                             "percentage-low");
@@ -4834,6 +5225,11 @@ csd_power_manager_stop (CsdPowerManager *manager)
 
         g_free (manager->priv->backlight_helper_preference_args);
         manager->priv->backlight_helper_preference_args = NULL;
+        backlight_broker_stop (manager);
+        backlight_cache_invalidate (manager);
+#ifdef HAVE_GUDEV
+        g_clear_object (&manager->priv->backlight_udev_client);
+#endif
 
         if (manager->priv->x11_screen != NULL) {
                 g_object_unref (manager->priv->x11_screen);
@@ -4886,6 +5282,8 @@ csd_power_manager_init (CsdPowerManager *manager)
         manager->priv = CSD_POWER_MANAGER_GET_PRIVATE (manager);
         manager->priv->inhibit_lid_switch_fd = -1;
         manager->priv->inhibit_suspend_fd = -1;
+        manager->priv->backlight_max = -1;
+        manager->priv->backlight_min_abs = -1;
 }
 
 static void
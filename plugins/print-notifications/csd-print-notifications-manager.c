@@ -39,6 +39,7 @@
 
 #include "cinnamon-settings-profile.h"
 #include "csd-print-notifications-manager.h"
+#include "csd-printer-dests.h"
 
 #define CSD_PRINT_NOTIFICATIONS_MANAGER_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), CSD_TYPE_PRINT_NOTIFICATIONS_MANAGER, CsdPrintNotificationsManagerPrivate))
 
@@ -51,7 +52,8 @@
 #define CONNECTING_TIMEOUT               60
 #define REASON_TIMEOUT                   15000
 #define CUPS_CONNECTION_TEST_INTERVAL    300
-#define CHECK_INTERVAL                   60 /* secs */
+#define CHECK_INTERVAL_IDLE              120 /* secs */
+#define CHECK_INTERVAL_ACTIVE            5 /* secs */
 
 #define PRINTER_REMOVED_LIFETIME         7200000000 // (7200 sec * 1000 * 1000 (microseconds) */
 #define PRINTER_REMOVED_UPDATE_INTERVAL  1260 /* 21 min (sec) */
@@ -81,8 +83,8 @@ struct CsdPrintNotificationsManagerPrivate
 {
         GDBusConnection              *cups_bus_connection;
         gint                          subscription_id;
-        cups_dest_t                  *dests;
-        gint                          num_dests;
+        CsdPrinterDests              *dests;
+        gboolean                      dests_loaded;
         gboolean                      scp_handler_spawned;
         GPid                          scp_handler_pid;
         GList                        *timeouts;
@@ -92,15 +94,22 @@ struct CsdPrintNotificationsManagerPrivate
         GList                        *active_notifications;
         guint                         cups_connection_timeout_id;
         guint                         check_source_id;
+        guint                         check_interval;
+        gboolean                      subscription_push;
         guint                         cups_dbus_subscription_id;
         guint                         renew_source_id;
         gint                          last_notify_sequence_number;
         guint                         start_idle_id;
+        GThreadPool                  *cups_pool;
+        GCancellable                 *cups_cancellable;
+        gboolean                      notifications_pending;
+        gboolean                      notifications_again;
 };
 
 static void     csd_print_notifications_manager_finalize    (GObject                           *object);
 static gboolean cups_connection_test                        (gpointer                           user_data);
 static gboolean process_new_notifications                   (gpointer                           user_data);
+static void     check_timeout_update                        (CsdPrintNotificationsManager      *manager);
 
 G_DEFINE_TYPE (CsdPrintNotificationsManager, csd_print_notifications_manager, G_TYPE_OBJECT)
 
@@ -116,13 +125,100 @@ password_cb (const char *prompt,
   return NULL;
 }
 
+/* All requests to CUPS go through a single worker thread, so a slow
+ * server or a hanging network queue can't block the main loop.  Calls run
+ * in the order they were queued and their results are delivered back to
+ * the main context by the GTask. */
+typedef gpointer (*CupsThreadFunc) (gpointer data);
+
+typedef struct
+{
+        CupsThreadFunc  func;
+        gpointer        data;
+        GDestroyNotify  data_free;
+        GDestroyNotify  result_free;
+} CupsCall;
+
+static void
+cups_call_free (CupsCall *call)
+{
+        if (call->data_free != NULL)
+                call->data_free (call->data);
+        g_free (call);
+}
+
+static void
+cups_worker (gpointer data,
+             gpointer user_data)
+{
+        GTask    *task = data;
+        CupsCall *call = g_task_get_task_data (task);
+
+        if (!g_task_return_error_if_cancelled (task)) {
+                /* libcups keeps the password callback per thread */
+                cupsSetPasswordCB2 (password_cb, NULL);
+                g_task_return_pointer (task, call->func (call->data), call->result_free);
+        }
+
+        g_object_unref (task);
+}
+
+static void
+cups_call_async (CsdPrintNotificationsManager *manager,
+                 GCancellable                 *cancellable,
+                 CupsThreadFunc                func,
+                 gpointer                      data,
+                 GDestroyNotify                data_free,
+                 GDestroyNotify                result_free,
+                 GAsyncReadyCallback           callback)
+{
+        GTask    *task;
+        CupsCall *call;
+
+        call = g_new0 (CupsCall, 1);
+        call->func = func;
+        call->data = data;
+        call->data_free = data_free;
+        call->result_free = result_free;
+
+        if (manager->priv->cups_pool == NULL) {
+                g_debug ("Not sending a request to CUPS, the manager is stopped");
+                cups_call_free (call);
+                return;
+        }
+
+        task = g_task_new (manager, cancellable, callback, manager);
+        g_task_set_task_data (task, call, (GDestroyNotify) cups_call_free);
+        g_thread_pool_push (manager->priv->cups_pool, task, NULL);
+}
+
+/* Returns FALSE if the manager has been stopped since the call was
+ * queued, otherwise @result is set to what the thread function returned */
+static gboolean
+cups_call_finish (GAsyncResult *res,
+                  gpointer     *result)
+{
+        GTask        *task = G_TASK (res);
+        CupsCall     *call = g_task_get_task_data (task);
+        GCancellable *cancellable = g_task_get_cancellable (task);
+
+        *result = g_task_propagate_pointer (task, NULL);
+
+        if (cancellable != NULL && g_cancellable_is_cancelled (cancellable)) {
+                if (*result != NULL && call->result_free != NULL)
+                        call->result_free (*result);
+                *result = NULL;
+                return FALSE;
+        }
+
+        return TRUE;
+}
+
 static char *
-get_dest_attr (const char *dest_name,
-               const char *attr,
-               cups_dest_t *dests,
-               int          num_dests)
+get_dest_attr (const char      *dest_name,
+               const char      *attr,
+               CsdPrinterDests *dests)
 {
-        cups_dest_t *dest;
         const char  *value;
         char        *ret;
 
@@ -131,13 +227,12 @@ get_dest_attr (const char *dest_name,
 
         ret = NULL;
 
-        dest = cupsGetDest (dest_name, NULL, num_dests, dests);
-        if (dest == NULL) {
+        if (csd_printer_dests_lookup (dests, dest_name) == NULL) {
                 g_debug ("Unable to find a printer named '%s'", dest_name);
                 goto out;
         }
 
-        value = cupsGetOption (attr, dest->num_options, dest->options);
+        value = csd_printer_dests_get_option (dests, dest_name, attr);
         if (value == NULL) {
                 g_debug ("Unable to get %s for '%s'", attr, dest_name);
                 goto out;
@@ -148,9 +243,8 @@ get_dest_attr (const char *dest_name,
 }
 
 static gboolean
-is_local_dest (const char  *name,
-               cups_dest_t *dests,
-               int          num_dests)
+is_local_dest (const char      *name,
+               CsdPrinterDests *dests)
 {
         char        *type_str;
         cups_ptype_t type;
@@ -158,7 +252,7 @@ is_local_dest (const char  *name,
 
         is_remote = TRUE;
 
-        type_str = get_dest_attr (name, "printer-type", dests, num_dests);
+        type_str = get_dest_attr (name, "printer-type", dests);
         if (type_str == NULL) {
                 goto out;
         }
@@ -490,6 +584,262 @@ get_statuses_second (guint i,
         return status;
 }
 
+static void
+show_transient_notification (const gchar *primary_text,
+                             const gchar *secondary_text)
+{
+        NotifyNotification *notification;
+
+        notification = notify_notification_new (primary_text,
+                                                secondary_text,
+                                                "xsi-printer-symbolic");
+        notify_notification_set_app_name (notification, _("Printers"));
+        notify_notification_set_hint (notification, "transient", g_variant_new_boolean (TRUE));
+        notify_notification_show (notification, NULL);
+        g_object_unref (notification);
+}
+
+typedef struct
+{
+        gchar       *printer_name;
+        gboolean     added;
+        cups_dest_t *dest;
+} NamedDest;
+
+static void
+named_dest_free (NamedDest *named_dest)
+{
+        if (named_dest->dest != NULL)
+                cupsFreeDests (1, named_dest->dest);
+        g_free (named_dest->printer_name);
+        g_free (named_dest);
+}
+
+/* Runs in the CUPS worker thread */
+static gpointer
+get_named_dest_thread (gpointer data)
+{
+        NamedDest *named_dest = data;
+        NamedDest *result;
+
+        result = g_new0 (NamedDest, 1);
+        result->printer_name = g_strdup (named_dest->printer_name);
+        result->added = named_dest->added;
+        result->dest = cupsGetNamedDest (CUPS_HTTP_DEFAULT, result->printer_name, NULL);
+
+        return result;
+}
+
+static void
+update_dest_cb (GObject      *source_object,
+                GAsyncResult *res,
+                gpointer      user_data)
+{
+        CsdPrintNotificationsManager *manager = (CsdPrintNotificationsManager *) user_data;
+        NamedDest                    *named_dest;
+
+        if (!cups_call_finish (res, (gpointer *) &named_dest))
+                return;
+
+        csd_printer_dests_replace (manager->priv->dests,
+                                   named_dest->printer_name,
+                                   named_dest->dest);
+        named_dest->dest = NULL;
+
+        if (named_dest->added &&
+            is_local_dest (named_dest->printer_name, manager->priv->dests)) {
+                if (should_notify_new_printer (manager, named_dest->printer_name)) {
+                        /* Translators: New printer has been added */
+                        show_transient_notification (_("Printer added"), named_dest->printer_name);
+                } else {
+                        g_debug ("A recently-removed printer %s has been re-added, skipping notification.",
+                                 named_dest->printer_name);
+                }
+        }
+
+        named_dest_free (named_dest);
+}
+
+/* Refreshes a single printer in the cache instead of all of them */
+static void
+update_dest (CsdPrintNotificationsManager *manager,
+             const gchar                  *printer_name,
+             gboolean                      added)
+{
+        NamedDest *named_dest;
+
+        if (printer_name == NULL)
+                return;
+
+        named_dest = g_new0 (NamedDest, 1);
+        named_dest->printer_name = g_strdup (printer_name);
+        named_dest->added = added;
+
+        cups_call_async (manager,
+                         manager->priv->cups_cancellable,
+                         get_named_dest_thread,
+                         named_dest,
+                         (GDestroyNotify) named_dest_free,
+                         (GDestroyNotify) named_dest_free,
+                         update_dest_cb);
+}
+
+typedef struct
+{
+        gchar *printer_name;
+        gchar *reason;
+        gchar *text;
+} PrinterReason;
+
+static void
+printer_reason_free (PrinterReason *printer_reason)
+{
+        g_free (printer_reason->printer_name);
+        g_free (printer_reason->reason);
+        g_free (printer_reason->text);
+        g_free (printer_reason);
+}
+
+/* Runs in the CUPS worker thread, cupsGetPPD() downloads the PPD file */
+static gpointer
+localize_reason_thread (gpointer data)
+{
+        PrinterReason *printer_reason = data;
+        PrinterReason *result;
+        gchar         *ppd_file_name;
+        ppd_file_t    *ppd_file;
+        char           buffer[8192];
+        gint           i, j;
+
+        result = g_new0 (PrinterReason, 1);
+        result->printer_name = g_strdup (printer_reason->printer_name);
+        result->reason = g_strdup (printer_reason->reason);
+
+        ppd_file_name = g_strdup (cupsGetPPD (result->printer_name));
+        if (ppd_file_name) {
+                ppd_file = ppdOpenFile (ppd_file_name);
+                if (ppd_file) {
+                        gchar **tmpv;
+                        static const char * const schemes[] = {
+                                "text", "http", "help", "file"
+                        };
+
+                        tmpv = g_new0 (gchar *, G_N_ELEMENTS (schemes) + 1);
+                        i = 0;
+                        for (j = 0; j < G_N_ELEMENTS (schemes); j++) {
+                                if (ppdLocalizeIPPReason (ppd_file, result->reason, schemes[j], buffer, sizeof (buffer))) {
+                                        tmpv[i++] = g_strdup (buffer);
+                                }
+                        }
+
+                        if (i > 0)
+                                result->text = g_strjoinv (", ", tmpv);
+                        g_strfreev (tmpv);
+
+                        ppdClose (ppd_file);
+                }
+
+                g_unlink (ppd_file_name);
+                g_free (ppd_file_name);
+        }
+
+        return result;
+}
+
+static void
+show_reason_notification_cb (GObject      *source_object,
+                             GAsyncResult *res,
+                             gpointer      user_data)
+{
+        CsdPrintNotificationsManager *manager = (CsdPrintNotificationsManager *) user_data;
+        PrinterReason                *printer_reason;
+        NotifyNotification           *notification;
+        ReasonData                   *reason_data;
+        const gchar                  *state_reasons;
+        gchar                        *first_row;
+        gchar                        *second_row;
+
+        if (!cups_call_finish (res, (gpointer *) &printer_reason))
+                return;
+
+        /* the reason may have been cleared while we were asking CUPS */
+        state_reasons = csd_printer_dests_get_option (manager->priv->dests,
+                                                      printer_reason->printer_name,
+                                                      "printer-state-reasons");
+        if (state_reasons != NULL &&
+            g_strrstr (state_reasons, printer_reason->reason) == NULL) {
+                printer_reason_free (printer_reason);
+                return;
+        }
+
+        if (g_str_has_suffix (printer_reason->reason, "-report"))
+                /* Translators: This is a title of a report notification for a printer */
+                first_row = g_strdup (_("Printer report"));
+        else if (g_str_has_suffix (printer_reason->reason, "-warning"))
+                /* Translators: This is a title of a warning notification for a printer */
+                first_row = g_strdup (_("Printer warning"));
+        else
+                /* Translators: This is a title of an error notification for a printer */
+                first_row = g_strdup (_("Printer error"));
+
+        /* Translators: "Printer 'MyPrinterName': 'Description of the report/warning/error from a PPD file'." */
+        second_row = g_strdup_printf (_("Printer '%s': '%s'."),
+                                      printer_reason->printer_name,
+                                      printer_reason->text != NULL ? printer_reason->text : printer_reason->reason);
+
+        notification = notify_notification_new (first_row,
+                                                second_row,
+                                                "xsi-printer-symbolic");
+        notify_notification_set_app_name (notification, _("Printers"));
+        notify_notification_set_hint (notification,
+                                      "resident",
+                                      g_variant_new_boolean (TRUE));
+        notify_notification_set_timeout (notification, REASON_TIMEOUT);
+
+        reason_data = g_new0 (ReasonData, 1);
+        reason_data->printer_name = g_strdup (printer_reason->printer_name);
+        reason_data->reason = g_strdup (printer_reason->reason);
+        reason_data->notification = notification;
+        reason_data->manager = manager;
+
+        reason_data->notification_close_id =
+                g_signal_connect (notification,
+                                  "closed",
+                                  G_CALLBACK (notification_closed_cb),
+                                  reason_data);
+
+        manager->priv->active_notifications =
+                g_list_append (manager->priv->active_notifications, reason_data);
+
+        notify_notification_show (notification, NULL);
+
+        g_free (first_row);
+        g_free (second_row);
+        printer_reason_free (printer_reason);
+}
+
+/* Shows a notification for a reason we have no text for, using the
+ * description from the printer's PPD file if there is one */
+static void
+show_reason_notification (CsdPrintNotificationsManager *manager,
+                          const gchar                  *printer_name,
+                          const gchar                  *reason)
+{
+        PrinterReason *printer_reason;
+
+        printer_reason = g_new0 (PrinterReason, 1);
+        printer_reason->printer_name = g_strdup (printer_name);
+        printer_reason->reason = g_strdup (reason);
+
+        cups_call_async (manager,
+                         manager->priv->cups_cancellable,
+                         localize_reason_thread,
+                         printer_reason,
+                         (GDestroyNotify) printer_reason_free,
+                         (GDestroyNotify) printer_reason_free,
+                         show_reason_notification_cb);
+}
+
 static void
 process_cups_notification (CsdPrintNotificationsManager *manager,
                            const char                   *notify_subscribed_event,
@@ -503,16 +853,12 @@ process_cups_notification (CsdPrintNotificationsManager *manager,
                            gint                          job_state,
                            const char                   *job_state_reasons,
                            const char                   *job_name,
-                           gint                          job_impressions_completed)
+                           gint                          job_impressions_completed,
+                           gboolean                      my_job)
 {
-        ipp_attribute_t *attr;
-        gboolean         my_job = FALSE;
         gboolean         known_reason;
-        http_t          *http;
         gchar           *primary_text = NULL;
         gchar           *secondary_text = NULL;
-        gchar           *job_uri = NULL;
-        ipp_t           *request, *response;
         static const char * const reasons[] = {
                 "toner-low",
                 "toner-empty",
@@ -554,6 +900,7 @@ process_cups_notification (CsdPrintNotificationsManager *manager,
                 N_("Printer error") };
 
         if (g_strcmp0 (notify_subscribed_event, "printer-added") != 0 &&
+            g_strcmp0 (notify_subscribed_event, "printer-modified") != 0 &&
             g_strcmp0 (notify_subscribed_event, "printer-deleted") != 0 &&
             g_strcmp0 (notify_subscribed_event, "printer-state-changed") != 0 &&
             g_strcmp0 (notify_subscribed_event, "job-completed") != 0 &&
@@ -561,54 +908,14 @@ process_cups_notification (CsdPrintNotificationsManager *manager,
             g_strcmp0 (notify_subscribed_event, "job-created") != 0)
                 return;
 
-        if (notify_job_id > 0) {
-                if ((http = httpConnectEncrypt (cupsServer (), ippPort (),
-                                                cupsEncryption ())) == NULL) {
-                        g_debug ("Connection to CUPS server \'%s\' failed.", cupsServer ());
-                } else {
-                        job_uri = g_strdup_printf ("ipp://localhost/jobs/%d", notify_job_id);
-
-                        request = ippNewRequest (IPP_GET_JOB_ATTRIBUTES);
-                        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
-                                      "job-uri", NULL, job_uri);
-                        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_NAME,
-                                     "requesting-user-name", NULL, cupsUser ());
-                        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
-                                     "requested-attributes", NULL, "job-originating-user-name");
-                        response = cupsDoRequest (http, request, "/");
-
-                        if (response) {
-                                if (ippGetStatusCode (response) <= IPP_OK_CONFLICT &&
-                                    (attr = ippFindAttribute(response, "job-originating-user-name",
-                                                             IPP_TAG_NAME))) {
-                                        if (g_strcmp0 (ippGetString (attr, 0, NULL), cupsUser ()) == 0)
-                                                my_job = TRUE;
-                                }
-                                ippDelete(response);
-                        }
-                        g_free (job_uri);
-                        httpClose (http);
-                }
-        }
-
         if (g_strcmp0 (notify_subscribed_event, "printer-added") == 0) {
-                cupsFreeDests (manager->priv->num_dests, manager->priv->dests);
-                manager->priv->num_dests = cupsGetDests (&manager->priv->dests);
-
-                if (is_local_dest (printer_name,
-                                   manager->priv->dests,
-                                   manager->priv->num_dests)) {
-                        /* Translators: New printer has been added */
-                        if (should_notify_new_printer (manager, printer_name)) {
-                            primary_text = g_strdup (_("Printer added"));
-                            secondary_text = g_strdup (printer_name);
-                        } else {
-                            g_debug ("A recently-removed printer %s has been re-added, skipping notification.", printer_name);
-                        }
-                }
+                /* the notification is shown once the printer is known */
+                update_dest (manager, printer_name, TRUE);
+        } else if (g_strcmp0 (notify_subscribed_event, "printer-modified") == 0) {
+                update_dest (manager, printer_name, FALSE);
         } else if (g_strcmp0 (notify_subscribed_event, "printer-deleted") == 0) {
-                cupsFreeDests (manager->priv->num_dests, manager->priv->dests);
-                manager->priv->num_dests = cupsGetDests (&manager->priv->dests);
+                if (printer_name != NULL)
+                        csd_printer_dests_remove (manager->priv->dests, printer_name);
                 add_or_update_removed_cache (manager, printer_name);
         } else if (g_strcmp0 (notify_subscribed_event, "job-completed") == 0 && my_job) {
                 g_hash_table_remove (manager->priv->printing_printers,
@@ -701,7 +1008,6 @@ process_cups_notification (CsdPrintNotificationsManager *manager,
                         secondary_text = g_strdup_printf (_("'%s' on %s"), job_name, printer_name);
                 }
         } else if (g_strcmp0 (notify_subscribed_event, "printer-state-changed") == 0) {
-                cups_dest_t  *dest = NULL;
                 const gchar  *tmp_printer_state_reasons = NULL;
                 GSList       *added_reasons = NULL;
                 GSList       *tmp_list = NULL;
@@ -757,32 +1063,15 @@ process_cups_notification (CsdPrintNotificationsManager *manager,
 
                 /* Check whether we are printing on this printer right now. */
                 if (g_hash_table_lookup_extended (manager->priv->printing_printers, printer_name, NULL, NULL)) {
-                        dest = cupsGetDest (printer_name,
-                                            NULL,
-                                            manager->priv->num_dests,
-                                            manager->priv->dests);
-                        if (dest)
-                                tmp_printer_state_reasons = cupsGetOption ("printer-state-reasons",
-                                                                           dest->num_options,
-                                                                           dest->options);
-
+                        tmp_printer_state_reasons = csd_printer_dests_get_option (manager->priv->dests,
+                                                                                  printer_name,
+                                                                                  "printer-state-reasons");
                         if (tmp_printer_state_reasons)
                                 old_state_reasons = g_strsplit (tmp_printer_state_reasons, ",", -1);
 
-                        cupsFreeDests (manager->priv->num_dests, manager->priv->dests);
-                        manager->priv->num_dests = cupsGetDests (&manager->priv->dests);
-
-                        dest = cupsGetDest (printer_name,
-                                            NULL,
-                                            manager->priv->num_dests,
-                                            manager->priv->dests);
-                        if (dest)
-                                tmp_printer_state_reasons = cupsGetOption ("printer-state-reasons",
-                                                                           dest->num_options,
-                                                                           dest->options);
-
-                        if (tmp_printer_state_reasons)
-                                new_state_reasons = g_strsplit (tmp_printer_state_reasons, ",", -1);
+                        /* the event carries the new reasons, no need to ask CUPS */
+                        if (printer_state_reasons)
+                                new_state_reasons = g_strsplit (printer_state_reasons, ",", -1);
 
                         if (new_state_reasons)
                                 qsort (new_state_reasons,
@@ -872,142 +1161,136 @@ process_cups_notification (CsdPrintNotificationsManager *manager,
                                 }
 
                                 if (!known_reason &&
-                                    !reason_is_blacklisted (data)) {
-                                        NotifyNotification *notification;
-                                        ReasonData         *reason_data;
-                                        gchar              *first_row;
-                                        gchar              *second_row;
-                                        gchar              *text = NULL;
-                                        gchar              *ppd_file_name;
-                                        ppd_file_t         *ppd_file;
-                                        char                buffer[8192];
-
-                                        ppd_file_name = g_strdup (cupsGetPPD (printer_name));
-                                        if (ppd_file_name) {
-                                                ppd_file = ppdOpenFile (ppd_file_name);
-                                                if (ppd_file) {
-                                                        gchar **tmpv;
-                                                        static const char * const schemes[] = {
-                                                                "text", "http", "help", "file"
-                                                        };
-
-                                                        tmpv = g_new0 (gchar *, G_N_ELEMENTS (schemes) + 1);
-                                                        i = 0;
-                                                        for (j = 0; j < G_N_ELEMENTS (schemes); j++) {
-                                                                if (ppdLocalizeIPPReason (ppd_file, data, schemes[j], buffer, sizeof (buffer))) {
-                                                                        tmpv[i++] = g_strdup (buffer);
-                                                                }
-                                                        }
-
-                                                        if (i > 0)
-                                                                text = g_strjoinv (", ", tmpv);
-                                                        g_strfreev (tmpv);
-
-                                                        ppdClose (ppd_file);
-                                                }
+                                    !reason_is_blacklisted (data))
+                                        show_reason_notification (manager, printer_name, data);
+                        }
+                        g_slist_free (added_reasons);
+                }
 
-                                                g_unlink (ppd_file_name);
-                                                g_free (ppd_file_name);
-                                        }
+                if (new_state_reasons)
+                        g_strfreev (new_state_reasons);
 
+                if (old_state_reasons)
+                        g_strfreev (old_state_reasons);
 
-                                        if (g_str_has_suffix (data, "-report"))
-                                                /* Translators: This is a title of a report notification for a printer */
-                                                first_row = g_strdup (_("Printer report"));
-                                        else if (g_str_has_suffix (data, "-warning"))
-                                                /* Translators: This is a title of a warning notification for a printer */
-                                                first_row = g_strdup (_("Printer warning"));
-                                        else
-                                                /* Translators: This is a title of an error notification for a printer */
-                                                first_row = g_strdup (_("Printer error"));
+                if (printer_name != NULL && printer_state_reasons != NULL)
+                        csd_printer_dests_set_option (manager->priv->dests,
+                                                      printer_name,
+                                                      "printer-state-reasons",
+                                                      printer_state_reasons);
+        }
 
 
-                                        if (text == NULL)
-                                                text = g_strdup (data);
+        if (primary_text) {
+                show_transient_notification (primary_text, secondary_text);
+                g_free (primary_text);
+                g_free (secondary_text);
+        }
+}
 
-                                        /* Translators: "Printer 'MyPrinterName': 'Description of the report/warning/error from a PPD file'." */
-                                        second_row = g_strdup_printf (_("Printer '%s': '%s'."), printer_name, text);
-                                        g_free (text);
+typedef struct
+{
+        gint      notify_sequence_number;
+        gchar    *notify_subscribed_event;
+        gchar    *notify_text;
+        gchar    *notify_printer_uri;
+        gchar    *printer_name;
+        gint      printer_state;
+        gchar    *printer_state_reasons;
+        gboolean  printer_is_accepting_jobs;
+        guint     notify_job_id;
+        gint      job_state;
+        gchar    *job_state_reasons;
+        gchar    *job_name;
+        gint      job_impressions_completed;
+        gboolean  my_job;
+} CupsEvent;
 
+static void
+cups_event_free (CupsEvent *event)
+{
+        g_free (event->notify_subscribed_event);
+        g_free (event->notify_text);
+        g_free (event->notify_printer_uri);
+        g_free (event->printer_name);
+        g_free (event->printer_state_reasons);
+        g_free (event->job_state_reasons);
+        g_free (event->job_name);
+        g_free (event);
+}
 
-                                        notification = notify_notification_new (first_row,
-                                                                                second_row,
-                                                                                "xsi-printer-symbolic");
-                                        notify_notification_set_app_name (notification, _("Printers"));
-                                        notify_notification_set_hint (notification,
-                                                                      "resident",
-                                                                      g_variant_new_boolean (TRUE));
-                                        notify_notification_set_timeout (notification, REASON_TIMEOUT);
+typedef struct
+{
+        gint subscription_id;
+        gint sequence_number;
+} NotificationsRequest;
 
-                                        reason_data = g_new0 (ReasonData, 1);
-                                        reason_data->printer_name = g_strdup (printer_name);
-                                        reason_data->reason = g_strdup (data);
-                                        reason_data->notification = notification;
-                                        reason_data->manager = manager;
+static gchar *
+join_attribute_strings (ipp_attribute_t *attr)
+{
+        gchar **strv;
+        gchar  *ret;
+        gint    i;
 
-                                        reason_data->notification_close_id =
-                                                g_signal_connect (notification,
-                                                                  "closed",
-                                                                  G_CALLBACK (notification_closed_cb),
-                                                                  reason_data);
+        strv = g_new0 (gchar *, ippGetCount (attr) + 1);
+        for (i = 0; i < ippGetCount (attr); i++)
+                strv[i] = g_strdup (ippGetString (attr, i, NULL));
+        ret = g_strjoinv (",", strv);
+        g_strfreev (strv);
 
-                                        manager->priv->active_notifications =
-                                                g_list_append (manager->priv->active_notifications, reason_data);
+        return ret;
+}
 
-                                        notify_notification_show (notification, NULL);
+/* Runs in the CUPS worker thread */
+static gboolean
+is_my_job (guint job_id)
+{
+        ipp_attribute_t *attr;
+        ipp_t           *request;
+        ipp_t           *response;
+        gchar           *job_uri;
+        gboolean         my_job = FALSE;
 
-                                        g_free (first_row);
-                                        g_free (second_row);
-                                }
-                        }
-                        g_slist_free (added_reasons);
-                }
+        job_uri = g_strdup_printf ("ipp://localhost/jobs/%d", job_id);
 
-                if (new_state_reasons)
-                        g_strfreev (new_state_reasons);
+        request = ippNewRequest (IPP_GET_JOB_ATTRIBUTES);
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
+                      "job-uri", NULL, job_uri);
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_NAME,
+                     "requesting-user-name", NULL, cupsUser ());
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
+                     "requested-attributes", NULL, "job-originating-user-name");
+        response = cupsDoRequest (CUPS_HTTP_DEFAULT, request, "/");
 
-                if (old_state_reasons)
-                        g_strfreev (old_state_reasons);
+        if (response) {
+                if (ippGetStatusCode (response) <= IPP_OK_CONFLICT &&
+                    (attr = ippFindAttribute(response, "job-originating-user-name",
+                                             IPP_TAG_NAME))) {
+                        if (g_strcmp0 (ippGetString (attr, 0, NULL), cupsUser ()) == 0)
+                                my_job = TRUE;
+                }
+                ippDelete(response);
+        } else {
+                g_debug ("Connection to CUPS server \'%s\' failed.", cupsServer ());
         }
 
+        g_free (job_uri);
 
-        if (primary_text) {
-                NotifyNotification *notification;
-                notification = notify_notification_new (primary_text,
-                                                        secondary_text,
-                                                        "xsi-printer-symbolic");
-                notify_notification_set_app_name (notification, _("Printers"));
-                notify_notification_set_hint (notification, "transient", g_variant_new_boolean (TRUE));
-                notify_notification_show (notification, NULL);
-                g_object_unref (notification);
-                g_free (primary_text);
-                g_free (secondary_text);
-        }
+        return my_job;
 }
 
-static gboolean
-process_new_notifications (gpointer user_data)
+/* Runs in the CUPS worker thread, returns the new events in order */
+static gpointer
+get_notifications_thread (gpointer data)
 {
-        CsdPrintNotificationsManager  *manager = (CsdPrintNotificationsManager *) user_data;
-        ipp_attribute_t               *attr;
-        const gchar                   *notify_subscribed_event = NULL;
-        const gchar                   *printer_name = NULL;
-        const gchar                   *notify_text = NULL;
-        const gchar                   *notify_printer_uri = NULL;
-        const gchar                   *job_name = NULL;
-        const char                    *attr_name;
-        gboolean                       printer_is_accepting_jobs = FALSE;
-        gchar                         *job_state_reasons = NULL;
-        gchar                         *printer_state_reasons = NULL;
-        gchar                        **reasons;
-        guint                          notify_job_id = 0;
-        ipp_t                         *request;
-        ipp_t                         *response;
-        gint                           printer_state = -1;
-        gint                           job_state = -1;
-        gint                           job_impressions_completed = -1;
-        gint                           notify_sequence_number = -1;
-        gint                           i;
+        NotificationsRequest *notifications = data;
+        ipp_attribute_t      *attr;
+        const char           *attr_name;
+        CupsEvent            *event = NULL;
+        GPtrArray            *events;
+        ipp_t                *request;
+        ipp_t                *response;
+        guint                 i;
 
         request = ippNewRequest (IPP_GET_NOTIFICATIONS);
 
@@ -1015,7 +1298,7 @@ process_new_notifications (gpointer user_data)
                       "requesting-user-name", NULL, cupsUser ());
 
         ippAddInteger (request, IPP_TAG_OPERATION, IPP_TAG_INTEGER,
-                       "notify-subscription-ids", manager->priv->subscription_id);
+                       "notify-subscription-ids", notifications->subscription_id);
 
         ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI, "printer-uri", NULL,
                       "/printers/");
@@ -1025,114 +1308,188 @@ process_new_notifications (gpointer user_data)
 
         ippAddInteger (request, IPP_TAG_OPERATION, IPP_TAG_INTEGER,
                        "notify-sequence-numbers",
-                       manager->priv->last_notify_sequence_number + 1);
+                       notifications->sequence_number);
 
 
         response = cupsDoRequest (CUPS_HTTP_DEFAULT, request, "/");
 
+        events = g_ptr_array_new_with_free_func ((GDestroyNotify) cups_event_free);
 
+        /* every event starts with its sequence number */
         for (attr = ippFindAttribute (response, "notify-sequence-number", IPP_TAG_INTEGER);
              attr != NULL;
              attr = ippNextAttribute (response)) {
 
                 attr_name = ippGetName (attr);
                 if (g_strcmp0 (attr_name, "notify-sequence-number") == 0) {
-                        notify_sequence_number = ippGetInteger (attr, 0);
-
-                        if (notify_sequence_number > manager->priv->last_notify_sequence_number)
-                                manager->priv->last_notify_sequence_number = notify_sequence_number;
-
-                        if (notify_subscribed_event != NULL) {
-                                process_cups_notification (manager,
-                                                           notify_subscribed_event,
-                                                           notify_text,
-                                                           notify_printer_uri,
-                                                           printer_name,
-                                                           printer_state,
-                                                           printer_state_reasons,
-                                                           printer_is_accepting_jobs,
-                                                           notify_job_id,
-                                                           job_state,
-                                                           job_state_reasons,
-                                                           job_name,
-                                                           job_impressions_completed);
-
-                                g_clear_pointer (&printer_state_reasons, g_free);
-                                g_clear_pointer (&job_state_reasons, g_free);
-                        }
-
-                        notify_subscribed_event = NULL;
-                        notify_text = NULL;
-                        notify_printer_uri = NULL;
-                        printer_name = NULL;
-                        printer_state = -1;
-                        printer_state_reasons = NULL;
-                        printer_is_accepting_jobs = FALSE;
-                        notify_job_id = 0;
-                        job_state = -1;
-                        job_state_reasons = NULL;
-                        job_name = NULL;
-                        job_impressions_completed = -1;
+                        event = g_new0 (CupsEvent, 1);
+                        event->notify_sequence_number = ippGetInteger (attr, 0);
+                        event->printer_state = -1;
+                        event->job_state = -1;
+                        event->job_impressions_completed = -1;
+                        g_ptr_array_add (events, event);
+                } else if (event == NULL) {
+                        continue;
                 } else if (g_strcmp0 (attr_name, "notify-subscribed-event") == 0) {
-                        notify_subscribed_event = ippGetString (attr, 0, NULL);
+                        g_free (event->notify_subscribed_event);
+                        event->notify_subscribed_event = g_strdup (ippGetString (attr, 0, NULL));
                 } else if (g_strcmp0 (attr_name, "notify-text") == 0) {
-                        notify_text = ippGetString (attr, 0, NULL);
+                        g_free (event->notify_text);
+                        event->notify_text = g_strdup (ippGetString (attr, 0, NULL));
                 } else if (g_strcmp0 (attr_name, "notify-printer-uri") == 0) {
-                        notify_printer_uri = ippGetString (attr, 0, NULL);
+                        g_free (event->notify_printer_uri);
+                        event->notify_printer_uri = g_strdup (ippGetString (attr, 0, NULL));
                 } else if (g_strcmp0 (attr_name, "printer-name") == 0) {
-                        printer_name = ippGetString (attr, 0, NULL);
+                        g_free (event->printer_name);
+                        event->printer_name = g_strdup (ippGetString (attr, 0, NULL));
                 } else if (g_strcmp0 (attr_name, "printer-state") == 0) {
-                        printer_state = ippGetInteger (attr, 0);
+                        event->printer_state = ippGetInteger (attr, 0);
                 } else if (g_strcmp0 (attr_name, "printer-state-reasons") == 0) {
-                        reasons = g_new0 (gchar *, ippGetCount (attr) + 1);
-                        for (i = 0; i < ippGetCount (attr); i++)
-                                reasons[i] = g_strdup (ippGetString (attr, i, NULL));
-                        printer_state_reasons = g_strjoinv (",", reasons);
-                        g_strfreev (reasons);
+                        g_free (event->printer_state_reasons);
+                        event->printer_state_reasons = join_attribute_strings (attr);
                 } else if (g_strcmp0 (attr_name, "printer-is-accepting-jobs") == 0) {
-                        printer_is_accepting_jobs = ippGetBoolean (attr, 0);
+                        event->printer_is_accepting_jobs = ippGetBoolean (attr, 0);
                 } else if (g_strcmp0 (attr_name, "notify-job-id") == 0) {
-                        notify_job_id = ippGetInteger (attr, 0);
+                        event->notify_job_id = ippGetInteger (attr, 0);
                 } else if (g_strcmp0 (attr_name, "job-state") == 0) {
-                        job_state = ippGetInteger (attr, 0);
+                        event->job_state = ippGetInteger (attr, 0);
                 } else if (g_strcmp0 (attr_name, "job-state-reasons") == 0) {
-                        reasons = g_new0 (gchar *, ippGetCount (attr) + 1);
-                        for (i = 0; i < ippGetCount (attr); i++)
-                                reasons[i] = g_strdup (ippGetString (attr, i, NULL));
-                        job_state_reasons = g_strjoinv (",", reasons);
-                        g_strfreev (reasons);
+                        g_free (event->job_state_reasons);
+                        event->job_state_reasons = join_attribute_strings (attr);
                 } else if (g_strcmp0 (attr_name, "job-name") == 0) {
-                        job_name = ippGetString (attr, 0, NULL);
+                        g_free (event->job_name);
+                        event->job_name = g_strdup (ippGetString (attr, 0, NULL));
                 } else if (g_strcmp0 (attr_name, "job-impressions-completed") == 0) {
-                        job_impressions_completed = ippGetInteger (attr, 0);
+                        event->job_impressions_completed = ippGetInteger (attr, 0);
                 }
         }
 
-        if (notify_subscribed_event != NULL) {
+        if (response != NULL)
+                ippDelete (response);
+
+        /* job notifications are only shown for our own jobs */
+        for (i = 0; i < events->len; i++) {
+                event = g_ptr_array_index (events, i);
+                if (event->notify_subscribed_event != NULL && event->notify_job_id > 0)
+                        event->my_job = is_my_job (event->notify_job_id);
+        }
+
+        return events;
+}
+
+static void
+process_new_notifications_cb (GObject      *source_object,
+                              GAsyncResult *res,
+                              gpointer      user_data)
+{
+        CsdPrintNotificationsManager *manager = (CsdPrintNotificationsManager *) user_data;
+        GPtrArray                    *events;
+        guint                         i;
+
+        if (!cups_call_finish (res, (gpointer *) &events))
+                return;
+
+        manager->priv->notifications_pending = FALSE;
+
+        for (i = 0; events != NULL && i < events->len; i++) {
+                CupsEvent *event = g_ptr_array_index (events, i);
+
+                if (event->notify_sequence_number > manager->priv->last_notify_sequence_number)
+                        manager->priv->last_notify_sequence_number = event->notify_sequence_number;
+
+                if (event->notify_subscribed_event == NULL)
+                        continue;
+
                 process_cups_notification (manager,
-                                           notify_subscribed_event,
-                                           notify_text,
-                                           notify_printer_uri,
-                                           printer_name,
-                                           printer_state,
-                                           printer_state_reasons,
-                                           printer_is_accepting_jobs,
-                                           notify_job_id,
-                                           job_state,
-                                           job_state_reasons,
-                                           job_name,
-                                           job_impressions_completed);
-
-                g_clear_pointer (&printer_state_reasons, g_free);
-                g_clear_pointer (&job_state_reasons, g_free);
+                                           event->notify_subscribed_event,
+                                           event->notify_text,
+                                           event->notify_printer_uri,
+                                           event->printer_name,
+                                           event->printer_state,
+                                           event->printer_state_reasons,
+                                           event->printer_is_accepting_jobs,
+                                           event->notify_job_id,
+                                           event->job_state,
+                                           event->job_state_reasons,
+                                           event->job_name,
+                                           event->job_impressions_completed,
+                                           event->my_job);
         }
 
-        if (response != NULL)
-                ippDelete (response);
+        if (events != NULL)
+                g_ptr_array_unref (events);
+
+        check_timeout_update (manager);
+
+        /* signals that arrived meanwhile may announce newer events */
+        if (manager->priv->notifications_again) {
+                manager->priv->notifications_again = FALSE;
+                process_new_notifications (manager);
+        }
+}
+
+static gboolean
+process_new_notifications (gpointer user_data)
+{
+        CsdPrintNotificationsManager *manager = (CsdPrintNotificationsManager *) user_data;
+        NotificationsRequest         *notifications;
+
+        /* a request with the same sequence number would return the same
+         * events again, so wait for the running one */
+        if (manager->priv->notifications_pending) {
+                manager->priv->notifications_again = TRUE;
+                return TRUE;
+        }
+
+        notifications = g_new0 (NotificationsRequest, 1);
+        notifications->subscription_id = manager->priv->subscription_id;
+        notifications->sequence_number = manager->priv->last_notify_sequence_number + 1;
+
+        manager->priv->notifications_pending = TRUE;
+        cups_call_async (manager,
+                         manager->priv->cups_cancellable,
+                         get_notifications_thread,
+                         notifications,
+                         g_free,
+                         (GDestroyNotify) g_ptr_array_unref,
+                         process_new_notifications_cb);
 
         return TRUE;
 }
 
+/* CUPS pushes events over D-Bus when it can, which needs no timer.
+ * Otherwise they are polled, often while one of our jobs is printing and
+ * rarely when idle. */
+static void
+check_timeout_update (CsdPrintNotificationsManager *manager)
+{
+        guint interval;
+
+        if (manager->priv->subscription_id < 0 ||
+            (manager->priv->subscription_push &&
+             manager->priv->cups_dbus_subscription_id > 0))
+                interval = 0;
+        else if (g_hash_table_size (manager->priv->printing_printers) > 0)
+                interval = CHECK_INTERVAL_ACTIVE;
+        else
+                interval = CHECK_INTERVAL_IDLE;
+
+        if (interval == manager->priv->check_interval)
+                return;
+
+        g_clear_handle_id (&manager->priv->check_source_id, g_source_remove);
+        manager->priv->check_interval = interval;
+
+        if (interval == 0) {
+                g_debug ("Waiting for CUPS to push notifications");
+                return;
+        }
+
+        g_debug ("Polling CUPS for notifications every %u seconds", interval);
+        manager->priv->check_source_id = g_timeout_add_seconds (interval, process_new_notifications, manager);
+        g_source_set_name_by_id (manager->priv->check_source_id, "[cinnamon-settings-daemon] process_new_notifications");
+}
+
 static void
 scp_handler (CsdPrintNotificationsManager *manager,
              gboolean                      start)
@@ -1165,92 +1522,239 @@ scp_handler (CsdPrintNotificationsManager *manager,
         }
 }
 
-static void
-cancel_subscription (gint id)
+/* Runs in the CUPS worker thread */
+static gpointer
+cancel_subscription_thread (gpointer data)
 {
-        http_t *http;
         ipp_t  *request;
 
-        if (id >= 0 &&
-            ((http = httpConnectEncrypt (cupsServer (), ippPort (),
-                                        cupsEncryption ())) != NULL)) {
-                request = ippNewRequest (IPP_CANCEL_SUBSCRIPTION);
-                ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
-                             "printer-uri", NULL, "/");
-                ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_NAME,
-                             "requesting-user-name", NULL, cupsUser ());
-                ippAddInteger (request, IPP_TAG_OPERATION, IPP_TAG_INTEGER,
-                              "notify-subscription-id", id);
-                ippDelete (cupsDoRequest (http, request, "/"));
-                httpClose (http);
-        }
+        request = ippNewRequest (IPP_CANCEL_SUBSCRIPTION);
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
+                     "printer-uri", NULL, "/");
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_NAME,
+                     "requesting-user-name", NULL, cupsUser ());
+        ippAddInteger (request, IPP_TAG_OPERATION, IPP_TAG_INTEGER,
+                      "notify-subscription-id", GPOINTER_TO_INT (data));
+        ippDelete (cupsDoRequest (CUPS_HTTP_DEFAULT, request, "/"));
+
+        return NULL;
 }
 
-static gboolean
-renew_subscription (gpointer data)
+static void
+cancel_subscription (CsdPrintNotificationsManager *manager,
+                     gint                          id)
+{
+        /* not cancellable, it is queued while stopping */
+        if (id >= 0)
+                cups_call_async (manager, NULL,
+                                 cancel_subscription_thread,
+                                 GINT_TO_POINTER (id), NULL, NULL,
+                                 NULL);
+}
+
+typedef struct
+{
+        gint     id;
+        gboolean push;
+} Subscription;
+
+/* Runs in the CUPS worker thread */
+static gint
+create_subscription (gboolean push)
 {
-        CsdPrintNotificationsManager *manager = (CsdPrintNotificationsManager *) data;
         ipp_attribute_t              *attr = NULL;
-        http_t                       *http;
         ipp_t                        *request;
         ipp_t                        *response;
-        gint                          num_events = 7;
+        gint                          subscription_id = -1;
+        gint                          num_events = 8;
         static const char * const events[] = {
                 "job-created",
                 "job-completed",
                 "job-state-changed",
                 "job-state",
                 "printer-added",
+                "printer-modified",
                 "printer-deleted",
                 "printer-state-changed"};
 
-        if ((http = httpConnectEncrypt (cupsServer (), ippPort (),
-                                        cupsEncryption ())) == NULL) {
+        request = ippNewRequest (IPP_CREATE_PRINTER_SUBSCRIPTION);
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
+                      "printer-uri", NULL,
+                      "/");
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_NAME,
+                      "requesting-user-name", NULL, cupsUser ());
+        ippAddStrings (request, IPP_TAG_SUBSCRIPTION, IPP_TAG_KEYWORD,
+                       "notify-events", num_events, NULL, events);
+        ippAddString (request, IPP_TAG_SUBSCRIPTION, IPP_TAG_KEYWORD,
+                      "notify-pull-method", NULL, "ippget");
+        if (push) {
+                ippAddString (request, IPP_TAG_SUBSCRIPTION, IPP_TAG_URI,
+                              "notify-recipient-uri", NULL, "dbus://");
+        }
+        ippAddInteger (request, IPP_TAG_SUBSCRIPTION, IPP_TAG_INTEGER,
+                       "notify-lease-duration", SUBSCRIPTION_DURATION);
+        response = cupsDoRequest (CUPS_HTTP_DEFAULT, request, "/");
+
+        if (response != NULL && ippGetStatusCode (response) <= IPP_OK_CONFLICT) {
+                if ((attr = ippFindAttribute (response, "notify-subscription-id",
+                                              IPP_TAG_INTEGER)) == NULL)
+                        g_debug ("No notify-subscription-id in response!\n");
+                else
+                        subscription_id = ippGetInteger (attr, 0);
+        } else if (response == NULL) {
                 g_debug ("Connection to CUPS server \'%s\' failed.", cupsServer ());
-        } else {
-                if (manager->priv->subscription_id >= 0) {
-                        request = ippNewRequest (IPP_RENEW_SUBSCRIPTION);
-                        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
-                                     "printer-uri", NULL, "/");
-                        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_NAME,
-                                     "requesting-user-name", NULL, cupsUser ());
-                        ippAddInteger (request, IPP_TAG_OPERATION, IPP_TAG_INTEGER,
-                                      "notify-subscription-id", manager->priv->subscription_id);
-                        ippAddInteger (request, IPP_TAG_SUBSCRIPTION, IPP_TAG_INTEGER,
-                                      "notify-lease-duration", SUBSCRIPTION_DURATION);
-                        ippDelete (cupsDoRequest (http, request, "/"));
+        }
+
+        if (response)
+                ippDelete (response);
+
+        return subscription_id;
+}
+
+/* Runs in the CUPS worker thread, returns the subscription and whether
+ * CUPS pushes its events over D-Bus */
+static gpointer
+renew_subscription_thread (gpointer data)
+{
+        Subscription                 *subscription;
+        ipp_t                        *request;
+        ipp_t                        *response;
+
+        subscription = g_new0 (Subscription, 1);
+        *subscription = *(Subscription *) data;
+
+        if (subscription->id >= 0) {
+                request = ippNewRequest (IPP_RENEW_SUBSCRIPTION);
+                ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
+                             "printer-uri", NULL, "/");
+                ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_NAME,
+                             "requesting-user-name", NULL, cupsUser ());
+                ippAddInteger (request, IPP_TAG_OPERATION, IPP_TAG_INTEGER,
+                              "notify-subscription-id", subscription->id);
+                ippAddInteger (request, IPP_TAG_SUBSCRIPTION, IPP_TAG_INTEGER,
+                              "notify-lease-duration", SUBSCRIPTION_DURATION);
+                response = cupsDoRequest (CUPS_HTTP_DEFAULT, request, "/");
+                if (response == NULL) {
+                        g_debug ("Connection to CUPS server \'%s\' failed.", cupsServer ());
                 } else {
-                        request = ippNewRequest (IPP_CREATE_PRINTER_SUBSCRIPTION);
-                        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
-                                      "printer-uri", NULL,
-                                      "/");
-                        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_NAME,
-                                      "requesting-user-name", NULL, cupsUser ());
-                        ippAddStrings (request, IPP_TAG_SUBSCRIPTION, IPP_TAG_KEYWORD,
-                                       "notify-events", num_events, NULL, events);
-                        ippAddString (request, IPP_TAG_SUBSCRIPTION, IPP_TAG_KEYWORD,
-                                      "notify-pull-method", NULL, "ippget");
-                        if (server_is_local (cupsServer ())) {
-                                ippAddString (request, IPP_TAG_SUBSCRIPTION, IPP_TAG_URI,
-                                              "notify-recipient-uri", NULL, "dbus://");
-                        }
-                        ippAddInteger (request, IPP_TAG_SUBSCRIPTION, IPP_TAG_INTEGER,
-                                       "notify-lease-duration", SUBSCRIPTION_DURATION);
-                        response = cupsDoRequest (http, request, "/");
-
-                        if (response != NULL && ippGetStatusCode (response) <= IPP_OK_CONFLICT) {
-                                if ((attr = ippFindAttribute (response, "notify-subscription-id",
-                                                              IPP_TAG_INTEGER)) == NULL)
-                                        g_debug ("No notify-subscription-id in response!\n");
-                                else
-                                        manager->priv->subscription_id = ippGetInteger (attr, 0);
+                        /* e.g. the server was restarted, subscribe again */
+                        if (ippGetStatusCode (response) > IPP_OK_CONFLICT) {
+                                g_debug ("Subscription %d is gone, creating a new one.", subscription->id);
+                                subscription->id = -1;
                         }
+                        ippDelete (response);
+                }
+        }
 
-                        if (response)
-                                ippDelete (response);
+        if (subscription->id < 0) {
+                /* the dbus notifier is optional in cupsd, events can still
+                 * be polled without it */
+                subscription->push = server_is_local (cupsServer ());
+                if (subscription->push)
+                        subscription->id = create_subscription (TRUE);
+                if (subscription->id < 0) {
+                        subscription->push = FALSE;
+                        subscription->id = create_subscription (FALSE);
                 }
-                httpClose (http);
         }
+
+        return subscription;
+}
+
+typedef struct
+{
+        cups_dest_t *dests;
+        gint         num_dests;
+} DestsResult;
+
+static void
+dests_result_free (DestsResult *result)
+{
+        cupsFreeDests (result->num_dests, result->dests);
+        g_free (result);
+}
+
+/* Runs in the CUPS worker thread */
+static gpointer
+get_dests_thread (gpointer data)
+{
+        DestsResult *result;
+
+        result = g_new0 (DestsResult, 1);
+        result->num_dests = cupsGetDests (&result->dests);
+
+        return result;
+}
+
+static void
+load_dests_cb (GObject      *source_object,
+               GAsyncResult *res,
+               gpointer      user_data)
+{
+        CsdPrintNotificationsManager *manager = (CsdPrintNotificationsManager *) user_data;
+        DestsResult                  *result;
+
+        if (!cups_call_finish (res, (gpointer *) &result))
+                return;
+
+        csd_printer_dests_replace_all (manager->priv->dests,
+                                       result->dests,
+                                       result->num_dests);
+        g_debug ("Got %d dests from CUPS server \'%s\'.", result->num_dests, cupsServer ());
+        g_free (result);
+}
+
+static void
+renew_subscription_cb (GObject      *source_object,
+                       GAsyncResult *res,
+                       gpointer      user_data)
+{
+        CsdPrintNotificationsManager *manager = (CsdPrintNotificationsManager *) user_data;
+        Subscription                 *subscription;
+
+        if (!cups_call_finish (res, (gpointer *) &subscription))
+                return;
+
+        manager->priv->subscription_push = subscription->push;
+
+        if (subscription->id != manager->priv->subscription_id) {
+                manager->priv->subscription_id = subscription->id;
+                manager->priv->last_notify_sequence_number = -1;
+
+                /* Printer events keep the cache up to date, it is only read as a
+                 * whole when a subscription starts and events may have been missed */
+                if (subscription->id >= 0)
+                        cups_call_async (manager,
+                                         manager->priv->cups_cancellable,
+                                         get_dests_thread,
+                                         NULL, NULL,
+                                         (GDestroyNotify) dests_result_free,
+                                         load_dests_cb);
+        }
+
+        g_free (subscription);
+
+        check_timeout_update (manager);
+}
+
+static gboolean
+renew_subscription (gpointer data)
+{
+        CsdPrintNotificationsManager *manager = (CsdPrintNotificationsManager *) data;
+        Subscription                 *subscription;
+
+        subscription = g_new0 (Subscription, 1);
+        subscription->id = manager->priv->subscription_id;
+        subscription->push = manager->priv->subscription_push;
+
+        cups_call_async (manager,
+                         manager->priv->cups_cancellable,
+                         renew_subscription_thread,
+                         subscription,
+                         g_free,
+                         g_free,
+                         renew_subscription_cb);
+
         return TRUE;
 }
 
@@ -1358,12 +1862,9 @@ cups_connection_test_cb (GObject      *source_object,
                 g_io_stream_close (G_IO_STREAM (connection), NULL, NULL);
                 g_object_unref (connection);
 
-                manager->priv->num_dests = cupsGetDests (&manager->priv->dests);
-                g_debug ("Got dests from remote CUPS server.");
+                manager->priv->dests_loaded = TRUE;
 
                 renew_subscription_timeout_enable (manager, TRUE, TRUE);
-                manager->priv->check_source_id = g_timeout_add_seconds (CHECK_INTERVAL, process_new_notifications, manager);
-                g_source_set_name_by_id (manager->priv->check_source_id, "[cinnamon-settings-daemon] process_new_notifications");
         } else {
                 g_debug ("Test connection to CUPS server \'%s:%d\' failed.", cupsServer (), ippPort ());
                 if (manager->priv->cups_connection_timeout_id == 0) {
@@ -1382,7 +1883,7 @@ cups_connection_test (gpointer user_data)
         gchar                        *address;
         int                           port = ippPort ();
 
-        if (!manager->priv->dests) {
+        if (!manager->priv->dests_loaded) {
                 address = g_strdup_printf ("%s:%d", cupsServer (), port);
 
                 client = g_socket_client_new ();
@@ -1400,7 +1901,7 @@ cups_connection_test (gpointer user_data)
                 g_free (address);
         }
 
-        if (manager->priv->dests) {
+        if (manager->priv->dests_loaded) {
                 manager->priv->cups_connection_timeout_id = 0;
 
                 return FALSE;
@@ -1431,6 +1932,7 @@ csd_print_notifications_manager_got_dbus_connection (GObject      *source_object
                                                             on_cups_notification,
                                                             manager,
                                                             NULL);
+                check_timeout_update (manager);
         } else {
                 g_warning ("Connection to message bus failed: %s", error->message);
                 g_error_free (error);
@@ -1454,8 +1956,7 @@ csd_print_notifications_manager_start_idle (gpointer data)
         cupsSetPasswordCB2 (password_cb, NULL);
 
         if (server_is_local (cupsServer ())) {
-                manager->priv->num_dests = cupsGetDests (&manager->priv->dests);
-                g_debug ("Got dests from local CUPS server.");
+                manager->priv->dests_loaded = TRUE;
 
                 renew_subscription_timeout_enable (manager, TRUE, FALSE);
 
@@ -1483,8 +1984,8 @@ csd_print_notifications_manager_start (CsdPrintNotificationsManager *manager,
         cinnamon_settings_profile_start (NULL);
 
         manager->priv->subscription_id = -1;
-        manager->priv->dests = NULL;
-        manager->priv->num_dests = 0;
+        manager->priv->dests = csd_printer_dests_new ();
+        manager->priv->dests_loaded = FALSE;
         manager->priv->scp_handler_spawned = FALSE;
         manager->priv->timeouts = NULL;
         manager->priv->printing_printers = NULL;
@@ -1494,6 +1995,12 @@ csd_print_notifications_manager_start (CsdPrintNotificationsManager *manager,
         manager->priv->cups_bus_connection = NULL;
         manager->priv->cups_connection_timeout_id = 0;
         manager->priv->last_notify_sequence_number = -1;
+        manager->priv->notifications_pending = FALSE;
+        manager->priv->notifications_again = FALSE;
+        manager->priv->check_interval = 0;
+        manager->priv->subscription_push = FALSE;
+        manager->priv->cups_cancellable = g_cancellable_new ();
+        manager->priv->cups_pool = g_thread_pool_new (cups_worker, NULL, 1, FALSE, NULL);
 
         manager->priv->start_idle_id = g_idle_add (csd_print_notifications_manager_start_idle, manager);
         g_source_set_name_by_id (manager->priv->start_idle_id, "[cinnamon-settings-daemon] csd_print_notifications_manager_start_idle");
@@ -1512,9 +2019,8 @@ csd_print_notifications_manager_stop (CsdPrintNotificationsManager *manager)
 
         g_debug ("Stopping print-notifications manager");
 
-        cupsFreeDests (manager->priv->num_dests, manager->priv->dests);
-        manager->priv->num_dests = 0;
-        manager->priv->dests = NULL;
+        g_clear_pointer (&manager->priv->dests, csd_printer_dests_free);
+        manager->priv->dests_loaded = FALSE;
 
         if (manager->priv->cups_dbus_subscription_id > 0 &&
             manager->priv->cups_bus_connection != NULL) {
@@ -1529,9 +2035,23 @@ csd_print_notifications_manager_stop (CsdPrintNotificationsManager *manager)
                 g_source_remove (manager->priv->check_source_id);
                 manager->priv->check_source_id = 0;
         }
+        manager->priv->check_interval = 0;
+
+        if (manager->priv->subscription_id >= 0) {
+                cancel_subscription (manager, manager->priv->subscription_id);
+                manager->priv->subscription_id = -1;
+        }
 
-        if (manager->priv->subscription_id >= 0)
-                cancel_subscription (manager->priv->subscription_id);
+        /* drop the results of anything still queued, the pool is freed
+         * once the queue, including the cancellation above, has run */
+        if (manager->priv->cups_cancellable != NULL) {
+                g_cancellable_cancel (manager->priv->cups_cancellable);
+                g_clear_object (&manager->priv->cups_cancellable);
+        }
+        if (manager->priv->cups_pool != NULL) {
+                g_thread_pool_free (manager->priv->cups_pool, FALSE, FALSE);
+                manager->priv->cups_pool = NULL;
+        }
 
         g_clear_pointer (&manager->priv->printing_printers, g_hash_table_destroy);
         g_clear_pointer (&manager->priv->removed_printers, g_hash_table_destroy);
@@ -0,0 +1,155 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "config.h"
+
+#include "csd-printer-dests.h"
+
+/* Printer destinations keyed by printer name.
+ *
+ * cupsGetDests() enumerates every queue over IPP and DNS-SD, which is slow
+ * on sites with many shared queues, so it is only used to fill the cache
+ * initially.  Single printers are then updated with cupsGetNamedDest().
+ * Each entry is a one element destination array of its own, so entries
+ * can be replaced independently.  Instances (lpoptions) are not kept,
+ * only the printers themselves. */
+struct CsdPrinterDests
+{
+        GHashTable *dests; /* key = printer name, value = cups_dest_t */
+};
+
+static void
+dest_free (cups_dest_t *dest)
+{
+        cupsFreeDests (1, dest);
+}
+
+CsdPrinterDests *
+csd_printer_dests_new (void)
+{
+        CsdPrinterDests *cache;
+
+        cache = g_new0 (CsdPrinterDests, 1);
+        cache->dests = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, (GDestroyNotify) dest_free);
+
+        return cache;
+}
+
+void
+csd_printer_dests_free (CsdPrinterDests *cache)
+{
+        if (cache == NULL)
+                return;
+
+        g_hash_table_destroy (cache->dests);
+        g_free (cache);
+}
+
+/* Takes ownership of @dests, as returned by cupsGetDests() */
+void
+csd_printer_dests_replace_all (CsdPrinterDests *cache,
+                               cups_dest_t     *dests,
+                               gint             num_dests)
+{
+        gint i;
+
+        g_hash_table_remove_all (cache->dests);
+
+        for (i = 0; i < num_dests; i++) {
+                cups_dest_t *copy = NULL;
+
+                if (dests[i].instance != NULL)
+                        continue;
+
+                if (cupsCopyDest (&dests[i], 0, &copy) == 1)
+                        g_hash_table_replace (cache->dests,
+                                              g_strdup (dests[i].name),
+                                              copy);
+        }
+
+        cupsFreeDests (num_dests, dests);
+}
+
+/* Takes ownership of @dest, as returned by cupsGetNamedDest(); a %NULL
+ * @dest means the printer doesn't exist */
+void
+csd_printer_dests_replace (CsdPrinterDests *cache,
+                           const gchar     *name,
+                           cups_dest_t     *dest)
+{
+        if (dest == NULL) {
+                g_hash_table_remove (cache->dests, name);
+                return;
+        }
+
+        g_hash_table_replace (cache->dests, g_strdup (name), dest);
+}
+
+void
+csd_printer_dests_remove (CsdPrinterDests *cache,
+                          const gchar     *name)
+{
+        g_hash_table_remove (cache->dests, name);
+}
+
+/* For attributes that arrive with notifications, e.g. printer-state-reasons */
+void
+csd_printer_dests_set_option (CsdPrinterDests *cache,
+                              const gchar     *name,
+                              const gchar     *option,
+                              const gchar     *value)
+{
+        cups_dest_t *dest;
+
+        dest = g_hash_table_lookup (cache->dests, name);
+        if (dest == NULL)
+                return;
+
+        if (value != NULL)
+                dest->num_options = cupsAddOption (option, value,
+                                                   dest->num_options,
+                                                   &dest->options);
+        else
+                dest->num_options = cupsRemoveOption (option,
+                                                      dest->num_options,
+                                                      &dest->options);
+}
+
+cups_dest_t *
+csd_printer_dests_lookup (CsdPrinterDests *cache,
+                          const gchar     *name)
+{
+        if (name == NULL)
+                return NULL;
+
+        return g_hash_table_lookup (cache->dests, name);
+}
+
+const gchar *
+csd_printer_dests_get_option (CsdPrinterDests *cache,
+                              const gchar     *name,
+                              const gchar     *option)
+{
+        cups_dest_t *dest;
+
+        dest = csd_printer_dests_lookup (cache, name);
+        if (dest == NULL)
+                return NULL;
+
+        return cupsGetOption (option, dest->num_options, dest->options);
+}
@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __CSD_PRINTER_DESTS_H
+#define __CSD_PRINTER_DESTS_H
+
+#include <glib.h>
+#include <cups/cups.h>
+
+G_BEGIN_DECLS
+
+typedef struct CsdPrinterDests CsdPrinterDests;
+
+CsdPrinterDests *csd_printer_dests_new          (void);
+void             csd_printer_dests_free         (CsdPrinterDests *cache);
+
+void             csd_printer_dests_replace_all  (CsdPrinterDests *cache,
+                                                 cups_dest_t     *dests,
+                                                 gint             num_dests);
+void             csd_printer_dests_replace      (CsdPrinterDests *cache,
+                                                 const gchar     *name,
+                                                 cups_dest_t     *dest);
+void             csd_printer_dests_remove       (CsdPrinterDests *cache,
+                                                 const gchar     *name);
+void             csd_printer_dests_set_option   (CsdPrinterDests *cache,
+                                                 const gchar     *name,
+                                                 const gchar     *option,
+                                                 const gchar     *value);
+
+cups_dest_t     *csd_printer_dests_lookup       (CsdPrinterDests *cache,
+                                                 const gchar     *name);
+const gchar     *csd_printer_dests_get_option   (CsdPrinterDests *cache,
+                                                 const gchar     *name,
+                                                 const gchar     *option);
+
+G_END_DECLS
+
+#endif /* __CSD_PRINTER_DESTS_H */
@@ -400,16 +400,29 @@ get_tag_value (const gchar *tag_string,
         return tag_value;
 }
 
+/* Looks up a single printer, listing all of them with cupsGetDests() can
+ * take long when there are many shared queues */
+static gboolean
+printer_exists (const gchar *printer_name)
+{
+        cups_dest_t *dest;
+
+        dest = cupsGetNamedDest (CUPS_HTTP_DEFAULT, printer_name, NULL);
+        if (dest == NULL)
+                return FALSE;
+
+        cupsFreeDests (1, dest);
+
+        return TRUE;
+}
+
 static gchar *
 create_name (gchar *device_id)
 {
-        cups_dest_t *dests;
         gboolean     already_present = FALSE;
         gchar       *name = NULL;
         gchar       *new_name = NULL;
-        gint         num_dests;
         gint         name_index = 2;
-        gint         j;
 
         g_return_val_if_fail (device_id != NULL, NULL);
 
@@ -420,7 +433,6 @@ create_name (gchar *device_id)
         if (name)
                 name = g_strcanon (name, ALLOWED_CHARACTERS, '-');
 
-        num_dests = cupsGetDests (&dests);
         do {
                 if (already_present) {
                         new_name = g_strdup_printf ("%s-%d", name, name_index);
@@ -429,10 +441,7 @@ create_name (gchar *device_id)
                         new_name = g_strdup (name);
                 }
 
-                already_present = FALSE;
-                for (j = 0; j < num_dests; j++)
-                        if (g_strcmp0 (dests[j].name, new_name) == 0)
-                                already_present = TRUE;
+                already_present = printer_exists (new_name);
 
                 if (already_present) {
                         g_free (new_name);
@@ -441,7 +450,6 @@ create_name (gchar *device_id)
                         name = new_name;
                 }
         } while (already_present);
-        cupsFreeDests (num_dests, dests);
 
         return name;
 }
@@ -453,13 +461,10 @@ add_printer (gchar *printer_name,
              gchar *info,
              gchar *location)
 {
-        cups_dest_t *dests;
         GDBusProxy  *proxy;
         gboolean     success = FALSE;
         GVariant    *output;
         GError      *error = NULL;
-        gint         num_dests;
-        gint         i;
 
         if (!printer_name || !device_uri || !ppd_name)
                 return FALSE;
@@ -501,11 +506,7 @@ add_printer (gchar *printer_name,
 
         g_object_unref (proxy);
 
-        num_dests = cupsGetDests (&dests);
-        for (i = 0; i < num_dests; i++)
-                if (g_strcmp0 (dests[i].name, printer_name) == 0)
-                        success = TRUE;
-        cupsFreeDests (num_dests, dests);
+        success = printer_exists (printer_name);
 
         return success;
 }
@@ -679,8 +680,6 @@ static char *
 get_dest_attr (const char *dest_name,
                const char *attr)
 {
-        cups_dest_t *dests;
-        int          num_dests;
         cups_dest_t *dest;
         const char  *value;
         char        *ret;
@@ -690,13 +689,7 @@ get_dest_attr (const char *dest_name,
 
         ret = NULL;
 
-        num_dests = cupsGetDests (&dests);
-        if (num_dests < 1) {
-                g_debug ("Unable to get printer destinations");
-                return NULL;
-        }
-
-        dest = cupsGetDest (dest_name, NULL, num_dests, dests);
+        dest = cupsGetNamedDest (CUPS_HTTP_DEFAULT, dest_name, NULL);
         if (dest == NULL) {
                 g_debug ("Unable to find a printer named '%s'", dest_name);
                 goto out;
@@ -709,7 +702,8 @@ get_dest_attr (const char *dest_name,
         }
         ret = g_strdup (value);
 out:
-        cupsFreeDests (num_dests, dests);
+        if (dest != NULL)
+                cupsFreeDests (1, dest);
 
         return ret;
 }
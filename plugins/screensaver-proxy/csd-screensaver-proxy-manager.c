@@ -141,10 +141,30 @@ struct CsdScreensaverProxyManagerPrivate
         GDBusNodeInfo           *introspection_data2;
         guint                    name_id;
 
-        GHashTable              *watch_ht;  /* key = sender, value = name watch id */
-        GHashTable              *cookie_ht; /* key = cookie, value = sender */
+        GCancellable            *session_cancellable;
+
+        GHashTable              *watch_ht;   /* key = sender, value = name watch id */
+        GHashTable              *cookie_ht;  /* key = cookie, value = Inhibitor */
+        GHashTable              *inhibit_ht; /* key = sender, app and reason, value = Inhibitor */
+        guint                    last_cookie;
 };
 
+/* An inhibitor as seen by clients.  The cookie handed out is our own, so
+ * Inhibit can return before the session manager has answered; the session
+ * manager's cookie is only needed to forward the Uninhibit. */
+typedef struct
+{
+        gint                     ref_count;
+        guint                    cookie;
+        guint                    session_cookie;
+        gboolean                 inhibited;  /* session_cookie is valid */
+        gboolean                 released;   /* no client holds it anymore */
+        guint                    holds;      /* coalesced Inhibit calls */
+        gchar                   *sender;
+        gchar                   *key;
+        gchar                   *app_id;
+} Inhibitor;
+
 static void     csd_screensaver_proxy_manager_finalize    (GObject             *object);
 
 G_DEFINE_TYPE (CsdScreensaverProxyManager, csd_screensaver_proxy_manager, G_TYPE_OBJECT)
@@ -183,34 +203,219 @@ cinnamon_settings_session_get_session_proxy (void)
         return session_proxy;
 }
 
+static Inhibitor *
+inhibitor_ref (Inhibitor *inhibitor)
+{
+        inhibitor->ref_count++;
+        return inhibitor;
+}
+
+static void
+inhibitor_unref (Inhibitor *inhibitor)
+{
+        if (--inhibitor->ref_count > 0)
+                return;
+
+        g_free (inhibitor->sender);
+        g_free (inhibitor->key);
+        g_free (inhibitor->app_id);
+        g_free (inhibitor);
+}
+
+static void
+session_uninhibit_cb (GObject      *source_object,
+                      GAsyncResult *res,
+                      gpointer      user_data)
+{
+        GVariant *ret;
+        GError *error = NULL;
+
+        ret = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &error);
+        if (ret == NULL) {
+                g_warning ("Failed to uninhibit the session: %s", error->message);
+                g_error_free (error);
+                return;
+        }
+        g_variant_unref (ret);
+}
+
+static void
+session_uninhibit (GDBusProxy *session,
+                   guint       session_cookie)
+{
+        /* the call keeps the proxy alive until it completes */
+        g_dbus_proxy_call (session,
+                           "Uninhibit",
+                           g_variant_new ("(u)", session_cookie),
+                           G_DBUS_CALL_FLAGS_NONE,
+                           -1, NULL,
+                           session_uninhibit_cb, NULL);
+}
+
+static void
+session_inhibit_cb (GObject      *source_object,
+                    GAsyncResult *res,
+                    gpointer      user_data)
+{
+        Inhibitor *inhibitor = user_data;
+        GVariant *ret;
+        GError *error = NULL;
+
+        ret = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &error);
+        if (ret == NULL) {
+                if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                        g_warning ("Failed to inhibit the session for %s: %s",
+                                   inhibitor->app_id, error->message);
+                g_error_free (error);
+                inhibitor_unref (inhibitor);
+                return;
+        }
+
+        g_variant_get (ret, "(u)", &inhibitor->session_cookie);
+        g_variant_unref (ret);
+        inhibitor->inhibited = TRUE;
+        g_debug ("Cookie %u for %s is session cookie %u",
+                 inhibitor->cookie, inhibitor->sender, inhibitor->session_cookie);
+
+        /* the client let go while the session manager was answering */
+        if (inhibitor->released)
+                session_uninhibit (G_DBUS_PROXY (source_object),
+                                   inhibitor->session_cookie);
+
+        inhibitor_unref (inhibitor);
+}
+
+static guint
+manager_next_cookie (CsdScreensaverProxyManager *manager)
+{
+        do {
+                manager->priv->last_cookie++;
+        } while (manager->priv->last_cookie == 0 ||
+                 g_hash_table_contains (manager->priv->cookie_ht,
+                                        GUINT_TO_POINTER (manager->priv->last_cookie)));
+
+        return manager->priv->last_cookie;
+}
+
+/* Forwards the Uninhibit, now or once the session manager has answered,
+ * and drops the inhibitor from inhibit_ht; the caller removes it from
+ * cookie_ht. */
+static void
+inhibitor_release (CsdScreensaverProxyManager *manager,
+                   Inhibitor                  *inhibitor)
+{
+        inhibitor->released = TRUE;
+        if (inhibitor->inhibited)
+                session_uninhibit (manager->priv->session, inhibitor->session_cookie);
+
+        g_hash_table_remove (manager->priv->inhibit_ht, inhibitor->key);
+}
+
 static void
 name_vanished_cb (GDBusConnection            *connection,
                   const gchar                *name,
                   CsdScreensaverProxyManager *manager)
 {
         GHashTableIter iter;
-        gpointer cookie_ptr;
-        const char *sender;
+        Inhibitor *inhibitor;
 
         /* Look for all the cookies under that name,
          * and call uninhibit for them */
         g_hash_table_iter_init (&iter, manager->priv->cookie_ht);
-        while (g_hash_table_iter_next (&iter, &cookie_ptr, (gpointer *) &sender)) {
-                if (g_strcmp0 (sender, name) == 0) {
-                        guint cookie = GPOINTER_TO_UINT (cookie_ptr);
-
-                        g_dbus_proxy_call_sync (manager->priv->session,
-                                                "Uninhibit",
-                                                g_variant_new ("(u)", cookie),
-                                                G_DBUS_CALL_FLAGS_NONE,
-                                                -1, NULL, NULL);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &inhibitor)) {
+                if (g_strcmp0 (inhibitor->sender, name) == 0) {
                         g_debug ("Removing cookie %u for sender %s",
-                                 cookie, sender);
+                                 inhibitor->cookie, name);
+                        inhibitor_release (manager, inhibitor);
                         g_hash_table_iter_remove (&iter);
                 }
         }
 
-        g_hash_table_remove (manager->priv->watch_ht, sender);
+        g_hash_table_remove (manager->priv->watch_ht, name);
+}
+
+static guint
+handle_inhibit (CsdScreensaverProxyManager *manager,
+                const gchar                *sender,
+                const gchar                *app_id,
+                const gchar                *reason)
+{
+        Inhibitor *inhibitor;
+        gchar *key;
+
+        /* the same inhibit again, e.g. a browser starting another video */
+        key = g_strdup_printf ("%s\n%s\n%s", sender, app_id, reason);
+        inhibitor = g_hash_table_lookup (manager->priv->inhibit_ht, key);
+        if (inhibitor != NULL) {
+                g_free (key);
+                inhibitor->holds++;
+                g_debug ("Coalesced inhibit from %s into cookie %u (%u holds)",
+                         sender, inhibitor->cookie, inhibitor->holds);
+                return inhibitor->cookie;
+        }
+
+        inhibitor = g_new0 (Inhibitor, 1);
+        inhibitor->ref_count = 1;
+        inhibitor->cookie = manager_next_cookie (manager);
+        inhibitor->holds = 1;
+        inhibitor->sender = g_strdup (sender);
+        inhibitor->key = key;
+        inhibitor->app_id = g_strdup (app_id);
+        g_hash_table_insert (manager->priv->cookie_ht,
+                             GUINT_TO_POINTER (inhibitor->cookie),
+                             inhibitor);
+        g_hash_table_insert (manager->priv->inhibit_ht,
+                             inhibitor->key,
+                             inhibitor);
+
+        if (g_hash_table_lookup (manager->priv->watch_ht, sender) == NULL) {
+                guint watch_id;
+
+                watch_id = g_bus_watch_name_on_connection (manager->priv->connection,
+                                                           sender,
+                                                           G_BUS_NAME_WATCHER_FLAGS_NONE,
+                                                           NULL,
+                                                           (GBusNameVanishedCallback) name_vanished_cb,
+                                                           manager,
+                                                           NULL);
+                g_hash_table_insert (manager->priv->watch_ht,
+                                     g_strdup (sender),
+                                     GUINT_TO_POINTER (watch_id));
+        }
+
+        g_dbus_proxy_call (manager->priv->session,
+                           "Inhibit",
+                           g_variant_new ("(susu)",
+                                          app_id, 0, reason, GSM_INHIBITOR_FLAG_IDLE),
+                           G_DBUS_CALL_FLAGS_NONE,
+                           -1,
+                           manager->priv->session_cancellable,
+                           session_inhibit_cb,
+                           inhibitor_ref (inhibitor));
+
+        return inhibitor->cookie;
+}
+
+static void
+handle_uninhibit (CsdScreensaverProxyManager *manager,
+                  const gchar                *sender,
+                  guint                       cookie)
+{
+        Inhibitor *inhibitor;
+
+        inhibitor = g_hash_table_lookup (manager->priv->cookie_ht,
+                                         GUINT_TO_POINTER (cookie));
+        if (inhibitor == NULL || g_strcmp0 (inhibitor->sender, sender) != 0) {
+                g_debug ("Ignoring unknown cookie %u from %s", cookie, sender);
+                return;
+        }
+
+        if (--inhibitor->holds > 0)
+                return;
+
+        g_debug ("Removing cookie %u for sender %s", cookie, sender);
+        inhibitor_release (manager, inhibitor);
+        g_hash_table_remove (manager->priv->cookie_ht, GUINT_TO_POINTER (cookie));
 }
 
 static void
@@ -234,49 +439,24 @@ handle_method_call (GDBusConnection       *connection,
         g_debug ("Calling method '%s.%s' for ScreenSaver Proxy",
                  interface_name, method_name);
 
+        /* Inhibit and UnInhibit are answered from the local cookie table
+         * right away, the session manager is updated asynchronously */
         if (g_strcmp0 (method_name, "Inhibit") == 0) {
-                GVariant *ret;
                 const char *app_id;
                 const char *reason;
                 guint cookie;
 
                 g_variant_get (parameters,
-                               "(ss)", &app_id, &reason);
-
-                ret = g_dbus_proxy_call_sync (manager->priv->session,
-                                              "Inhibit",
-                                              g_variant_new ("(susu)",
-                                                             app_id, 0, reason, GSM_INHIBITOR_FLAG_IDLE),
-                                              G_DBUS_CALL_FLAGS_NONE,
-                                              -1, NULL, NULL);
-                g_variant_get (ret, "(u)", &cookie);
-                g_hash_table_insert (manager->priv->cookie_ht,
-                                     GUINT_TO_POINTER (cookie),
-                                     g_strdup (sender));
-                if (g_hash_table_lookup (manager->priv->watch_ht, sender) == NULL) {
-                        guint watch_id;
-
-                        watch_id = g_bus_watch_name_on_connection (manager->priv->connection,
-                                                                   sender,
-                                                                   G_BUS_NAME_WATCHER_FLAGS_NONE,
-                                                                   NULL,
-                                                                   (GBusNameVanishedCallback) name_vanished_cb,
-                                                                   manager,
-                                                                   NULL);
-                        g_hash_table_insert (manager->priv->watch_ht,
-                                             g_strdup (sender),
-                                             GUINT_TO_POINTER (watch_id));
-                }
-                g_dbus_method_invocation_return_value (invocation, ret);
+                               "(&s&s)", &app_id, &reason);
+
+                cookie = handle_inhibit (manager, sender, app_id, reason);
+                g_dbus_method_invocation_return_value (invocation,
+                                                       g_variant_new ("(u)", cookie));
         } else if (g_strcmp0 (method_name, "UnInhibit") == 0) {
                 guint cookie;
 
                 g_variant_get (parameters, "(u)", &cookie);
-                g_dbus_proxy_call_sync (manager->priv->session,
-                                        "Uninhibit",
-                                        parameters,
-                                        G_DBUS_CALL_FLAGS_NONE,
-                                        -1, NULL, NULL);
+                handle_uninhibit (manager, sender, cookie);
                 g_dbus_method_invocation_return_value (invocation, NULL);
         } else if (g_strcmp0 (method_name, "Throttle") == 0) {
                 g_dbus_method_invocation_return_value (invocation, NULL);
@@ -389,7 +569,9 @@ csd_screensaver_proxy_manager_start (CsdScreensaverProxyManager *manager,
         manager->priv->cookie_ht = g_hash_table_new_full (g_direct_hash,
                                                           g_direct_equal,
                                                           NULL,
-                                                          (GDestroyNotify) g_free);
+                                                          (GDestroyNotify) inhibitor_unref);
+        manager->priv->inhibit_ht = g_hash_table_new (g_str_hash, g_str_equal);
+        manager->priv->session_cancellable = g_cancellable_new ();
         cinnamon_settings_profile_end (NULL);
         return TRUE;
 }
@@ -399,6 +581,12 @@ csd_screensaver_proxy_manager_stop (CsdScreensaverProxyManager *manager)
 {
         g_debug ("Stopping screensaver_proxy manager");
 
+        if (manager->priv->session_cancellable != NULL) {
+                g_cancellable_cancel (manager->priv->session_cancellable);
+                g_object_unref (manager->priv->session_cancellable);
+                manager->priv->session_cancellable = NULL;
+        }
+
         if (manager->priv->session != NULL) {
                 g_object_unref (manager->priv->session);
                 manager->priv->session = NULL;
@@ -409,6 +597,11 @@ csd_screensaver_proxy_manager_stop (CsdScreensaverProxyManager *manager)
                 manager->priv->watch_ht = NULL;
         }
 
+        if (manager->priv->inhibit_ht != NULL) {
+                g_hash_table_destroy (manager->priv->inhibit_ht);
+                manager->priv->inhibit_ht = NULL;
+        }
+
         if (manager->priv->cookie_ht != NULL) {
                 g_hash_table_destroy (manager->priv->cookie_ht);
                 manager->priv->cookie_ht = NULL;
@@ -44,6 +44,10 @@
 #include <glib.h>
 #include <glib/gi18n.h>
 
+#ifdef HAVE_GUDEV
+#include <gudev/gudev.h>
+#endif
+
 #include <prerror.h>
 #include <prinit.h>
 #include <nss.h>
@@ -67,8 +71,21 @@
 #define CSD_OPEN_FILE_DESCRIPTORS_DIR "/proc/self/fd"
 #endif
 
+#define CSD_SMARTCARD_MANAGER_SCHEMA "org.cinnamon.settings-daemon.peripherals.smartcard"
+
+/* Drivers that implement C_WaitForSlotEvent() block until a card event,
+ * for the others NSS polls the slots at this interval */
+#define CSD_SMARTCARD_MANAGER_POLL_INTERVAL PR_SecondsToInterval (1)
+
+/* How long to keep watching for card events after the last reader is
+ * unplugged, so the removal of a card that was still in it is seen */
+#define CSD_SMARTCARD_MANAGER_READER_REMOVAL_TIMEOUT 5 /* secs */
+
 typedef enum _CsdSmartcardManagerState CsdSmartcardManagerState;
 typedef struct _CsdSmartcardManagerWorker CsdSmartcardManagerWorker;
+typedef struct _CsdSmartcardManagerEvent CsdSmartcardManagerEvent;
+typedef struct _CsdSmartcardManagerEventQueue CsdSmartcardManagerEventQueue;
+typedef struct _CsdSmartcardManagerSlot CsdSmartcardManagerSlot;
 
 enum _CsdSmartcardManagerState {
         CSD_SMARTCARD_MANAGER_STATE_STOPPED = 0,
@@ -83,27 +100,66 @@ struct _CsdSmartcardManagerPrivate {
         char        *module_path;
 
         GList        *workers;
+        CsdSmartcardManagerEventQueue *event_queue;
 
         GPid smartcard_event_watcher_pid;
         GHashTable *smartcards;
+        GHashTable *slots;
 
         guint poll_timeout_id;
 
+#ifdef HAVE_GUDEV
+        GUdevClient *udev_client;
+        GHashTable  *readers;
+        guint        readers_timeout_id;
+#endif
+
         guint32 is_unstoppable : 1;
         guint32 nss_is_loaded : 1;
 };
 
+/* There is one worker thread per module, since C_WaitForSlotEvent()
+ * blocks on a single module and has nothing that could be polled
+ * together with the others.  The threads only report what changed, the
+ * cards are tracked in the main thread. */
 struct _CsdSmartcardManagerWorker {
+        volatile gint ref_count;
+        volatile gint cancelled;
+
         CsdSmartcardManager *manager;
-        int manager_fd;
+        CsdSmartcardManagerEventQueue *event_queue;
 
         GThread      *thread;
         SECMODModule *module;
-        GHashTable *smartcards;
-        int fd;
-        GSource *event_source;
+};
 
-        guint32 nss_is_loaded : 1;
+/* A slot event seen by a worker, or the error that stopped it */
+struct _CsdSmartcardManagerEvent {
+        SECMODModule *module;
+        CK_SLOT_ID slot_id;
+        int slot_series;
+        gboolean is_present;
+
+        GError *error;
+};
+
+/* Events of all workers are collected here and handed to the main loop
+ * in batches, so a burst of them costs a single wakeup */
+struct _CsdSmartcardManagerEventQueue {
+        volatile gint ref_count;
+
+        GMutex lock;
+        GPtrArray *events;
+        guint idle_id;
+        gboolean is_closed;
+
+        CsdSmartcardManager *manager;
+};
+
+/* Slot ids are only unique within a module */
+struct _CsdSmartcardManagerSlot {
+        SECMODModule *module;
+        CK_SLOT_ID slot_id;
 };
 
 static void csd_smartcard_manager_finalize (GObject *object);
@@ -124,21 +180,20 @@ static void csd_smartcard_manager_card_removed_handler (CsdSmartcardManager *man
 static void csd_smartcard_manager_card_inserted_handler (CsdSmartcardManager *manager_class,
                                                          CsdSmartcard        *card);
 static gboolean csd_smartcard_manager_stop_now (CsdSmartcardManager *manager);
+static void start_workers (CsdSmartcardManager *manager);
 static void csd_smartcard_manager_queue_stop (CsdSmartcardManager *manager);
 
 static CsdSmartcardManagerWorker *csd_smartcard_manager_create_worker (CsdSmartcardManager  *manager,
                                                                        SECMODModule         *module);
 
-static CsdSmartcardManagerWorker * csd_smartcard_manager_worker_new (CsdSmartcardManager *manager,
-                                                                     int                  worker_fd,
-                                                                     int                  manager_fd,
-                                                                     SECMODModule        *module);
-static void csd_smartcard_manager_worker_free (CsdSmartcardManagerWorker *worker);
-static gboolean open_pipe (int *write_fd, int *read_fd);
-static gboolean read_bytes (int fd, gpointer bytes, gsize num_bytes);
-static gboolean write_bytes (int fd, gconstpointer bytes, gsize num_bytes);
-static CsdSmartcard *read_smartcard (int fd, SECMODModule *module);
-static gboolean write_smartcard (int fd, CsdSmartcard *card);
+static CsdSmartcardManagerWorker * csd_smartcard_manager_worker_new (CsdSmartcardManager           *manager,
+                                                                     CsdSmartcardManagerEventQueue *event_queue,
+                                                                     SECMODModule                  *module);
+static CsdSmartcardManagerWorker *csd_smartcard_manager_worker_ref (CsdSmartcardManagerWorker *worker);
+static void csd_smartcard_manager_worker_unref (CsdSmartcardManagerWorker *worker);
+static void csd_smartcard_manager_event_queue_unref (CsdSmartcardManagerEventQueue *event_queue);
+static void csd_smartcard_manager_process_events (CsdSmartcardManager *manager,
+                                                  GPtrArray           *events);
 
 enum {
         PROP_0 = 0,
@@ -344,6 +399,20 @@ slot_id_hash (CK_SLOT_ID *slot_id)
         return upper_bits + g_int_hash (&temp);
 }
 
+static gboolean
+slot_equal (CsdSmartcardManagerSlot *slot_1,
+            CsdSmartcardManagerSlot *slot_2)
+{
+        return slot_1->module == slot_2->module &&
+               slot_id_equal (&slot_1->slot_id, &slot_2->slot_id);
+}
+
+static guint
+slot_hash (CsdSmartcardManagerSlot *slot)
+{
+        return g_direct_hash (slot->module) ^ slot_id_hash (&slot->slot_id);
+}
+
 static void
 csd_smartcard_manager_init (CsdSmartcardManager *manager)
 {
@@ -360,6 +429,12 @@ csd_smartcard_manager_init (CsdSmartcardManager *manager)
                                        g_str_equal,
                                        (GDestroyNotify) g_free,
                                        (GDestroyNotify) g_object_unref);
+
+        manager->priv->slots =
+                g_hash_table_new_full ((GHashFunc) slot_hash,
+                                       (GEqualFunc) slot_equal,
+                                       (GDestroyNotify) g_free,
+                                       (GDestroyNotify) g_object_unref);
 }
 
 static void
@@ -377,6 +452,9 @@ csd_smartcard_manager_finalize (GObject *object)
         g_hash_table_destroy (manager->priv->smartcards);
         manager->priv->smartcards = NULL;
 
+        g_hash_table_destroy (manager->priv->slots);
+        manager->priv->slots = NULL;
+
         gobject_class->finalize (object);
 }
 
@@ -440,102 +518,290 @@ csd_smartcard_manager_emit_smartcard_removed (CsdSmartcardManager *manager,
         manager->priv->is_unstoppable = FALSE;
 }
 
-static gboolean
-csd_smartcard_manager_check_for_and_process_events (GIOChannel          *io_channel,
-                                                    GIOCondition         condition,
-                                                    CsdSmartcardManagerWorker *worker)
+static void
+csd_smartcard_manager_card_inserted (CsdSmartcardManager *manager,
+                                     SECMODModule        *module,
+                                     CK_SLOT_ID           slot_id,
+                                     CsdSmartcard        *card)
+{
+        CsdSmartcardManagerSlot *slot;
+
+        slot = g_new (CsdSmartcardManagerSlot, 1);
+        slot->module = module;
+        slot->slot_id = slot_id;
+        g_hash_table_replace (manager->priv->slots, slot, g_object_ref (card));
+
+        g_hash_table_replace (manager->priv->smartcards,
+                              csd_smartcard_get_name (card), card);
+
+        csd_smartcard_manager_emit_smartcard_inserted (manager, card);
+}
+
+static void
+csd_smartcard_manager_card_removed (CsdSmartcardManager     *manager,
+                                    CsdSmartcardManagerSlot *slot,
+                                    CsdSmartcard            *card)
 {
-        CsdSmartcard *card;
-        CsdSmartcardManager *manager;
-        gboolean should_stop;
-        guchar event_type;
         char *card_name;
-        int fd;
 
-        manager = worker->manager;
+        g_object_ref (card);
+        g_hash_table_remove (manager->priv->slots, slot);
 
-        g_debug ("event!");
-        card = NULL;
-        should_stop = (condition & G_IO_HUP) || (condition & G_IO_ERR);
-
-        if (should_stop) {
-                g_debug ("received %s on event socket, stopping "
-                          "manager...",
-                          (condition & G_IO_HUP) && (condition & G_IO_ERR)?
-                          "error and hangup" :
-                          (condition & G_IO_HUP)?
-                          "hangup" : "error");
+        csd_smartcard_manager_emit_smartcard_removed (manager, card);
+
+        card_name = csd_smartcard_get_name (card);
+        if (!g_hash_table_remove (manager->priv->smartcards, card_name)) {
+                g_debug ("got removal event of unknown card!");
         }
+        g_free (card_name);
 
-        if (!(condition & G_IO_IN)) {
-                g_debug ("nevermind outta here!");
-                goto out;
+        g_object_unref (card);
+}
+
+static void
+csd_smartcard_manager_process_event (CsdSmartcardManager      *manager,
+                                     CsdSmartcardManagerEvent *event)
+{
+        CsdSmartcardManagerSlot slot;
+        CsdSmartcard *card;
+        int card_slot_series;
+
+        /* the slot id and series together uniquely identify a card.
+         * You can never have two cards with the same slot id at the
+         * same time, however (I think), so we can key off of it.
+         */
+        slot.module = event->module;
+        slot.slot_id = event->slot_id;
+
+        /* First check to see if there is a card that we're currently
+         * tracking in the slot.
+         */
+        card = g_hash_table_lookup (manager->priv->slots, &slot);
+
+        if (card != NULL) {
+                card_slot_series = csd_smartcard_get_slot_series (card);
+        } else {
+                card_slot_series = -1;
         }
 
-        fd = g_io_channel_unix_get_fd (io_channel);
+        if (event->is_present) {
+                /* NSS reports cards that are already inserted again when
+                 * the workers are restarted, they are still the same card.
+                 */
+                if (card_slot_series == event->slot_series) {
+                        g_debug ("card in slot %lu already known", (gulong) event->slot_id);
+                        return;
+                }
 
-        event_type = '\0';
-        if (!read_bytes (fd, &event_type, 1)) {
-                g_debug ("could not read event type, stopping");
-                should_stop = TRUE;
-                goto out;
+                /* Now, check to see if their is a new card in the slot.
+                 * If there was a different card in the slot now than
+                 * there was before, then we need to emit a removed signal
+                 * for the old card (we don't want unpaired insertion events).
+                 */
+                if (card != NULL) {
+                        csd_smartcard_manager_card_removed (manager, &slot, card);
+                }
+
+                card = _csd_smartcard_new (event->module,
+                                           event->slot_id, event->slot_series);
+                csd_smartcard_manager_card_inserted (manager, event->module,
+                                                     event->slot_id, card);
+        } else {
+                /* if we aren't tracking the card, just discard the event.
+                 * We don't want unpaired remove events.  Note on startup
+                 * NSS will generate an "insertion" event if a card is
+                 * already inserted in the slot.
+                 */
+                if (card == NULL) {
+                        g_debug ("got spurious remove event");
+                        return;
+                }
+
+                /* FIXME: i'm not sure about this code.  Maybe we
+                 * shouldn't do this at all, or maybe we should do it
+                 * n times (where n = slot_series - card_slot_series + 1)
+                 *
+                 * Right now, i'm just doing it once.
+                 */
+                if ((event->slot_series - card_slot_series) > 1) {
+                        csd_smartcard_manager_card_removed (manager, &slot, card);
+
+                        card = _csd_smartcard_new (event->module,
+                                                   event->slot_id, event->slot_series);
+                        csd_smartcard_manager_card_inserted (manager, event->module,
+                                                             event->slot_id, card);
+                }
+
+                csd_smartcard_manager_card_removed (manager, &slot, card);
         }
+}
 
-        card = read_smartcard (fd, worker->module);
+/* The thread of a worker that reported an error has already exited, the
+ * workers of the other modules keep running */
+static void
+csd_smartcard_manager_forget_worker (CsdSmartcardManager *manager,
+                                     SECMODModule        *module)
+{
+        GList *node;
 
-        if (card == NULL) {
-                g_debug ("could not read card, stopping");
-                should_stop = TRUE;
-                goto out;
+        for (node = manager->priv->workers; node != NULL; node = node->next) {
+                CsdSmartcardManagerWorker *worker;
+
+                worker = (CsdSmartcardManagerWorker *) node->data;
+                if (worker->module != module) {
+                        continue;
+                }
+
+                g_debug ("no longer watching module '%s' for card events",
+                         module->commonName);
+                manager->priv->workers = g_list_delete_link (manager->priv->workers, node);
+                worker->thread = NULL;
+                csd_smartcard_manager_worker_unref (worker);
+                break;
         }
+}
 
-        card_name = csd_smartcard_get_name (card);
-        g_debug ("card '%s' had event %c", card_name, event_type);
+static void
+csd_smartcard_manager_process_events (CsdSmartcardManager *manager,
+                                      GPtrArray           *events)
+{
+        guint i;
 
-        switch (event_type) {
-                case 'I':
-                        g_hash_table_replace (manager->priv->smartcards,
-                                              card_name, card);
-                        card_name = NULL;
+        g_debug ("processing %u card event(s)", events->len);
 
-                        csd_smartcard_manager_emit_smartcard_inserted (manager, card);
-                        card = NULL;
-                        break;
+        for (i = 0; i < events->len; i++) {
+                CsdSmartcardManagerEvent *event;
 
-                case 'R':
-                        csd_smartcard_manager_emit_smartcard_removed (manager, card);
-                        if (!g_hash_table_remove (manager->priv->smartcards, card_name)) {
-                                g_debug ("got removal event of unknown card!");
-                        }
-                        g_free (card_name);
-                        card_name = NULL;
-                        card = NULL;
+                /* a signal handler may have stopped us */
+                if (manager->priv->state != CSD_SMARTCARD_MANAGER_STATE_STARTED) {
                         break;
+                }
 
-                default:
-                        g_free (card_name);
-                        card_name = NULL;
-                        g_object_unref (card);
+                event = g_ptr_array_index (events, i);
 
-                        should_stop = TRUE;
-                        break;
+                if (event->error != NULL) {
+                        csd_smartcard_manager_emit_error (manager, event->error);
+                        csd_smartcard_manager_forget_worker (manager, event->module);
+                        continue;
+                }
+
+                csd_smartcard_manager_process_event (manager, event);
         }
+}
 
-out:
-        if (should_stop) {
-                GError *error;
+static void
+csd_smartcard_manager_event_free (CsdSmartcardManagerEvent *event)
+{
+        if (event->module != NULL) {
+                SECMOD_DestroyModule (event->module);
+        }
 
-                error = g_error_new (CSD_SMARTCARD_MANAGER_ERROR,
-                                     CSD_SMARTCARD_MANAGER_ERROR_WATCHING_FOR_EVENTS,
-                                     "%s", (condition & G_IO_IN) ? g_strerror (errno) : _("received error or hang up from event source"));
+        if (event->error != NULL) {
+                g_error_free (event->error);
+        }
 
-                csd_smartcard_manager_emit_error (manager, error);
-                g_error_free (error);
-                csd_smartcard_manager_stop_now (manager);
-                return FALSE;
+        g_slice_free (CsdSmartcardManagerEvent, event);
+}
+
+static CsdSmartcardManagerEventQueue *
+csd_smartcard_manager_event_queue_new (CsdSmartcardManager *manager)
+{
+        CsdSmartcardManagerEventQueue *event_queue;
+
+        event_queue = g_slice_new0 (CsdSmartcardManagerEventQueue);
+        event_queue->ref_count = 1;
+        event_queue->manager = manager;
+        g_mutex_init (&event_queue->lock);
+        event_queue->events =
+                g_ptr_array_new_with_free_func ((GDestroyNotify) csd_smartcard_manager_event_free);
+
+        return event_queue;
+}
+
+static CsdSmartcardManagerEventQueue *
+csd_smartcard_manager_event_queue_ref (CsdSmartcardManagerEventQueue *event_queue)
+{
+        g_atomic_int_inc (&event_queue->ref_count);
+
+        return event_queue;
+}
+
+static void
+csd_smartcard_manager_event_queue_unref (CsdSmartcardManagerEventQueue *event_queue)
+{
+        if (!g_atomic_int_dec_and_test (&event_queue->ref_count)) {
+                return;
         }
 
-        return TRUE;
+        g_ptr_array_unref (event_queue->events);
+        g_mutex_clear (&event_queue->lock);
+
+        g_slice_free (CsdSmartcardManagerEventQueue, event_queue);
+}
+
+static gboolean
+csd_smartcard_manager_event_queue_dispatch (CsdSmartcardManagerEventQueue *event_queue)
+{
+        CsdSmartcardManager *manager;
+        GPtrArray *events;
+
+        g_mutex_lock (&event_queue->lock);
+        events = event_queue->events;
+        event_queue->events =
+                g_ptr_array_new_with_free_func ((GDestroyNotify) csd_smartcard_manager_event_free);
+        event_queue->idle_id = 0;
+        manager = event_queue->manager;
+        g_mutex_unlock (&event_queue->lock);
+
+        /* may close the queue */
+        csd_smartcard_manager_process_events (manager, events);
+        g_ptr_array_unref (events);
+
+        return G_SOURCE_REMOVE;
+}
+
+/* Called from the worker threads, takes ownership of @event */
+static void
+csd_smartcard_manager_event_queue_push (CsdSmartcardManagerEventQueue *event_queue,
+                                        CsdSmartcardManagerEvent      *event)
+{
+        g_mutex_lock (&event_queue->lock);
+
+        if (event_queue->is_closed) {
+                g_mutex_unlock (&event_queue->lock);
+                csd_smartcard_manager_event_free (event);
+                return;
+        }
+
+        g_ptr_array_add (event_queue->events, event);
+
+        if (event_queue->idle_id == 0) {
+                event_queue->idle_id =
+                        g_idle_add ((GSourceFunc) csd_smartcard_manager_event_queue_dispatch,
+                                    event_queue);
+        }
+
+        g_mutex_unlock (&event_queue->lock);
+}
+
+/* Drops pending events, workers that are still winding down can keep
+ * pushing into the queue until they let go of it */
+static void
+csd_smartcard_manager_event_queue_close (CsdSmartcardManagerEventQueue *event_queue)
+{
+        g_mutex_lock (&event_queue->lock);
+
+        event_queue->is_closed = TRUE;
+        g_ptr_array_set_size (event_queue->events, 0);
+
+        if (event_queue->idle_id != 0) {
+                g_source_remove (event_queue->idle_id);
+                event_queue->idle_id = 0;
+        }
+
+        g_mutex_unlock (&event_queue->lock);
+
+        csd_smartcard_manager_event_queue_unref (event_queue);
 }
 
 static void
@@ -556,81 +822,196 @@ stop_worker (CsdSmartcardManagerWorker *worker)
         CsdSmartcardManager *manager;
 
         manager = worker->manager;
+        manager->priv->workers = g_list_remove (manager->priv->workers, worker);
 
-        if (worker->event_source != NULL) {
-                g_source_destroy (worker->event_source);
-                worker->event_source = NULL;
-        }
-
+        /* the thread notices the flag once the wait returns, and drops
+         * its reference to the worker on the way out */
         if (worker->thread != NULL) {
+                g_atomic_int_set (&worker->cancelled, TRUE);
                 SECMOD_CancelWait (worker->module);
                 worker->thread = NULL;
         }
 
-        SECMOD_DestroyModule (worker->module);
-        manager->priv->workers = g_list_remove (manager->priv->workers, worker);
+        csd_smartcard_manager_worker_unref (worker);
+}
+
+static void
+csd_smartcard_manager_stop_watching_for_events (CsdSmartcardManager  *manager)
+{
+        GList *node;
+
+        node = manager->priv->workers;
+        while (node != NULL) {
+                CsdSmartcardManagerWorker *worker;
+                GList *next_node;
+
+                worker = (CsdSmartcardManagerWorker *) node->data;
+                next_node = node->next;
+
+                stop_worker (worker);
 
-        if (manager->priv->workers == NULL && manager->priv->state != CSD_SMARTCARD_MANAGER_STATE_STOPPED) {
-                stop_manager (manager);
+                node = next_node;
         }
 }
 
-static void
-csd_smartcard_manager_event_processing_stopped_handler (CsdSmartcardManagerWorker *worker)
+#ifdef HAVE_GUDEV
+static gboolean
+is_smartcard_reader (GUdevDevice *device)
 {
-        worker->event_source = NULL;
+        const char *interfaces;
+
+        if (g_strcmp0 (g_udev_device_get_devtype (device), "usb_device") != 0) {
+                return FALSE;
+        }
 
-        stop_worker (worker);
+        if (g_udev_device_get_property (device, "ID_SMARTCARD_READER") != NULL) {
+                return TRUE;
+        }
+
+        /* CCID readers use USB interface class 0x0b */
+        interfaces = g_udev_device_get_property (device, "ID_USB_INTERFACES");
+
+        return interfaces != NULL && strstr (interfaces, ":0b") != NULL;
 }
 
 static gboolean
-open_pipe (int *write_fd,
-           int *read_fd)
+on_readers_timeout (CsdSmartcardManager *manager)
 {
-        int pipe_fds[2] = { -1, -1 };
+        manager->priv->readers_timeout_id = 0;
 
-        g_assert (write_fd != NULL);
-        g_assert (read_fd != NULL);
+        g_debug ("no smartcard reader left, no longer watching for card events");
+        csd_smartcard_manager_stop_watching_for_events (manager);
 
-        if (pipe (pipe_fds) < 0) {
-                return FALSE;
+        return G_SOURCE_REMOVE;
+}
+
+static void
+csd_smartcard_manager_readers_changed (CsdSmartcardManager *manager)
+{
+        if (manager->priv->readers_timeout_id != 0) {
+                g_source_remove (manager->priv->readers_timeout_id);
+                manager->priv->readers_timeout_id = 0;
         }
 
-        if (fcntl (pipe_fds[0], F_SETFD, FD_CLOEXEC) < 0) {
-                close (pipe_fds[0]);
-                close (pipe_fds[1]);
-                return FALSE;
+        if (g_hash_table_size (manager->priv->readers) > 0) {
+                if (manager->priv->workers == NULL) {
+                        g_debug ("smartcard reader plugged in, watching for card events");
+                        start_workers (manager);
+                }
+        } else if (manager->priv->workers != NULL) {
+                manager->priv->readers_timeout_id =
+                        g_timeout_add_seconds (CSD_SMARTCARD_MANAGER_READER_REMOVAL_TIMEOUT,
+                                               (GSourceFunc) on_readers_timeout,
+                                               manager);
+        }
+}
+
+static void
+on_reader_uevent (GUdevClient         *client,
+                  const char          *action,
+                  GUdevDevice         *device,
+                  CsdSmartcardManager *manager)
+{
+        const char *sysfs_path;
+
+        sysfs_path = g_udev_device_get_sysfs_path (device);
+
+        if (g_strcmp0 (action, "add") == 0 && is_smartcard_reader (device)) {
+                g_debug ("smartcard reader '%s' added", sysfs_path);
+                g_hash_table_add (manager->priv->readers, g_strdup (sysfs_path));
+        } else if (g_strcmp0 (action, "remove") == 0 &&
+                   g_hash_table_remove (manager->priv->readers, sysfs_path)) {
+                g_debug ("smartcard reader '%s' removed", sysfs_path);
+        } else {
+                return;
         }
 
-        if (fcntl (pipe_fds[1], F_SETFD, FD_CLOEXEC) < 0) {
-                close (pipe_fds[0]);
-                close (pipe_fds[1]);
+        csd_smartcard_manager_readers_changed (manager);
+}
+#endif
+
+/* Without a reader there can't be any card events, so when enabled the
+ * token event threads are only run while a reader is plugged in.  Returns
+ * %FALSE if readers aren't watched and the threads should always run. */
+static gboolean
+csd_smartcard_manager_start_watching_for_readers (CsdSmartcardManager *manager)
+{
+#ifdef HAVE_GUDEV
+        const char * const subsystems[] = { "usb", NULL };
+        GSettings *settings;
+        GList *devices, *node;
+        gboolean wait_for_reader;
+
+        settings = g_settings_new (CSD_SMARTCARD_MANAGER_SCHEMA);
+        wait_for_reader = g_settings_get_boolean (settings, "wait-for-reader");
+        g_object_unref (settings);
+
+        if (!wait_for_reader) {
                 return FALSE;
         }
 
-        *read_fd = pipe_fds[0];
-        *write_fd = pipe_fds[1];
+        manager->priv->readers = g_hash_table_new_full (g_str_hash,
+                                                        g_str_equal,
+                                                        (GDestroyNotify) g_free,
+                                                        NULL);
+        manager->priv->udev_client = g_udev_client_new (subsystems);
+        g_signal_connect (manager->priv->udev_client, "uevent",
+                          G_CALLBACK (on_reader_uevent), manager);
+
+        devices = g_udev_client_query_by_subsystem (manager->priv->udev_client, "usb");
+        for (node = devices; node != NULL; node = node->next) {
+                GUdevDevice *device = node->data;
+
+                if (is_smartcard_reader (device)) {
+                        g_hash_table_add (manager->priv->readers,
+                                          g_strdup (g_udev_device_get_sysfs_path (device)));
+                }
+                g_object_unref (device);
+        }
+        g_list_free (devices);
+
+        g_debug ("%u smartcard reader(s) plugged in",
+                 g_hash_table_size (manager->priv->readers));
 
         return TRUE;
+#else
+        return FALSE;
+#endif
 }
 
-static void
-csd_smartcard_manager_stop_watching_for_events (CsdSmartcardManager  *manager)
+static gboolean
+csd_smartcard_manager_has_readers (CsdSmartcardManager *manager)
 {
-        GList *node;
-
-        node = manager->priv->workers;
-        while (node != NULL) {
-                CsdSmartcardManagerWorker *worker;
-                GList *next_node;
+#ifdef HAVE_GUDEV
+        if (manager->priv->readers != NULL) {
+                return g_hash_table_size (manager->priv->readers) > 0;
+        }
+#endif
+        return TRUE;
+}
 
-                worker = (CsdSmartcardManagerWorker *) node->data;
-                next_node = node->next;
+static void
+csd_smartcard_manager_stop_watching_for_readers (CsdSmartcardManager *manager)
+{
+#ifdef HAVE_GUDEV
+        if (manager->priv->readers_timeout_id != 0) {
+                g_source_remove (manager->priv->readers_timeout_id);
+                manager->priv->readers_timeout_id = 0;
+        }
 
-                stop_worker (worker);
+        if (manager->priv->udev_client != NULL) {
+                g_signal_handlers_disconnect_by_func (manager->priv->udev_client,
+                                                      on_reader_uevent,
+                                                      manager);
+                g_object_unref (manager->priv->udev_client);
+                manager->priv->udev_client = NULL;
+        }
 
-                node = next_node;
+        if (manager->priv->readers != NULL) {
+                g_hash_table_destroy (manager->priv->readers);
+                manager->priv->readers = NULL;
         }
+#endif
 }
 
 static gboolean
@@ -832,23 +1213,25 @@ csd_smartcard_manager_get_all_cards (CsdSmartcardManager *manager)
         GList *node;
         int i;
 
-        node = manager->priv->workers;
+        /* by module rather than by worker, there are none until a reader
+         * is plugged in */
+        node = manager->priv->modules;
         while (node != NULL) {
 
-                CsdSmartcardManagerWorker *worker;
+                SECMODModule *module;
 
-                worker = (CsdSmartcardManagerWorker *) node->data;
+                module = (SECMODModule *) node->data;
 
-                for (i = 0; i < worker->module->slotCount; i++) {
+                for (i = 0; i < module->slotCount; i++) {
                         CsdSmartcard *card;
                         CK_SLOT_ID    slot_id;
                         int          slot_series;
                         char         *card_name;
 
-                        slot_id = PK11_GetSlotID (worker->module->slots[i]);
-                        slot_series = PK11_GetSlotSeries (worker->module->slots[i]);
+                        slot_id = PK11_GetSlotID (module->slots[i]);
+                        slot_series = PK11_GetSlotSeries (module->slots[i]);
 
-                        card = _csd_smartcard_new (worker->module,
+                        card = _csd_smartcard_new (module,
                                                    slot_id, slot_series);
 
                         card_name = csd_smartcard_get_name (card);
@@ -865,8 +1248,6 @@ start_worker (CsdSmartcardManager  *manager,
               SECMODModule         *module,
               GError              **error)
 {
-        GIOChannel *io_channel;
-        GSource *source;
         CsdSmartcardManagerWorker *worker;
 
         worker = csd_smartcard_manager_create_worker (manager, module);
@@ -877,27 +1258,8 @@ start_worker (CsdSmartcardManager  *manager,
                              CSD_SMARTCARD_MANAGER_ERROR_WATCHING_FOR_EVENTS,
                              _("could not watch for incoming card events - %s"),
                              g_strerror (errno));
-
-                goto out;
         }
 
-        io_channel = g_io_channel_unix_new (worker->manager_fd);
-
-        source = g_io_create_watch (io_channel, G_IO_IN | G_IO_HUP);
-        g_io_channel_unref (io_channel);
-        io_channel = NULL;
-
-        worker->event_source = source;
-
-        g_source_set_callback (worker->event_source,
-                               (GSourceFunc) (GIOFunc)
-                               csd_smartcard_manager_check_for_and_process_events,
-                               worker,
-                               (GDestroyNotify)
-                               csd_smartcard_manager_event_processing_stopped_handler);
-        g_source_attach (worker->event_source, NULL);
-        g_source_unref (worker->event_source);
-out:
         return worker;
 }
 
@@ -914,6 +1276,10 @@ start_workers (CsdSmartcardManager *manager)
 
                 module = (SECMODModule *) node->data;
 
+                /* pick up slots of readers plugged in since the module
+                 * was loaded */
+                SECMOD_UpdateSlotList (module);
+
                 error = NULL;
                 worker = start_worker (manager, module, &error);
                 if (worker == NULL) {
@@ -947,6 +1313,10 @@ csd_smartcard_manager_start (CsdSmartcardManager  *manager,
         }
         manager->priv->nss_is_loaded = TRUE;
 
+        if (manager->priv->event_queue == NULL) {
+                manager->priv->event_queue = csd_smartcard_manager_event_queue_new (manager);
+        }
+
         if (manager->priv->modules == NULL) {
                 if (!load_driver (manager, manager->priv->module_path, &nss_error)) {
                         g_propagate_error (error, nss_error);
@@ -954,7 +1324,12 @@ csd_smartcard_manager_start (CsdSmartcardManager  *manager,
                 }
         }
 
-        start_workers (manager);
+        if (!csd_smartcard_manager_start_watching_for_readers (manager) ||
+            csd_smartcard_manager_has_readers (manager)) {
+                start_workers (manager);
+        } else {
+                g_debug ("no smartcard reader plugged in, not watching for card events yet");
+        }
 
         /* populate the hash with cards that are already inserted
          */
@@ -982,8 +1357,17 @@ csd_smartcard_manager_stop_now (CsdSmartcardManager *manager)
                 return FALSE;
         }
 
+        csd_smartcard_manager_stop_watching_for_readers (manager);
         csd_smartcard_manager_stop_watching_for_events (manager);
 
+        if (manager->priv->event_queue != NULL) {
+                csd_smartcard_manager_event_queue_close (manager->priv->event_queue);
+                manager->priv->event_queue = NULL;
+        }
+        g_hash_table_remove_all (manager->priv->slots);
+
+        stop_manager (manager);
+
         return FALSE;
 }
 
@@ -1039,229 +1423,63 @@ csd_smartcard_manager_login_card_is_inserted (CsdSmartcardManager *manager)
 }
 
 static CsdSmartcardManagerWorker *
-csd_smartcard_manager_worker_new (CsdSmartcardManager *manager,
-                                  int                 worker_fd,
-                                  int                 manager_fd,
-                                  SECMODModule        *module)
+csd_smartcard_manager_worker_new (CsdSmartcardManager           *manager,
+                                  CsdSmartcardManagerEventQueue *event_queue,
+                                  SECMODModule                  *module)
 {
         CsdSmartcardManagerWorker *worker;
 
         worker = g_slice_new0 (CsdSmartcardManagerWorker);
+        worker->ref_count = 1;
         worker->manager = manager;
-        worker->fd = worker_fd;
-        worker->manager_fd = manager_fd;
-        worker->module = module;
-
-        worker->smartcards =
-                g_hash_table_new_full ((GHashFunc) slot_id_hash,
-                                       (GEqualFunc) slot_id_equal,
-                                       (GDestroyNotify) g_free,
-                                       (GDestroyNotify) g_object_unref);
+        worker->event_queue = csd_smartcard_manager_event_queue_ref (event_queue);
+        worker->module = SECMOD_ReferenceModule (module);
 
         return worker;
 }
 
-static void
-csd_smartcard_manager_worker_free (CsdSmartcardManagerWorker *worker)
-{
-        if (worker->smartcards != NULL) {
-                g_hash_table_destroy (worker->smartcards);
-                worker->smartcards = NULL;
-        }
-
-        g_slice_free (CsdSmartcardManagerWorker, worker);
-}
-
-static gboolean
-read_bytes (int      fd,
-            gpointer bytes,
-            gsize    num_bytes)
-{
-        size_t bytes_left;
-        size_t total_bytes_read;
-        ssize_t bytes_read;
-
-        bytes_left = (size_t) num_bytes;
-        total_bytes_read = 0;
-
-        do {
-                bytes_read = read (fd,
-                                   (char *) bytes + total_bytes_read,
-                                   bytes_left);
-                g_assert (bytes_read <= (ssize_t) bytes_left);
-
-                if (bytes_read <= 0) {
-                        if ((bytes_read < 0) && (errno == EINTR || errno == EAGAIN)) {
-                                continue;
-                        }
-
-                        bytes_left = 0;
-                } else {
-                        bytes_left -= bytes_read;
-                        total_bytes_read += bytes_read;
-                }
-        } while (bytes_left > 0);
-
-        if (total_bytes_read <  (size_t) num_bytes) {
-                return FALSE;
-        }
-
-        return TRUE;
-}
-
-static gboolean
-write_bytes (int           fd,
-             gconstpointer bytes,
-             gsize         num_bytes)
-{
-        size_t bytes_left;
-        size_t total_bytes_written;
-        ssize_t bytes_written;
-
-        bytes_left = (size_t) num_bytes;
-        total_bytes_written = 0;
-
-        do {
-                bytes_written = write (fd,
-                                       (char *) bytes + total_bytes_written,
-                                       bytes_left);
-                g_assert (bytes_written <= (ssize_t) bytes_left);
-
-                if (bytes_written <= 0) {
-                        if ((bytes_written < 0) && (errno == EINTR || errno == EAGAIN)) {
-                                continue;
-                        }
-
-                        bytes_left = 0;
-                } else {
-                        bytes_left -= bytes_written;
-                        total_bytes_written += bytes_written;
-                }
-        } while (bytes_left > 0);
-
-        if (total_bytes_written <  (size_t) num_bytes) {
-                return FALSE;
-        }
-
-        return TRUE;
-}
-
-static CsdSmartcard *
-read_smartcard (int           fd,
-                SECMODModule *module)
-{
-        CsdSmartcard *card;
-        char *card_name;
-        gsize card_name_size;
-
-        card_name_size = 0;
-        if (!read_bytes (fd, &card_name_size, sizeof (card_name_size))) {
-                return NULL;
-        }
-
-        card_name = g_slice_alloc0 (card_name_size);
-        if (!read_bytes (fd, card_name, card_name_size)) {
-                g_slice_free1 (card_name_size, card_name);
-                return NULL;
-        }
-        card = _csd_smartcard_new_from_name (module, card_name);
-        g_slice_free1 (card_name_size, card_name);
-
-        return card;
-}
-
-static gboolean
-write_smartcard (int          fd,
-                    CsdSmartcard *card)
-{
-        gsize card_name_size;
-        char *card_name;
-
-        card_name = csd_smartcard_get_name (card);
-        card_name_size = strlen (card_name) + 1;
-
-        if (!write_bytes (fd, &card_name_size, sizeof (card_name_size))) {
-                g_free (card_name);
-                return FALSE;
-        }
-
-        if (!write_bytes (fd, card_name, card_name_size)) {
-                g_free (card_name);
-                return FALSE;
-        }
-        g_free (card_name);
-
-        return TRUE;
-}
-
-static gboolean
-csd_smartcard_manager_worker_emit_smartcard_removed (CsdSmartcardManagerWorker  *worker,
-                                                     CsdSmartcard               *card,
-                                                     GError                    **error)
+static CsdSmartcardManagerWorker *
+csd_smartcard_manager_worker_ref (CsdSmartcardManagerWorker *worker)
 {
-        g_debug ("card '%s' removed!", csd_smartcard_get_name (card));
-
-        if (!write_bytes (worker->fd, "R", 1)) {
-                goto error_out;
-        }
+        g_atomic_int_inc (&worker->ref_count);
 
-        if (!write_smartcard (worker->fd, card)) {
-                goto error_out;
-        }
-
-        return TRUE;
-
-error_out:
-        g_set_error (error, CSD_SMARTCARD_MANAGER_ERROR,
-                     CSD_SMARTCARD_MANAGER_ERROR_REPORTING_EVENTS,
-                     "%s", g_strerror (errno));
-        return FALSE;
+        return worker;
 }
 
-static gboolean
-csd_smartcard_manager_worker_emit_smartcard_inserted (CsdSmartcardManagerWorker  *worker,
-                                                      CsdSmartcard               *card,
-                                                      GError                    **error)
+/* The worker is shared by the manager and its thread, whichever lets
+ * go last frees it */
+static void
+csd_smartcard_manager_worker_unref (CsdSmartcardManagerWorker *worker)
 {
-        g_debug ("card '%s' inserted!", csd_smartcard_get_name (card));
-        if (!write_bytes (worker->fd, "I", 1)) {
-                goto error_out;
-        }
-
-        if (!write_smartcard (worker->fd, card)) {
-                goto error_out;
+        if (!g_atomic_int_dec_and_test (&worker->ref_count)) {
+                return;
         }
 
-        return TRUE;
+        csd_smartcard_manager_event_queue_unref (worker->event_queue);
+        SECMOD_DestroyModule (worker->module);
 
-error_out:
-        g_set_error (error, CSD_SMARTCARD_MANAGER_ERROR,
-                     CSD_SMARTCARD_MANAGER_ERROR_REPORTING_EVENTS,
-                     "%s", g_strerror (errno));
-        return FALSE;
+        g_slice_free (CsdSmartcardManagerWorker, worker);
 }
 
 static gboolean
 csd_smartcard_manager_worker_watch_for_and_process_event (CsdSmartcardManagerWorker  *worker,
                                                           GError                    **error)
 {
+        CsdSmartcardManagerEvent *event;
         PK11SlotInfo *slot;
-        CK_SLOT_ID slot_id, *key = NULL;
-        int slot_series, card_slot_series;
-        CsdSmartcard *card;
-        GError *processing_error;
-        gboolean ret;
 
         g_debug ("waiting for card event");
-        ret = FALSE;
-
-        slot = SECMOD_WaitForAnyTokenEvent (worker->module, 0, PR_SecondsToInterval (1));
 
-        processing_error = NULL;
+        slot = SECMOD_WaitForAnyTokenEvent (worker->module, 0, CSD_SMARTCARD_MANAGER_POLL_INTERVAL);
 
         if (slot == NULL) {
                 int error_code;
 
+                if (g_atomic_int_get (&worker->cancelled)) {
+                        g_debug ("stopped waiting for card events");
+                        return FALSE;
+                }
+
                 error_code = PORT_GetError ();
                 if ((error_code == 0) || (error_code == SEC_ERROR_NO_EVENT)) {
                         g_debug ("spurious event occurred");
@@ -1275,105 +1493,26 @@ csd_smartcard_manager_worker_watch_for_and_process_event (CsdSmartcardManagerWor
                              CSD_SMARTCARD_MANAGER_ERROR_WITH_NSS,
                              _("encountered unexpected error while "
                                "waiting for smartcard events"));
-                goto out;
+                return FALSE;
         }
 
-        /* the slot id and series together uniquely identify a card.
-         * You can never have two cards with the same slot id at the
-         * same time, however (I think), so we can key off of it.
+        /* the main thread makes sense of the event, the slot is only
+         * looked at here since checking for a token can block
          */
-        slot_id = PK11_GetSlotID (slot);
-        slot_series = PK11_GetSlotSeries (slot);
-
-        /* First check to see if there is a card that we're currently
-         * tracking in the slot.
-         */
-        key = g_new (CK_SLOT_ID, 1);
-        *key = slot_id;
-        card = g_hash_table_lookup (worker->smartcards, key);
-
-        if (card != NULL) {
-                card_slot_series = csd_smartcard_get_slot_series (card);
-        } else {
-                card_slot_series = -1;
-        }
-
-        if (PK11_IsPresent (slot)) {
-                /* Now, check to see if their is a new card in the slot.
-                 * If there was a different card in the slot now than
-                 * there was before, then we need to emit a removed signal
-                 * for the old card (we don't want unpaired insertion events).
-                 */
-                if ((card != NULL) &&
-                    card_slot_series != slot_series) {
-                        if (!csd_smartcard_manager_worker_emit_smartcard_removed (worker, card, &processing_error)) {
-                                g_propagate_error (error, processing_error);
-                                goto out;
-                        }
-                }
-
-                card = _csd_smartcard_new (worker->module,
-                                           slot_id, slot_series);
+        event = g_slice_new0 (CsdSmartcardManagerEvent);
+        event->module = SECMOD_ReferenceModule (worker->module);
+        event->slot_id = PK11_GetSlotID (slot);
+        event->slot_series = PK11_GetSlotSeries (slot);
+        event->is_present = PK11_IsPresent (slot);
 
-                g_hash_table_replace (worker->smartcards,
-                                      key, card);
-                key = NULL;
+        g_debug ("slot %lu had event, card %s", (gulong) event->slot_id,
+                 event->is_present ? "present" : "absent");
 
-                if (!csd_smartcard_manager_worker_emit_smartcard_inserted (worker, card, &processing_error)) {
-                        g_propagate_error (error, processing_error);
-                        goto out;
-                }
-        } else {
-                /* if we aren't tracking the card, just discard the event.
-                 * We don't want unpaired remove events.  Note on startup
-                 * NSS will generate an "insertion" event if a card is
-                 * already inserted in the slot.
-                 */
-                if ((card != NULL)) {
-                        /* FIXME: i'm not sure about this code.  Maybe we
-                         * shouldn't do this at all, or maybe we should do it
-                         * n times (where n = slot_series - card_slot_series + 1)
-                         *
-                         * Right now, i'm just doing it once.
-                         */
-                        if ((slot_series - card_slot_series) > 1) {
-
-                                if (!csd_smartcard_manager_worker_emit_smartcard_removed (worker, card, &processing_error)) {
-                                        g_propagate_error (error, processing_error);
-                                        goto out;
-                                }
-                                g_hash_table_remove (worker->smartcards, key);
-
-                                card = _csd_smartcard_new (worker->module,
-                                                                slot_id, slot_series);
-                                g_hash_table_replace (worker->smartcards,
-                                                      key, card);
-                                key = NULL;
-                                if (!csd_smartcard_manager_worker_emit_smartcard_inserted (worker, card, &processing_error)) {
-                                        g_propagate_error (error, processing_error);
-                                        goto out;
-                                }
-                        }
-
-                        if (!csd_smartcard_manager_worker_emit_smartcard_removed (worker, card, &processing_error)) {
-                                g_propagate_error (error, processing_error);
-                                goto out;
-                        }
+        csd_smartcard_manager_event_queue_push (worker->event_queue, event);
 
-                        g_hash_table_remove (worker->smartcards, key);
-                        card = NULL;
-                } else {
-                        g_debug ("got spurious remove event");
-                }
-        }
-
-        ret = TRUE;
-
-out:
-        g_free (key);
         PK11_FreeSlot (slot);
 
-        return ret;
+        return TRUE;
 }
 
 static void
@@ -1387,14 +1526,20 @@ csd_smartcard_manager_worker_run (CsdSmartcardManagerWorker *worker)
                 error = NULL;
                 should_continue = csd_smartcard_manager_worker_watch_for_and_process_event (worker, &error);
         }
-        while (should_continue);
+        while (should_continue && !g_atomic_int_get (&worker->cancelled));
 
         if (error != NULL)  {
+                CsdSmartcardManagerEvent *event;
+
                 g_debug ("could not process card event - %s", error->message);
-                g_error_free (error);
+
+                event = g_slice_new0 (CsdSmartcardManagerEvent);
+                event->module = SECMOD_ReferenceModule (worker->module);
+                event->error = error;
+                csd_smartcard_manager_event_queue_push (worker->event_queue, event);
         }
 
-        csd_smartcard_manager_worker_free (worker);
+        csd_smartcard_manager_worker_unref (worker);
 }
 
 static CsdSmartcardManagerWorker *
@@ -1402,25 +1547,19 @@ csd_smartcard_manager_create_worker (CsdSmartcardManager  *manager,
                                      SECMODModule         *module)
 {
         CsdSmartcardManagerWorker *worker;
-        int write_fd, read_fd;
-
-        write_fd = -1;
-        read_fd = -1;
-        if (!open_pipe (&write_fd, &read_fd)) {
-                return NULL;
-        }
 
         worker = csd_smartcard_manager_worker_new (manager,
-                                                   write_fd,
-                                                   read_fd,
+                                                   manager->priv->event_queue,
                                                    module);
 
         worker->thread = g_thread_create ((GThreadFunc)
                                           csd_smartcard_manager_worker_run,
-                                          worker, FALSE, NULL);
+                                          csd_smartcard_manager_worker_ref (worker),
+                                          FALSE, NULL);
 
         if (worker->thread == NULL) {
-                csd_smartcard_manager_worker_free (worker);
+                csd_smartcard_manager_worker_unref (worker);
+                csd_smartcard_manager_worker_unref (worker);
                 return NULL;
         }
 
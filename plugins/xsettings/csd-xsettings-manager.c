@@ -271,6 +271,12 @@ struct CinnamonSettingsXSettingsManagerPrivate
         guint              device_removed_id;
 
         guint              notify_idle_id;
+
+        /* RESOURCE_MANAGER as last written by us, split into resources,
+         * and the 1-based index of each key in xresources_lines */
+        gchar             *xresources_last;
+        GHashTable        *xresources;
+        GPtrArray         *xresources_lines;
 };
 
 #define CSD_XSETTINGS_ERROR csd_xsettings_error_quark ()
@@ -727,72 +733,161 @@ xft_settings_set_xsettings (CinnamonSettingsXSettingsManager *manager,
         cinnamon_settings_profile_end (NULL);
 }
 
+/* Replaces the line of @key, or appends one if there is none yet */
 static void
-update_property (GString *props, const gchar* key, const gchar* value)
+xresources_set (CinnamonSettingsXSettingsManager *manager,
+                const gchar                      *key,
+                const gchar                      *value)
 {
-        gchar* needle;
-        size_t needle_len;
-        gchar* found = NULL;
-
-        /* update an existing property */
-        needle = g_strconcat (key, ":", NULL);
-        needle_len = strlen (needle);
-        if (g_str_has_prefix (props->str, needle))
-                found = props->str;
-        else 
-            found = strstr (props->str, needle);
-
-        if (found) {
-                size_t value_index;
-                gchar* end;
-
-                end = strchr (found, '\n');
-                value_index = (found - props->str) + needle_len + 1;
-                g_string_erase (props, value_index, end ? (end - found - needle_len) : -1);
-                g_string_insert (props, value_index, "\n");
-                g_string_insert (props, value_index, value);
-        } else {
-                g_string_append_printf (props, "%s:\t%s\n", key, value);
+        gpointer index;
+        gchar *line;
+
+        line = g_strdup_printf ("%s:\t%s", key, value);
+
+        if (g_hash_table_lookup_extended (manager->priv->xresources, key, NULL, &index)) {
+                guint i = GPOINTER_TO_UINT (index) - 1;
+
+                g_free (g_ptr_array_index (manager->priv->xresources_lines, i));
+                g_ptr_array_index (manager->priv->xresources_lines, i) = line;
+                return;
+        }
+
+        g_ptr_array_add (manager->priv->xresources_lines, line);
+        g_hash_table_replace (manager->priv->xresources, g_strdup (key),
+                              GUINT_TO_POINTER (manager->priv->xresources_lines->len));
+}
+
+/* Finds the end of the resource starting at @line, xrdb writes multi-line
+ * values with backslash-newline continuations */
+static const gchar *
+xresources_find_line_end (const gchar *line)
+{
+        const gchar *end;
+        const gchar *p;
+
+        for (end = strchr (line, '\n'); end != NULL; end = strchr (end + 1, '\n')) {
+                /* an even number of backslashes escape each other */
+                for (p = end; p > line && p[-1] == '\\'; p--);
+                if ((end - p) % 2 == 0)
+                        return end;
+        }
+
+        return line + strlen (line);
+}
+
+/* Splits RESOURCE_MANAGER into resources, keeping their order and their
+ * exact bytes so that the ones we don't set are written back unchanged.
+ * The key of every "key:value" resource is indexed so ours can be
+ * replaced in place. */
+static void
+xresources_parse (CinnamonSettingsXSettingsManager *manager,
+                  const gchar                      *props)
+{
+        const gchar *line;
+        const gchar *end;
+        const gchar *colon;
+
+        g_hash_table_remove_all (manager->priv->xresources);
+        g_ptr_array_set_size (manager->priv->xresources_lines, 0);
+
+        for (line = props; line != NULL && *line != '\0'; line = *end ? end + 1 : end) {
+                end = xresources_find_line_end (line);
+                if (end == line)
+                        continue;
+
+                g_ptr_array_add (manager->priv->xresources_lines,
+                                 g_strndup (line, end - line));
+
+                colon = memchr (line, ':', end - line);
+                if (colon != NULL)
+                        g_hash_table_replace (manager->priv->xresources,
+                                              g_strndup (line, colon - line),
+                                              GUINT_TO_POINTER (manager->priv->xresources_lines->len));
+        }
+}
+
+static GString *
+xresources_serialize (CinnamonSettingsXSettingsManager *manager)
+{
+        GString *props;
+        guint i;
+
+        props = g_string_sized_new (1024);
+        for (i = 0; i < manager->priv->xresources_lines->len; i++) {
+                g_string_append (props, g_ptr_array_index (manager->priv->xresources_lines, i));
+                g_string_append_c (props, '\n');
         }
+        return props;
+}
 
-	g_free (needle);
+static gchar *
+xresources_read_property (Display *dpy)
+{
+        Atom type;
+        int format;
+        unsigned long n_items;
+        unsigned long bytes_after;
+        unsigned char *data = NULL;
+        gchar *props = NULL;
+        int result;
+
+        gdk_x11_display_error_trap_push (gdk_display_get_default ());
+        result = XGetWindowProperty (dpy, RootWindow (dpy, 0),
+                                     XA_RESOURCE_MANAGER, 0, G_MAXLONG, False,
+                                     XA_STRING, &type, &format, &n_items,
+                                     &bytes_after, &data);
+        gdk_x11_display_error_trap_pop_ignored (gdk_display_get_default ());
+
+        if (result == Success && type == XA_STRING && format == 8 && data != NULL)
+                props = g_strndup ((const gchar *) data, n_items);
+        if (data != NULL)
+                XFree (data);
+        return props;
 }
 
 static void
-xft_settings_set_xresources (CinnamonSettingsXftSettings *settings)
+xft_settings_set_xresources (CinnamonSettingsXSettingsManager *manager,
+                             CinnamonSettingsXftSettings      *settings)
 {
         GString    *add_string;
+        gchar      *orig;
         char        dpibuf[G_ASCII_DTOSTR_BUF_SIZE];
         Display    *dpy;
 
         cinnamon_settings_profile_start (NULL);
 
-        /* get existing properties */
-        dpy = XOpenDisplay (NULL);
-        g_return_if_fail (dpy != NULL);
-        add_string = g_string_new (XResourceManagerString (dpy));
+        /* get existing properties over our own connection, and only parse
+         * them again if somebody else changed them since we last did */
+        dpy = gdk_x11_display_get_xdisplay (gdk_display_get_default ());
+        orig = xresources_read_property (dpy);
+        if (manager->priv->xresources_last == NULL ||
+            g_strcmp0 (orig, manager->priv->xresources_last) != 0)
+                xresources_parse (manager, orig);
 
-        g_debug("xft_settings_set_xresources: orig res '%s'", add_string->str);
+        g_debug("xft_settings_set_xresources: orig res '%s'", orig);
 
         g_snprintf (dpibuf, sizeof (dpibuf), "%d", (int) (settings->scaled_dpi / 1024.0 + 0.5));
-        update_property (add_string, "Xft.dpi", dpibuf);
-        update_property (add_string, "Xft.antialias",
-                                settings->antialias ? "1" : "0");
-        update_property (add_string, "Xft.hinting",
-                                settings->hinting ? "1" : "0");
-        update_property (add_string, "Xft.hintstyle",
-                                settings->hintstyle);
-        update_property (add_string, "Xft.rgba",
-                                settings->rgba);
+        xresources_set (manager, "Xft.dpi", dpibuf);
+        xresources_set (manager, "Xft.antialias",
+                        settings->antialias ? "1" : "0");
+        xresources_set (manager, "Xft.hinting",
+                        settings->hinting ? "1" : "0");
+        xresources_set (manager, "Xft.hintstyle",
+                        settings->hintstyle);
+        xresources_set (manager, "Xft.rgba",
+                        settings->rgba);
+        add_string = xresources_serialize (manager);
 
         g_debug("xft_settings_set_xresources: new res '%s'", add_string->str);
 
         /* Set the new X property */
-        XChangeProperty(dpy, RootWindow (dpy, 0),
-                        XA_RESOURCE_MANAGER, XA_STRING, 8, PropModeReplace, (const unsigned char *) add_string->str, add_string->len);
-        XCloseDisplay (dpy);
+        if (g_strcmp0 (orig, add_string->str) != 0)
+                XChangeProperty(dpy, RootWindow (dpy, 0),
+                                XA_RESOURCE_MANAGER, XA_STRING, 8, PropModeReplace, (const unsigned char *) add_string->str, add_string->len);
 
-        g_string_free (add_string, TRUE);
+        g_free (manager->priv->xresources_last);
+        manager->priv->xresources_last = g_string_free (add_string, FALSE);
+        g_free (orig);
 
         cinnamon_settings_profile_end (NULL);
 }
@@ -809,7 +904,7 @@ update_xft_settings (CinnamonSettingsXSettingsManager *manager)
 
         xft_settings_get (manager, &settings);
         xft_settings_set_xsettings (manager, &settings);
-        xft_settings_set_xresources (&settings);
+        xft_settings_set_xresources (manager, &settings);
 
         cinnamon_settings_profile_end (NULL);
 }
@@ -1434,6 +1529,10 @@ cinnamon_xsettings_manager_stop (CinnamonSettingsXSettingsManager *manager)
         }
 
         g_clear_object (&manager->priv->interface_settings);
+
+        g_clear_pointer (&manager->priv->xresources_last, g_free);
+        g_hash_table_remove_all (manager->priv->xresources);
+        g_ptr_array_set_size (manager->priv->xresources_lines, 0);
 }
 
 static GObject *
@@ -1473,6 +1572,10 @@ cinnamon_xsettings_manager_init (CinnamonSettingsXSettingsManager *manager)
         if (!manager->priv->dbus_connection) {
                 g_error ("Failed to get session bus: %s", error->message);
         }
+
+        manager->priv->xresources = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                           g_free, NULL);
+        manager->priv->xresources_lines = g_ptr_array_new_with_free_func (g_free);
 }
 
 static void
@@ -1493,6 +1596,8 @@ cinnamon_xsettings_manager_finalize (GObject *object)
         }
 
         g_clear_object (&xsettings_manager->priv->dbus_connection);
+        g_clear_pointer (&xsettings_manager->priv->xresources, g_hash_table_destroy);
+        g_clear_pointer (&xsettings_manager->priv->xresources_lines, g_ptr_array_unref);
 
         G_OBJECT_CLASS (cinnamon_xsettings_manager_parent_class)->finalize (object);
 }
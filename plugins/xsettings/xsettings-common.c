@@ -67,13 +67,14 @@ xsettings_setting_get (XSettingsSetting *setting)
   return NULL;
 }
 
-void
+gboolean
 xsettings_setting_set (XSettingsSetting *setting,
                        gint              tier,
                        GVariant         *value,
                        guint32           serial)
 {
   GVariant *old_value;
+  gboolean changed = FALSE;
 
   old_value = xsettings_setting_get (setting);
   if (old_value)
@@ -84,10 +85,15 @@ xsettings_setting_set (XSettingsSetting *setting,
   setting->value[tier] = value ? g_variant_ref_sink (value) : NULL;
 
   if (!xsettings_variant_equal0 (old_value, xsettings_setting_get (setting)))
-    setting->last_change_serial = serial;
+    {
+      setting->last_change_serial = serial;
+      changed = TRUE;
+    }
 
   if (old_value)
     g_variant_unref (old_value);
+
+  return changed;
 }
 
 void
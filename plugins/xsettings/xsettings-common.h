@@ -50,11 +50,16 @@ struct _XSettingsSetting
   char *name;
   GVariant *value[XSETTINGS_N_TIERS];
   unsigned long last_change_serial;
+
+  /* where the encoded setting lives in the manager's property buffer,
+   * encoded_length is 0 until it has been serialized once */
+  gsize encoded_offset;
+  gsize encoded_length;
 };
 
 XSettingsSetting *xsettings_setting_new   (const gchar      *name);
 GVariant *        xsettings_setting_get   (XSettingsSetting *setting);
-void              xsettings_setting_set   (XSettingsSetting *setting,
+gboolean          xsettings_setting_set   (XSettingsSetting *setting,
                                            gint              tier,
                                            GVariant         *value,
                                            guint32           serial);
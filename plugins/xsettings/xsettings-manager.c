@@ -48,8 +48,18 @@ struct _XSettingsManager
   unsigned long serial;
 
   GVariant *overrides;
+
+  /* the _XSETTINGS_SETTINGS property as last published, patched in place
+   * on notify; see xsettings_manager_notify() */
+  GString *buffer;
+  GString *scratch;
+  GHashTable *dirty;
+  gboolean buffer_changed;
 };
 
+/* byte order, padding, serial and number of settings */
+#define XSETTINGS_HEADER_LENGTH 12
+
 typedef struct 
 {
   Window window;
@@ -148,6 +158,14 @@ xsettings_manager_new (Display                *display,
   manager->serial = 0;
   manager->overrides = NULL;
 
+  manager->buffer = g_string_sized_new (4096);
+  g_string_append_c (manager->buffer, xsettings_byte_order ());
+  g_string_append_len (manager->buffer, "\0\0\0", 3);
+  g_string_append_len (manager->buffer, "\0\0\0\0\0\0\0\0", 8);
+  manager->scratch = g_string_new (NULL);
+  manager->dirty = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  manager->buffer_changed = TRUE;
+
   manager->window = XCreateSimpleWindow (display,
 					 RootWindow (display, screen),
 					 0, 0, 10, 10, 0,
@@ -194,10 +212,49 @@ xsettings_manager_destroy (XSettingsManager *manager)
   XDestroyWindow (manager->display, manager->window);
 
   g_hash_table_unref (manager->settings);
+  g_hash_table_unref (manager->dirty);
+  g_string_free (manager->buffer, TRUE);
+  g_string_free (manager->scratch, TRUE);
 
   g_slice_free (XSettingsManager, manager);
 }
 
+/* Replaces @old_length bytes at @offset of the property buffer with
+ * @data, moving every setting stored after it. */
+static void
+buffer_splice (XSettingsManager *manager,
+               gsize             offset,
+               gsize             old_length,
+               const gchar      *data,
+               gsize             new_length)
+{
+  GHashTableIter iter;
+  gpointer value;
+  XSettingsSetting *other;
+
+  if (old_length == 0 && new_length == 0)
+    return;
+
+  manager->buffer_changed = TRUE;
+
+  if (old_length == new_length)
+    {
+      memcpy (manager->buffer->str + offset, data, new_length);
+      return;
+    }
+
+  g_string_erase (manager->buffer, offset, old_length);
+  g_string_insert_len (manager->buffer, offset, data, new_length);
+
+  g_hash_table_iter_init (&iter, manager->settings);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      other = value;
+      if (other->encoded_length > 0 && other->encoded_offset > offset)
+        other->encoded_offset = other->encoded_offset + new_length - old_length;
+    }
+}
+
 static void
 xsettings_manager_set_setting (XSettingsManager *manager,
                                const gchar      *name,
@@ -215,10 +272,15 @@ xsettings_manager_set_setting (XSettingsManager *manager,
       g_hash_table_insert (manager->settings, setting->name, setting);
     }
 
-  xsettings_setting_set (setting, tier, value, manager->serial);
+  if (xsettings_setting_set (setting, tier, value, manager->serial))
+    g_hash_table_add (manager->dirty, g_strdup (name));
 
   if (xsettings_setting_get (setting) == NULL)
-    g_hash_table_remove (manager->settings, name);
+    {
+      buffer_splice (manager, setting->encoded_offset, setting->encoded_length, NULL, 0);
+      g_hash_table_remove (manager->dirty, name);
+      g_hash_table_remove (manager->settings, name);
+    }
 }
 
 void
@@ -322,34 +384,62 @@ setting_store (XSettingsSetting *setting,
     g_string_append_len (buffer, g_variant_get_data (value), g_variant_get_size (value));
 }
 
+/**
+ * xsettings_manager_notify:
+ * @manager: a #XSettingsManager
+ *
+ * Publishes the settings changed since the last call. Only those are
+ * encoded again, everything else is kept from the previous property
+ * contents. Nothing is sent to the X server if no setting changed.
+ **/
 void
 xsettings_manager_notify (XSettingsManager *manager)
 {
-  GString *buffer;
   GHashTableIter iter;
-  int n_settings;
-  gpointer value;
+  gpointer key;
+  XSettingsSetting *setting;
+  guint32 header[2];
+  guint n_changed = 0;
+  gsize n_bytes = 0;
 
-  n_settings = g_hash_table_size (manager->settings);
+  g_hash_table_iter_init (&iter, manager->dirty);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      setting = g_hash_table_lookup (manager->settings, key);
+      if (setting == NULL)
+        continue;
 
-  buffer = g_string_new (NULL);
-  g_string_append_c (buffer, xsettings_byte_order ());
-  g_string_append_c (buffer, '\0');
-  g_string_append_c (buffer, '\0');
-  g_string_append_c (buffer, '\0');
+      g_string_truncate (manager->scratch, 0);
+      setting_store (setting, manager->scratch);
 
-  g_string_append_len (buffer, (gchar *) &manager->serial, 4);
-  g_string_append_len (buffer, (gchar *) &n_settings, 4);
+      if (setting->encoded_length == 0)
+        setting->encoded_offset = manager->buffer->len;
+      buffer_splice (manager,
+                     setting->encoded_offset, setting->encoded_length,
+                     manager->scratch->str, manager->scratch->len);
+      setting->encoded_length = manager->scratch->len;
 
-  g_hash_table_iter_init (&iter, manager->settings);
-  while (g_hash_table_iter_next (&iter, NULL, &value))
-    setting_store (value, buffer);
+      n_changed++;
+      n_bytes += manager->scratch->len;
+    }
+  g_hash_table_remove_all (manager->dirty);
+
+  if (!manager->buffer_changed)
+    return;
+
+  header[0] = manager->serial;
+  header[1] = g_hash_table_size (manager->settings);
+  memcpy (manager->buffer->str + 4, header, sizeof (header));
 
   XChangeProperty (manager->display, manager->window,
                    manager->xsettings_atom, manager->xsettings_atom,
-                   8, PropModeReplace, (guchar *) buffer->str, buffer->len);
+                   8, PropModeReplace, (guchar *) manager->buffer->str, manager->buffer->len);
+
+  g_debug ("XSETTINGS serial %lu: %u settings (%" G_GSIZE_FORMAT " bytes) changed, %"
+           G_GSIZE_FORMAT " bytes total",
+           manager->serial, n_changed, n_bytes, manager->buffer->len);
 
-  g_string_free (buffer, TRUE);
+  manager->buffer_changed = FALSE;
   manager->serial++;
 }
 